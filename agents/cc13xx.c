@@ -15,9 +15,15 @@
 // limitations under the License.
 
 #include <agent/flash.h>
+#include <agent/pack.h>
 #include "cc13xx-romapi.h"
 
+#define RAM_BASE	0x20000000
+#define RAM_SIZE	(16 * 1024) // smallest cc13xx part
+
 int flash_agent_setup(flash_agent *agent) {
+	// there's no sram size register, so use what every part has
+	agent->data_size = (RAM_BASE + RAM_SIZE - agent->data_addr) & (~0xFFF);
 	return ERR_NONE;
 }
 
@@ -51,7 +57,12 @@ int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length) {
 
 
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	switch (op) {
+	case OP_PACK:
+		return pack_words(ptr);
+	default:
+		return ERR_INVALID;
+	}
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
@@ -63,6 +74,7 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.data_size =	0x1000,
 	.flash_addr =	0x00000000,
 	.flash_size =	0x00020000,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
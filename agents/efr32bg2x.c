@@ -19,6 +19,8 @@
 #define FLASH_BASE	0x00000000
 
 #include <agent/flash.h>
+#include <agent/pack.h>
+#include <agent/crc32.h>
 #include <fw/io.h>
 
 #define CMU_CLKEN1_SET 0x40009068
@@ -34,10 +36,16 @@
 #define MSC_WDATA          0x40030018
 #define MSC_STATUS         0x4003001C
 
+#define DEVINFO_MSIZE      0x0FE0800C
+#define MSIZE_SRAM_KB(n)   (((n) >> 16) & 0x7FF)
+
+#define RAM_BASE           0x20000000
+
 #define MSC_WRITECTRL_WREN 1
 
-#define MSC_WRITECMD_WRITEND   (1U<<2)
-#define MSC_WRITECMD_ERASEPAGE (1U<<1)
+#define MSC_WRITECMD_ERASEMAIN0 (1U<<8)
+#define MSC_WRITECMD_WRITEND    (1U<<2)
+#define MSC_WRITECMD_ERASEPAGE  (1U<<1)
 
 #define MSC_STATUS_WREADY         (1U<<27)
 #define MSC_STATUS_PWRON          (1U<<24)
@@ -63,11 +71,31 @@ int flash_agent_setup(flash_agent *agent) {
 	// TODO: read from userdata
 	agent->flash_size = FLASH_SIZE;
 
+	// use all ram above the agent as the data buffer
+	unsigned ram_kb = MSIZE_SRAM_KB(readl(DEVINFO_MSIZE));
+	if ((ram_kb >= 16) && (ram_kb <= 1024)) {
+		agent->data_size = (RAM_BASE + ram_kb * 1024 - agent->data_addr) & (~0xFFF);
+	}
+
 	return ERR_NONE;
 }
 
-int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
+// set ADDRB and check that the MSC will accept a write or erase there
+static int msc_set_addr(uint32_t flash_addr) {
 	unsigned v;
+	writel(flash_addr, MSC_ADDRB);
+	v = readl(MSC_STATUS);
+	if (v & (MSC_STATUS_INVADDR | MSC_STATUS_LOCKED)) {
+		return ERR_INVALID;
+	}
+	if (!(v & MSC_STATUS_WREADY)) {
+		return ERR_FAIL;
+	}
+	return ERR_NONE;
+}
+
+// verification is left to the host (OP_CRC32), once, at the end
+int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
 	int status = ERR_NONE;
 	if (flash_addr > FLASH_SIZE) {
 		return ERR_INVALID;
@@ -78,15 +106,15 @@ int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
 
 	writel(CMU_CLKEN1_MSC, CMU_CLKEN1_SET);
 	writel(MSC_WRITECTRL_WREN, MSC_WRITECTRL_SET);
-	while (length > 0) {
-		writel(flash_addr, MSC_ADDRB);
-		v = readl(MSC_STATUS);
-		if (v & (MSC_STATUS_INVADDR | MSC_STATUS_LOCKED)) {
-			status = ERR_INVALID;
-			break;
+	if ((flash_addr == 0) && (length >= FLASH_SIZE)) {
+		if ((status = msc_set_addr(0)) == ERR_NONE) {
+			writel(MSC_WRITECMD_ERASEMAIN0, MSC_WRITECMD_SET);
+			while (readl(MSC_STATUS) & MSC_STATUS_BUSY) ;
 		}
-		if (!(v & MSC_STATUS_WREADY)) {
-			status = ERR_FAIL;
+		goto done;
+	}
+	while (length > 0) {
+		if ((status = msc_set_addr(flash_addr)) != ERR_NONE) {
 			break;
 		}
 		if (length > FLASH_PAGE_SIZE) {
@@ -96,12 +124,6 @@ int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
 		}
 		writel(MSC_WRITECMD_ERASEPAGE, MSC_WRITECMD_SET);
 		while (readl(MSC_STATUS) & MSC_STATUS_BUSY) ;
-		for (unsigned n = 0; n < FLASH_PAGE_SIZE; n += 4) {
-			if (readl(flash_addr + n) != 0xFFFFFFFF) {
-				status = ERR_FAIL;
-				goto done;
-			}
-		}
 		flash_addr += FLASH_PAGE_SIZE;
 	}
 done:
@@ -109,10 +131,12 @@ done:
 	return status;
 }
 
+// ADDRB is loaded once per page: the MSC advances the write
+// address itself as each WDATA word is accepted (WDATAREADY),
+// and WRITEEND finishes the burst
 int flash_agent_write(uint32_t flash_addr, const void *_data, uint32_t length) {
 	int status = ERR_NONE;
 	const unsigned *data = _data;
-	unsigned v;
 	if (flash_addr > FLASH_SIZE) {
 		return ERR_INVALID;
 	}
@@ -122,33 +146,38 @@ int flash_agent_write(uint32_t flash_addr, const void *_data, uint32_t length) {
 	writel(CMU_CLKEN1_MSC, CMU_CLKEN1_SET);
 	writel(MSC_WRITECTRL_WREN, MSC_WRITECTRL_SET);
 	while (length > 0) {
-		writel(flash_addr, MSC_ADDRB);
-		v = readl(MSC_STATUS);
-		if (v & (MSC_STATUS_INVADDR | MSC_STATUS_LOCKED)) {
-			status = ERR_INVALID;
+		unsigned room = FLASH_PAGE_SIZE - (flash_addr & (FLASH_PAGE_SIZE - 1));
+		unsigned xfer = (length > room) ? room : length;
+		if ((status = msc_set_addr(flash_addr)) != ERR_NONE) {
 			break;
 		}
-		if (!(v & MSC_STATUS_WREADY)) {
-			status = ERR_FAIL;
-			break;
+		length -= xfer;
+		flash_addr += xfer;
+		while (xfer > 0) {
+			while (!(readl(MSC_STATUS) & MSC_STATUS_WDATAREADY)) ;
+			writel(*data++, MSC_WDATA);
+			xfer -= 4;
 		}
-		writel(*data, MSC_WDATA);
+		writel(MSC_WRITECMD_WRITEND, MSC_WRITECMD_SET);
 		while (readl(MSC_STATUS) & MSC_STATUS_BUSY) ;
-		if (readl(flash_addr) != *data) {
-			status = ERR_FAIL;
-			goto done;
-		}
-		data++;
-		length -= 4;
-		flash_addr += 4;
 	}
-done:
 	writel(MSC_WRITECTRL_WREN, MSC_WRITECTRL_CLR);
 	return status;
 }
 
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	switch (op) {
+	case OP_CRC32:
+		if ((arg0 > FLASH_SIZE) || (arg1 > (FLASH_SIZE - arg0))) {
+			return ERR_INVALID;
+		}
+		*((uint32_t*) ptr) = crc32_update(0, (void*) arg0, arg1);
+		return ERR_NONE;
+	case OP_PACK:
+		return pack_words(ptr);
+	default:
+		return ERR_INVALID;
+	}
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
@@ -160,6 +189,7 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.data_size =	0x4000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	0,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
@@ -2,4 +2,7 @@
 #define FLASH_BASE	0x00000000
 #define FLASH_SIZE	0x00008000
 
+#define RAM_BASE	0x10000000
+#define RAM_SIZE	0x00002000
+
 #include "lpc13xx_lpc15xx.c"
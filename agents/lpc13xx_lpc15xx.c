@@ -15,6 +15,8 @@
 // limitations under the License.
 
 #include <agent/flash.h>
+#include <agent/pack.h>
+#include <fw/io.h>
 
 #ifdef ARCH_LPC15XX
 #define LPC_IAP_FUNC	0x03000205
@@ -26,15 +28,79 @@
 #define LPC_IAP_WRITE	51
 #define LPC_IAP_ERASE	52
 
+// IAP needs the core clock in kHz for flash timing
+// at reset both parts run from the 12MHz IRC
+static uint32_t cclk_khz = 12000;
+
 // Note that while the databook claims you can reuse the same array
 // for both parameters and results, this is a lie.  Attempting to 
 // do so causes an invalid command failure.
 
 
+#define SECTOR_SIZE	4096
+#define SECTOR(addr)	((addr) >> 12)
+
+// IAP runs with 32 bytes at the top of ram
+#define IAP_RAM_RSVD	32
+
+#ifdef ARCH_LPC15XX
+#define DEVICE_ID	0x400743F8
+
+// ram is contiguous from RAM_BASE, sized by part number
+static uint32_t ram_size(flash_agent *agent) {
+	switch (readl(DEVICE_ID)) {
+	case 0x1549: case 0x1519:
+		agent->flash_size = 256 * 1024;
+		return 36 * 1024;
+	case 0x1548: case 0x1518:
+		agent->flash_size = 128 * 1024;
+		return 20 * 1024;
+	case 0x1547: case 0x1517:
+		agent->flash_size = 64 * 1024;
+		return 12 * 1024;
+	default:
+		return 0;
+	}
+}
+#else
+static uint32_t ram_size(flash_agent *agent) {
+	return RAM_SIZE;
+}
+#endif
+
 int flash_agent_setup(flash_agent *agent) {
+	uint32_t sz = ram_size(agent);
+	if (sz) {
+		// use all ram above the agent, less the IAP scratch
+		// area, in whole sectors, as the data buffer
+		agent->data_size = (RAM_BASE + sz - IAP_RAM_RSVD - agent->data_addr) &
+			(~(SECTOR_SIZE - 1));
+	}
 	return ERR_NONE;
 }
 
+static int iap_prepare(uint32_t first, uint32_t last) {
+	void (*romcall)(uint32_t *, uint32_t *) = (void*) LPC_IAP_FUNC;
+	uint32_t p[5],r[4];
+	p[0] = LPC_IAP_PREPARE;
+	p[1] = first;
+	p[2] = last;
+	romcall(p,r);
+	return r[0];
+}
+
+static int iap_write(uint32_t flash_addr, const void *data, uint32_t count) {
+	void (*romcall)(uint32_t *, uint32_t *) = (void*) LPC_IAP_FUNC;
+	uint32_t p[5],r[4];
+	p[0] = LPC_IAP_WRITE;
+	p[1] = flash_addr;
+	p[2] = (uint32_t) data;
+	p[3] = count;
+	p[4] = cclk_khz;
+	romcall(p,r);
+	return r[0];
+}
+
 int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
 	void (*romcall)(uint32_t *, uint32_t *) = (void*) LPC_IAP_FUNC;
 	uint32_t p[5],r[4];
@@ -44,18 +110,14 @@ int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
 		return ERR_ALIGNMENT;
 	}
 
-	p[0] = LPC_IAP_PREPARE;
-	p[1] = page;
-	p[2] = last;
-	romcall(p,r);
-	if (r[0]) {
+	if (iap_prepare(page, last)) {
 		return ERR_FAIL;
 	}
 
 	p[0] = LPC_IAP_ERASE;
 	p[1] = page;
 	p[2] = last;
-	p[3] = 0x2ee0;
+	p[3] = cclk_khz;
 	romcall(p,r);
 	if (r[0]) {
 		return ERR_FAIL;
@@ -63,55 +125,152 @@ int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
 	return ERR_NONE;
 }
 
+// IAP writes 256, 512, 1024, or 4096 bytes to a 256 byte aligned
+// address.  Use the largest that fits the remaining data without
+// leaving the current sector.
+static uint32_t iap_write_size(uint32_t flash_addr, uint32_t length) {
+	uint32_t room = SECTOR_SIZE - (flash_addr & (SECTOR_SIZE - 1));
+	if (length > room) {
+		length = room;
+	}
+	if (length >= 4096) return 4096;
+	if (length >= 1024) return 1024;
+	if (length >= 512) return 512;
+	return 256;
+}
+
 int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length) {
-	void (*romcall)(uint32_t *,uint32_t *) = (void*) LPC_IAP_FUNC;
-	uint32_t p[5],r[4];
-	uint32_t page = flash_addr >> 12;
-	if (flash_addr & 0xFFF) {
+	const uint8_t *x = data;
+	uint32_t locked = 0xFFFFFFFF;
+	uint32_t tail[256 / 4];
+	if ((flash_addr & 0xFF) || (((uint32_t) data) & 3)) {
 		return ERR_ALIGNMENT;
 	}
+	if (length == 0) {
+		return ERR_NONE;
+	}
 
-	p[0] = LPC_IAP_PREPARE;
-	p[1] = page;
-	p[2] = page;
-	romcall(p,r);
-	if (r[0]) {
+	// a WRITE re-protects only the sector it programmed, so one
+	// PREPARE covers the whole buffer as long as each sector is
+	// written once; smaller trailing writes re-PREPARE their sector
+	if (iap_prepare(SECTOR(flash_addr), SECTOR(flash_addr + length - 1))) {
 		return ERR_FAIL;
 	}
-
-	// todo: smaller writes, etc
-	if (length != 4096) {
-		int n;
-		for (n = length; n < 4096; n++) {
-			((char*) data)[n] = 0;
+	while (length > 0) {
+		uint32_t xfer = iap_write_size(flash_addr, length);
+		const void *src = x;
+		if (length < xfer) {
+			// pad the tail in a copy, not the caller's buffer
+			uint8_t *t = (void*) tail;
+			uint32_t n;
+			for (n = 0; n < length; n++) t[n] = x[n];
+			for (; n < xfer; n++) t[n] = 0;
+			src = tail;
 		}
+		if ((SECTOR(flash_addr) == locked) &&
+			iap_prepare(locked, locked)) {
+			return ERR_FAIL;
+		}
+		if (iap_write(flash_addr, src, xfer)) {
+			return ERR_FAIL;
+		}
+		locked = SECTOR(flash_addr);
+		if (length <= xfer) break;
+		length -= xfer;
+		flash_addr += xfer;
+		x += xfer;
 	}
-	p[0] = LPC_IAP_WRITE;
-	p[1] = flash_addr;
-	p[2] = (uint32_t) data;
-	p[3] = 0x1000;
-	p[4] = 0x2ee0;
-	romcall(p,r);
-	if (r[0]) {
-		return ERR_FAIL;
-	}
+	return ERR_NONE;
+}
 
+#ifndef ARCH_LPC15XX
+#define SYSPLLCTRL		0x40048008
+#define SYSPLLCTRL_MSEL(m)	(((m) - 1) & 31) // multiplier
+#define SYSPLLCTRL_PSEL_2	(1 << 5) // post divider 2 (FCCO 288MHz)
+#define SYSPLLSTAT		0x4004800C
+#define SYSPLLSTAT_LOCK		(1 << 0)
+#define SYSPLLCLKSEL		0x40048040
+#define SYSPLLCLKUEN		0x40048044
+#define MAINCLKSEL		0x40048070
+#define MAINCLKSEL_IRC		0
+#define MAINCLKSEL_PLLOUT	3
+#define MAINCLKUEN		0x40048074
+#define PDRUNCFG		0x40048238
+#define PDRUNCFG_SYSPLL_PD	(1 << 7)
+#define FLASHCFG		0x4003C010
+#define FLASHCFG_FLASHTIM_MASK	3
+#define FLASHCFG_FLASHTIM_3CLK	2 // up to 72MHz
+
+static uint32_t saved_flashcfg;
+static uint32_t saved_pdruncfg;
+
+static void clock_update(uint32_t uen) {
+	writel(0, uen);
+	writel(1, uen);
+}
+
+// IRC x 6 = 72MHz
+static int clock_boost(uint32_t *hz) {
+	saved_flashcfg = readl(FLASHCFG);
+	saved_pdruncfg = readl(PDRUNCFG);
+
+	writel((saved_flashcfg & ~FLASHCFG_FLASHTIM_MASK) |
+		FLASHCFG_FLASHTIM_3CLK, FLASHCFG);
+	writel(0, SYSPLLCLKSEL);
+	clock_update(SYSPLLCLKUEN);
+	writel(SYSPLLCTRL_MSEL(6) | SYSPLLCTRL_PSEL_2, SYSPLLCTRL);
+	writel(saved_pdruncfg & ~PDRUNCFG_SYSPLL_PD, PDRUNCFG);
+	while (!(readl(SYSPLLSTAT) & SYSPLLSTAT_LOCK)) ;
+	writel(MAINCLKSEL_PLLOUT, MAINCLKSEL);
+	clock_update(MAINCLKUEN);
+
+	cclk_khz = 72000;
+	*hz = cclk_khz * 1000;
 	return ERR_NONE;
 }
 
-int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
+static int clock_restore(void) {
+	writel(MAINCLKSEL_IRC, MAINCLKSEL);
+	clock_update(MAINCLKUEN);
+	writel(saved_pdruncfg, PDRUNCFG);
+	writel(saved_flashcfg, FLASHCFG);
+	cclk_khz = 12000;
+	return ERR_NONE;
+}
+#else
+// todo: LPC15xx PLL setup
+static int clock_boost(uint32_t *hz) {
 	return ERR_INVALID;
 }
 
+static int clock_restore(void) {
+	return ERR_INVALID;
+}
+#endif
+
+int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
+	switch (op) {
+	case OP_CLOCK_BOOST:
+		return clock_boost(ptr);
+	case OP_CLOCK_RESTORE:
+		return clock_restore();
+	case OP_PACK:
+		return pack_words(ptr);
+	default:
+		return ERR_INVALID;
+	}
+}
+
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
 	.flags =	FLAG_BOOT_ROM_HACK,
 	.load_addr =	LOADADDR,
 	.data_addr =	LOADADDR + 0x400,
-	.data_size =	0x1000,
+	.data_size =	SECTOR_SIZE,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	FLASH_SIZE,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
@@ -4,4 +4,6 @@
 #define FLASH_BASE	0x00000000
 #define FLASH_SIZE	0x00010000
 
+#define RAM_BASE	0x02000000
+
 #include "lpc13xx_lpc15xx.c"
@@ -30,6 +30,33 @@
 #define PIN_INPUT	(1 << 6) // enable input buffer, required for inputs
 #define PIN_FILTER	(1 << 7) // enable glitch filter, not for >30MHz signals
 
+// ---- clock generation unit
+
+#define PLL1_STAT		0x40050040
+#define PLL1_STAT_LOCK		(1 << 0)
+#define PLL1_CTRL		0x40050044
+#define PLL1_PD			(1 << 0)
+#define PLL1_BYPASS		(1 << 1)
+#define PLL1_FBSEL		(1 << 6) // integer mode: Fout = M * Fin / N
+#define PLL1_DIRECT		(1 << 7)
+#define PLL1_PSEL(n)		(((n) & 3) << 8)
+#define PLL1_NSEL(n)		(((n) & 3) << 12)
+#define PLL1_MSEL(n)		(((n) & 255) << 16)
+#define IDIVA_CTRL		0x40050048
+#define IDIV_DIV(n)		((((n) - 1) & 3) << 2)
+#define BASE_M4_CLK		0x4005006C
+#define BASE_SPIFI_CLK		0x40050070
+
+// common to PLL1, IDIVx, and BASE_x_CLK
+#define CLK_PD			(1 << 0)
+#define CLK_AUTOBLOCK		(1 << 11)
+#define CLK_SEL(n)		(((n) & 0x1F) << 24)
+#define CLK_IRC			0x01
+#define CLK_PLL1		0x09
+#define CLK_IDIVA		0x0C
+
+#define IRC_HZ			12000000
+
 // ---- spifi serial flash controller
 
 #define SPIFI_CTRL		0x40003000 // Control
@@ -79,75 +106,314 @@
 #define STAT_RESET		(1 << 4) // write 1 to abort current txn or memory mode
 #define STAT_INTRQ		(1 << 5) // read IRQ status, wr(1) to clear
 
+#define CMD_WRITE_STATUS		0x01
 #define CMD_PAGE_PROGRAM		0x02
 #define CMD_READ_DATA			0x03
 #define CMD_READ_STATUS			0x05
 #define CMD_WRITE_ENABLE		0x06
-#define CMD_SECTOR_ERASE		0x20
+#define CMD_SECTOR_ERASE		0x20 // 4K
+#define CMD_WRITE_STATUS2		0x31
+#define CMD_QUAD_PAGE_PROGRAM		0x32 // 1-1-4
+#define CMD_READ_STATUS2		0x35
+#define CMD_QUAD_PAGE_PROGRAM_4IO	0x38 // 1-4-4 (Macronix)
+#define CMD_BLOCK_ERASE_32K		0x52
+#define CMD_READ_SFDP			0x5A
+#define CMD_FAST_READ_QUAD_OUT		0x6B // 1-1-4, 8 dummy clocks
+#define CMD_READ_JEDEC_ID		0x9F
+#define CMD_CHIP_ERASE			0xC7
+#define CMD_BLOCK_ERASE_64K		0xD8
+
+#define MFR_MICRON			0x20
+#define MFR_ISSI			0x9D
+#define MFR_MACRONIX			0xC2
+#define MFR_WINBOND			0xEF
+
+// JESD216 quad enable requirements (BFPT dword 15)
+#define QER_NONE			0 // no QE bit (Micron)
+#define QER_SR2_BIT1_NO_RD		1 // write SR1+SR2 with 0x01
+#define QER_SR1_BIT6			2 // write SR1 with 0x01 (Macronix, ISSI)
+#define QER_SR2_BIT1			4 // write SR1+SR2 with 0x01 (Winbond)
+#define QER_SR2_BIT1_RD			5 // as 4, SR2 readable
+#define QER_SR2_BIT1_WR31		6 // write SR2 with 0x31
+
+#define SFDP_SIGNATURE			0x50444653 // "SFDP"
+
+#define PAGE_SIZE			256
+#define XFER_MAX			0x2000 // per command (DATALEN is 14 bits)
+#define SIZE_MAX_3B			0x01000000 // 3-byte addressing limit
+
+typedef struct {
+	uint8_t shift; // log2(size)
+	uint8_t op;
+} nor_erase_t;
+
+// the attached serial nor flash, as found by setup()
+// (this is .bss, which nothing clears, so setup() fills it all in)
+static struct {
+	uint32_t size;
+	uint32_t pp_cmd; // page program SPIFI_CMD, less DATALEN
+	uint32_t rd_cmd; // verify / memory mode read SPIFI_CMD, less DATALEN
+	nor_erase_t erase[4]; // largest first, shift 0 = unused
+} nor;
+
+static void spifi_wait_cmd(void) {
+	while (readl(SPIFI_STAT) & STAT_CMD) ;
+}
+
+// leave memory mode (if the boot rom or a previous write left it
+// there) so that commands may be issued
+static void spifi_cmd_mode(void) {
+	if (readl(SPIFI_STAT) & STAT_MCINIT) {
+		writel(STAT_RESET, SPIFI_STAT);
+		while (readl(SPIFI_STAT) & STAT_RESET) ;
+	}
+}
 
 static void spifi_write_enable(void) {
 	writel(CMD_FF_SERIAL | CMD_FR_OP | CMD_OPCODE(CMD_WRITE_ENABLE),
 		SPIFI_CMD);
-	while (readl(SPIFI_STAT) & STAT_CMD) ;
+	spifi_wait_cmd();
 }
 
 static void spifi_wait_busy(void) {
-	while (readl(SPIFI_STAT) & STAT_CMD) ;
+	spifi_wait_cmd();
 	writel(CMD_POLLBIT(0) | CMD_POLLCLR | CMD_POLL |
 		CMD_FF_SERIAL | CMD_FR_OP | CMD_OPCODE(CMD_READ_STATUS),
 		SPIFI_CMD);
-	while (readl(SPIFI_STAT) & STAT_CMD) ;
+	spifi_wait_cmd();
 	// discard matching status byte from fifo
 	readb(SPIFI_DATA);
 }
 
-static void spifi_page_program(uint32_t addr, uint32_t *ptr, uint32_t count) {
+static uint32_t spifi_read_reg(uint32_t op, uint32_t len) {
+	uint32_t v = 0, n;
+	writel(CMD_DATALEN(len) | CMD_FF_SERIAL | CMD_FR_OP |
+		CMD_OPCODE(op), SPIFI_CMD);
+	for (n = 0; n < len; n++) {
+		v |= readb(SPIFI_DATA) << (n * 8);
+	}
+	spifi_wait_cmd();
+	return v;
+}
+
+static void spifi_write_reg(uint32_t op, uint32_t val, uint32_t len) {
 	spifi_write_enable();
-	writel(addr, SPIFI_ADDR);
-	writel(CMD_DATALEN(count * 4) | CMD_FF_SERIAL | CMD_FR_OP_3B |
-		CMD_DOUT | CMD_OPCODE(CMD_PAGE_PROGRAM), SPIFI_CMD);
-	while (count-- > 0) {
-		writel(*ptr++, SPIFI_DATA);
+	writel(CMD_DATALEN(len) | CMD_FF_SERIAL | CMD_FR_OP |
+		CMD_DOUT | CMD_OPCODE(op), SPIFI_CMD);
+	while (len-- > 0) {
+		writeb(val, SPIFI_DATA);
+		val >>= 8;
 	}
 	spifi_wait_busy();
 }
 
-static void spifi_sector_erase(uint32_t addr) {
-	spifi_write_enable();
+static uint32_t spifi_read_sfdp(uint32_t addr) {
+	uint32_t v;
 	writel(addr, SPIFI_ADDR);
-	writel(CMD_FF_SERIAL | CMD_FR_OP_3B | CMD_OPCODE(CMD_SECTOR_ERASE),
-		SPIFI_CMD);
-	spifi_wait_busy();
+	writel(0, SPIFI_IDATA);
+	writel(CMD_DATALEN(4) | CMD_FF_SERIAL | CMD_FR_OP_3B | CMD_INTLEN(1) |
+		CMD_OPCODE(CMD_READ_SFDP), SPIFI_CMD);
+	v = readl(SPIFI_DATA);
+	spifi_wait_cmd();
+	return v;
 }
 
-static int verify_erased(uint32_t addr, uint32_t count) {
-	int err = 0;
+// sets the QE bit (non-volatile on most parts) if not already set
+static int spifi_quad_enable(uint32_t qer) {
+	uint32_t sr1, sr2;
+	switch (qer) {
+	case QER_NONE:
+		return 0;
+	case QER_SR1_BIT6:
+		sr1 = spifi_read_reg(CMD_READ_STATUS, 1);
+		if (!(sr1 & 0x40)) {
+			spifi_write_reg(CMD_WRITE_STATUS, sr1 | 0x40, 1);
+			sr1 = spifi_read_reg(CMD_READ_STATUS, 1);
+		}
+		return (sr1 & 0x40) ? 0 : -1;
+	case QER_SR2_BIT1_NO_RD:
+		sr1 = spifi_read_reg(CMD_READ_STATUS, 1);
+		spifi_write_reg(CMD_WRITE_STATUS, sr1 | (0x02 << 8), 2);
+		return 0;
+	case QER_SR2_BIT1:
+	case QER_SR2_BIT1_RD:
+		sr2 = spifi_read_reg(CMD_READ_STATUS2, 1);
+		if (!(sr2 & 0x02)) {
+			sr1 = spifi_read_reg(CMD_READ_STATUS, 1);
+			spifi_write_reg(CMD_WRITE_STATUS, sr1 | ((sr2 | 0x02) << 8), 2);
+			sr2 = spifi_read_reg(CMD_READ_STATUS2, 1);
+		}
+		return (sr2 & 0x02) ? 0 : -1;
+	case QER_SR2_BIT1_WR31:
+		sr2 = spifi_read_reg(CMD_READ_STATUS2, 1);
+		if (!(sr2 & 0x02)) {
+			spifi_write_reg(CMD_WRITE_STATUS2, sr2 | 0x02, 1);
+			sr2 = spifi_read_reg(CMD_READ_STATUS2, 1);
+		}
+		return (sr2 & 0x02) ? 0 : -1;
+	default:
+		return -1;
+	}
+}
+
+static void nor_add_erase(uint32_t shift, uint32_t op) {
+	int n, m;
+	if ((shift < 12) || (shift > 24)) {
+		return;
+	}
+	for (n = 0; n < 4; n++) {
+		if (nor.erase[n].shift < shift) break;
+	}
+	if (n == 4) {
+		return;
+	}
+	for (m = 3; m > n; m--) {
+		nor.erase[m] = nor.erase[m - 1];
+	}
+	nor.erase[n].shift = shift;
+	nor.erase[n].op = op;
+}
+
+// read size, erase types, and quad support from the JEDEC basic
+// flash parameter table; returns quad enable requirement, or -1
+// if there is no usable SFDP (or it does not offer 1-1-4 reads)
+static int nor_probe_sfdp(void) {
+	uint32_t ph0, ph1, ptp, dw;
+	int n;
+	if (spifi_read_sfdp(0) != SFDP_SIGNATURE) {
+		return -1;
+	}
+	// the first parameter header is always the BFPT
+	ph0 = spifi_read_sfdp(8);
+	ph1 = spifi_read_sfdp(12);
+	ptp = ph1 & 0xFFFFFF;
+	if ((ph0 >> 24) < 9) {
+		return -1;
+	}
+
+	dw = spifi_read_sfdp(ptp + 4);
+	if (dw & 0x80000000) {
+		dw &= 0x7FFFFFFF;
+		nor.size = (dw >= 27) ? SIZE_MAX_3B : (1 << (dw - 3));
+	} else {
+		nor.size = (dw >= (SIZE_MAX_3B * 8)) ? SIZE_MAX_3B : ((dw + 1) / 8);
+	}
+
+	for (n = 0; n < 4; n++) {
+		nor.erase[n].shift = 0;
+	}
+	for (n = 0; n < 2; n++) {
+		dw = spifi_read_sfdp(ptp + 28 + n * 4);
+		nor_add_erase(dw & 0xFF, (dw >> 8) & 0xFF);
+		nor_add_erase((dw >> 16) & 0xFF, dw >> 24);
+	}
+	if (nor.erase[0].shift == 0) {
+		nor_add_erase(12, CMD_SECTOR_ERASE);
+	}
+
+	if (!(spifi_read_sfdp(ptp) & (1 << 22))) {
+		return -1;
+	}
+	if ((ph0 >> 24) >= 15) {
+		return (spifi_read_sfdp(ptp + 56) >> 20) & 7;
+	}
+	return -2;
+}
+
+static void nor_probe(void) {
+	uint32_t id = spifi_read_reg(CMD_READ_JEDEC_ID, 3);
+	uint32_t mfr = id & 0xFF;
+	uint32_t cap = (id >> 16) & 0xFF;
+	int qer;
+
+	// defaults: single bit, 4K/32K/64K erase, size by JEDEC id
+	nor.size = FLASH_SIZE;
+	if ((cap >= 16) && (cap <= 24)) {
+		nor.size = 1 << cap;
+	}
+	nor.erase[0].shift = 16;
+	nor.erase[0].op = CMD_BLOCK_ERASE_64K;
+	nor.erase[1].shift = 15;
+	nor.erase[1].op = CMD_BLOCK_ERASE_32K;
+	nor.erase[2].shift = 12;
+	nor.erase[2].op = CMD_SECTOR_ERASE;
+	nor.erase[3].shift = 0;
+	nor.pp_cmd = CMD_FF_SERIAL | CMD_FR_OP_3B | CMD_DOUT |
+		CMD_OPCODE(CMD_PAGE_PROGRAM);
+	nor.rd_cmd = CMD_FF_SERIAL | CMD_FR_OP_3B |
+		CMD_OPCODE(CMD_READ_DATA);
+
+	qer = nor_probe_sfdp();
+	if (qer == -1) {
+		return;
+	}
+	if (qer == -2) {
+		// JESD216 rev 0 tables do not say how to enable quad
+		switch (mfr) {
+		case MFR_MICRON: qer = QER_NONE; break;
+		case MFR_ISSI: qer = QER_SR1_BIT6; break;
+		case MFR_MACRONIX: qer = QER_SR1_BIT6; break;
+		case MFR_WINBOND: qer = QER_SR2_BIT1; break;
+		default: return;
+		}
+	}
+	if (spifi_quad_enable(qer)) {
+		return;
+	}
+
+	// SFDP does not describe page program; Macronix only
+	// has the 1-4-4 variant
+	if (mfr == MFR_MACRONIX) {
+		nor.pp_cmd = CMD_FF_SERIAL_OPCODE | CMD_FR_OP_3B | CMD_DOUT |
+			CMD_OPCODE(CMD_QUAD_PAGE_PROGRAM_4IO);
+	} else {
+		nor.pp_cmd = CMD_FF_WIDE_DATA | CMD_FR_OP_3B | CMD_DOUT |
+			CMD_OPCODE(CMD_QUAD_PAGE_PROGRAM);
+	}
+	nor.rd_cmd = CMD_FF_WIDE_DATA | CMD_FR_OP_3B | CMD_INTLEN(1) |
+		CMD_OPCODE(CMD_FAST_READ_QUAD_OUT);
+}
+
+static void spifi_page_program(uint32_t addr, const uint32_t *ptr, uint32_t count) {
+	spifi_write_enable();
 	writel(addr, SPIFI_ADDR);
-	writel(CMD_DATALEN(count * 4) | CMD_FF_SERIAL | CMD_FR_OP_3B |
-		CMD_OPCODE(CMD_READ_DATA), SPIFI_CMD);
+	writel(CMD_DATALEN(count * 4) | nor.pp_cmd, SPIFI_CMD);
 	while (count-- > 0) {
-		if (readl(SPIFI_DATA) != 0xFFFFFFFF) err = -1;
+		writel(*ptr++, SPIFI_DATA);
 	}
-	while (readl(SPIFI_STAT) & STAT_CMD) ;
-	return err;
+	spifi_wait_busy();
 }
 
-static int verify_page(uint32_t addr, uint32_t *ptr) {
-	int count = 256 / 4;
-	int err = 0;
+static void spifi_erase(uint32_t addr, uint32_t op, uint32_t frame) {
+	spifi_write_enable();
 	writel(addr, SPIFI_ADDR);
-	writel(CMD_DATALEN(count * 4) | CMD_FF_SERIAL | CMD_FR_OP_3B |
-		CMD_OPCODE(CMD_READ_DATA), SPIFI_CMD);
-	while (count-- > 0) {
-		if (readl(SPIFI_DATA) != *ptr++) err = -1;
+	writel(CMD_FF_SERIAL | frame | CMD_OPCODE(op), SPIFI_CMD);
+	spifi_wait_busy();
+}
+
+// compare count bytes at addr with ptr, or with erased (0xFF)
+// if ptr is 0, reading in quad mode when available
+static int spifi_verify(uint32_t addr, const uint32_t *ptr, uint32_t count) {
+	int err = 0;
+	while (count > 0) {
+		uint32_t xfer = (count > XFER_MAX) ? XFER_MAX : count;
+		uint32_t n;
+		writel(addr, SPIFI_ADDR);
+		writel(0, SPIFI_IDATA);
+		writel(CMD_DATALEN(xfer) | nor.rd_cmd, SPIFI_CMD);
+		for (n = 0; n < xfer; n += 4) {
+			uint32_t v = readl(SPIFI_DATA);
+			if (v != (ptr ? *ptr++ : 0xFFFFFFFF)) err = -1;
+		}
+		spifi_wait_cmd();
+		addr += xfer;
+		count -= xfer;
 	}
-	while (readl(SPIFI_STAT) & STAT_CMD) ;
 	return err;
 }
 
 // at reset-stop, all clocks are running from 12MHz internal osc
-// todo: run SPIFI_CLK at a much higher rate
-// todo: use 4bit modes
+// (OP_CLOCK_BOOST raises core and SPIFI_CLK)
 int flash_agent_setup(flash_agent *agent) {
 	// configure pinmux
 	writel(PIN_MODE(3) | PIN_PLAIN, PIN_CFG(3,3)); // SPIFI_SCK
@@ -162,52 +428,132 @@ int flash_agent_setup(flash_agent *agent) {
 	while (readl(SPIFI_STAT) & STAT_RESET) ;
 	writel(0xFFFFF, SPIFI_CTRL);
 
+	nor_probe();
+	agent->flash_size = nor.size;
 	return ERR_NONE;
 }
 
 int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
+	int err = ERR_NONE;
 	if (flash_addr & 0xFFF) {
 		return ERR_ALIGNMENT;
 	}
+	spifi_cmd_mode();
+	if ((flash_addr == 0) && (length >= nor.size)) {
+		spifi_erase(0, CMD_CHIP_ERASE, CMD_FR_OP);
+		if (spifi_verify(0, 0, nor.size)) {
+			err = ERR_FAIL;
+		}
+		goto done;
+	}
 	while (length != 0) {
-		spifi_sector_erase(flash_addr);
-		if (verify_erased(flash_addr, 0x1000/4)) {
-			return ERR_FAIL;
+		// largest aligned block that does not overshoot, or
+		// else the smallest (rounding up the end of the range)
+		uint32_t sz = 0, op = 0;
+		int n;
+		for (n = 0; (n < 4) && nor.erase[n].shift; n++) {
+			sz = 1 << nor.erase[n].shift;
+			op = nor.erase[n].op;
+			if (((flash_addr & (sz - 1)) == 0) && (length >= sz)) break;
+		}
+		if (sz == 0) {
+			err = ERR_FAIL;
+			goto done;
 		}
-		if (length < 0x1000) break;
-		length -= 0x1000;
-		flash_addr += 0x1000;
+		if (flash_addr & (sz - 1)) {
+			err = ERR_ALIGNMENT;
+			goto done;
+		}
+		spifi_erase(flash_addr, op, CMD_FR_OP_3B);
+		if (spifi_verify(flash_addr, 0, sz)) {
+			err = ERR_FAIL;
+			goto done;
+		}
+		if (length <= sz) break;
+		length -= sz;
+		flash_addr += sz;
 	}
-	return ERR_NONE;
+done:
+	writel(nor.rd_cmd, SPIFI_MCMD);
+	return err;
 }
 
+// pages must be busy-polled one by one, but the read back for
+// verify is one (quad) pass over the whole buffer
 int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length) {
 	char *x = (void*) data;
-	if (flash_addr & 0xFFF) {
+	uint32_t addr = flash_addr;
+	uint32_t count = length;
+	int err = ERR_NONE;
+	if (flash_addr & (PAGE_SIZE - 1)) {
 		return ERR_ALIGNMENT;
 	}
-	while (length != 0) {
-		if (length < 256) {
-			int n;
-			for (n = length; n < 256; n++) {
-				x[n] = 0;
-			}
+	if (length & (PAGE_SIZE - 1)) {
+		int n;
+		for (n = length; n & (PAGE_SIZE - 1); n++) {
+			x[n] = 0;
 		}
-		spifi_page_program(flash_addr, (void*) x, 256 / 4);
-		if (verify_page(flash_addr, (void*) x)) {
-			return ERR_FAIL;
-		}
-		if (length < 256) break;
-		length -= 256;
-		flash_addr += 256;
-		x += 256;
+		count = (length + PAGE_SIZE - 1) & (~(PAGE_SIZE - 1));
+	}
+	spifi_cmd_mode();
+	for (length = count; length != 0; length -= PAGE_SIZE) {
+		spifi_page_program(addr, (void*) x, PAGE_SIZE / 4);
+		addr += PAGE_SIZE;
+		x += PAGE_SIZE;
+	}
+	if (spifi_verify(flash_addr, data, count)) {
+		err = ERR_FAIL;
 	}
-	writel(CMD_FF_SERIAL | CMD_FR_OP_3B | CMD_OPCODE(CMD_READ_DATA), SPIFI_MCMD);
+	writel(nor.rd_cmd, SPIFI_MCMD);
+	return err;
+}
+
+static uint32_t saved_pll1;
+static uint32_t saved_idiva;
+static uint32_t saved_m4_clk;
+static uint32_t saved_spifi_clk;
+
+// IRC x 8 = 96MHz core (below the 110MHz that would require
+// stepping the base clock up), SPIFI_CLK = 96 / 3 = 32MHz, within
+// every serial flash's limit for the slow (0x03) read command
+static int clock_boost(uint32_t *hz) {
+	saved_pll1 = readl(PLL1_CTRL);
+	saved_idiva = readl(IDIVA_CTRL);
+	saved_m4_clk = readl(BASE_M4_CLK);
+	saved_spifi_clk = readl(BASE_SPIFI_CLK);
+
+	writel(CLK_SEL(CLK_IRC) | CLK_AUTOBLOCK | PLL1_FBSEL |
+		PLL1_MSEL(8 - 1) | PLL1_NSEL(0) | PLL1_PSEL(0), PLL1_CTRL);
+	while (!(readl(PLL1_STAT) & PLL1_STAT_LOCK)) ;
+	writel(CLK_SEL(CLK_PLL1) | CLK_AUTOBLOCK | IDIV_DIV(3), IDIVA_CTRL);
+
+	// spifi must be idle while its clock changes
+	while (readl(SPIFI_STAT) & STAT_CMD) ;
+	writel(CLK_SEL(CLK_IDIVA) | CLK_AUTOBLOCK, BASE_SPIFI_CLK);
+	writel(CLK_SEL(CLK_PLL1) | CLK_AUTOBLOCK, BASE_M4_CLK);
+
+	*hz = IRC_HZ * 8;
+	return ERR_NONE;
+}
+
+static int clock_restore(void) {
+	while (readl(SPIFI_STAT) & STAT_CMD) ;
+	writel(saved_m4_clk, BASE_M4_CLK);
+	writel(saved_spifi_clk, BASE_SPIFI_CLK);
+	writel(saved_idiva, IDIVA_CTRL);
+	writel(saved_pll1, PLL1_CTRL);
 	return ERR_NONE;
 }
 
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	switch (op) {
+	case OP_CLOCK_BOOST:
+		return clock_boost(ptr);
+	case OP_CLOCK_RESTORE:
+		return clock_restore();
+	default:
+		return ERR_INVALID;
+	}
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
@@ -215,10 +561,11 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.version =	AGENT_VERSION,
 	.flags =	0,
 	.load_addr =	LOADADDR,
-	.data_addr =	LOADADDR + 0x400,
+	.data_addr =	LOADADDR + 0xC00,
 	.data_size =	0x8000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	FLASH_SIZE,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
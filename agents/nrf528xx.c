@@ -19,6 +19,7 @@
 #define FLASH_BASE	0x00000000
 
 #include <agent/flash.h>
+#include <agent/pack.h>
 #include <fw/io.h>
 
 #define NVMC_READY		0x4001E400
@@ -30,6 +31,9 @@
 
 #define FICR_CODEPAGESIZE	0x10000010
 #define FICR_CODESIZE           0x10000014
+#define FICR_INFO_RAM		0x1000010C // KB
+
+#define RAM_BASE		0x20000000
 
 static unsigned FLASH_PAGE_SIZE = 1024;
 static unsigned FLASH_SIZE = 192 * 1024;
@@ -48,6 +52,13 @@ int flash_agent_setup(flash_agent *agent) {
 	
 	agent->flash_size = FLASH_SIZE;
 
+	// use all ram above the agent as the data buffer
+	unsigned ram_kb = readl(FICR_INFO_RAM);
+	if ((ram_kb >= 16) && (ram_kb <= 1024)) {
+		agent->data_size = (RAM_BASE + ram_kb * 1024 - agent->data_addr) &
+			(~(FLASH_PAGE_SIZE - 1));
+	}
+
 	return ERR_NONE;
 }
 
@@ -108,7 +119,12 @@ done:
 }
 
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	switch (op) {
+	case OP_PACK:
+		return pack_words(ptr);
+	default:
+		return ERR_INVALID;
+	}
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
@@ -120,6 +136,7 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.data_size =	0x4000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	0,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
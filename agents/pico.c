@@ -20,6 +20,7 @@
 
 #include <stdint.h>
 #include <agent/flash.h>
+#include <agent/pack.h>
 #include <fw/io.h>
 
 static unsigned FLASH_BLOCK_SIZE = 256;
@@ -28,6 +29,10 @@ static unsigned FLASH_SIZE = 4 * 1024 * 1024;
 
 #define FLASH_XIP_BASE 0x10000000
 
+// striped main sram (SRAM4/5 above it are left alone)
+#define RAM_BASE 0x20000000
+#define RAM_SIZE (256 * 1024)
+
 #define CODE(c1, c2) (((c2) << 8) | (c1))
 
 #define ROM_LOOKUP_FN_PTR 0x18
@@ -69,6 +74,9 @@ int flash_agent_setup(flash_agent *agent) {
 	// TODO: obtain from spi flash	
 	agent->flash_size = FLASH_SIZE;
 
+	// use all ram above the agent as the data buffer
+	agent->data_size = (RAM_BASE + RAM_SIZE - agent->data_addr) & (~(FLASH_PAGE_SIZE - 1));
+
 	return ERR_NONE;
 }
 
@@ -127,8 +135,25 @@ int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length) {
 	return ERR_NONE;
 }
 
+// after reset-stop boot2 has not run, so bring up (slow) xip
+// before reading flash through it
+static int pack_flash(flash_pack *p) {
+	if ((p->addr >= FLASH_XIP_BASE) && (p->addr < (FLASH_XIP_BASE + FLASH_SIZE))) {
+		_flash_connect();
+		_flash_exit_xip();
+		_flash_flush_cache();
+		_flash_enter_xip();
+	}
+	return pack_words(p);
+}
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	switch (op) {
+	case OP_PACK:
+		return pack_flash(ptr);
+	default:
+		return ERR_INVALID;
+	}
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
@@ -140,6 +165,7 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.data_size =	0x4000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	0,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
@@ -20,10 +20,13 @@
 #define FLASH_SIZE	0x00004000
 
 #include <agent/flash.h>
+#include <agent/pack.h>
 #include <fw/io.h>
 
 #define _FLASH_BASE		0x40022000
 #define FLASH_ACR		(_FLASH_BASE + 0x00)
+#define FLASH_ACR_PRFTBE	(1 << 4) // prefetch enable
+#define FLASH_ACR_LATENCY_1	(1 << 0) // one wait state, 24-48MHz
 
 #define FLASH_KEYR		(_FLASH_BASE + 0x04)
 #define FLASH_KEYR_KEY1		0x45670123
@@ -52,18 +55,46 @@
 
 #define FLASH_AR		(_FLASH_BASE + 0x14)
 
+#define RAM_BASE		0x20000000
+
+#define _RCC_BASE		0x40021000
+#define RCC_CR			(_RCC_BASE + 0x00)
+#define RCC_CR_PLLRDY		(1 << 25)
+#define RCC_CR_PLLON		(1 << 24)
+#define RCC_CFGR		(_RCC_BASE + 0x04)
+#define RCC_CFGR_PLLMUL(n)	((((n) - 2) & 15) << 18)
+#define RCC_CFGR_PLLMUL_MASK	(15 << 18)
+#define RCC_CFGR_PLLSRC_MASK	(3 << 15) // 0 = HSI/2 on all parts
+#define RCC_CFGR_SWS_MASK	(3 << 2)
+#define RCC_CFGR_SWS_HSI	(0 << 2)
+#define RCC_CFGR_SWS_PLL	(2 << 2)
+#define RCC_CFGR_SW_MASK	(3 << 0)
+#define RCC_CFGR_SW_PLL		(2 << 0)
+
+#define HSI_HZ			8000000
+
 static unsigned FLASH_PAGE_SIZE = 1024;
 
 int flash_agent_setup(flash_agent *agent) {
+	unsigned ram_size;
 
 	// check MCU ID
 	switch (readl(0x40015800) & 0xFFF) {
 	case 0x444: // F03x
+		ram_size = 4 * 1024;
+		break;
 	case 0x445: // F04x
+		ram_size = 6 * 1024;
+		break;
 	case 0x440: // F05x
+		ram_size = 8 * 1024;
 		break;
 	case 0x448: // F07x
+		ram_size = 16 * 1024;
+		FLASH_PAGE_SIZE = 2048;
+		break;
 	case 0x442: // F09x
+		ram_size = 32 * 1024;
 		FLASH_PAGE_SIZE = 2048;
 		break;
 	default:
@@ -71,6 +102,10 @@ int flash_agent_setup(flash_agent *agent) {
 		return ERR_INVALID;
 	}
 
+	// use all ram above the agent as the data buffer
+	agent->data_size = (RAM_BASE + ram_size - agent->data_addr) &
+		(~(FLASH_PAGE_SIZE - 1));
+
 	// check flash size
 	agent->flash_size = readw(0x1FFFF7CC) * 1024;
 
@@ -134,8 +169,52 @@ int flash_agent_write(uint32_t flash_addr, const void *_data, uint32_t length) {
 	return ERR_NONE;
 }
 
+static uint32_t saved_acr;
+static uint32_t saved_cfgr;
+
+// HSI/2 x 12 = 48MHz (the flash interface runs from HSI
+// regardless, so programming timing is unaffected)
+static int clock_boost(uint32_t *hz) {
+	uint32_t cfgr = readl(RCC_CFGR);
+	if ((cfgr & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_HSI) {
+		return ERR_FAIL;
+	}
+	saved_acr = readl(FLASH_ACR);
+	saved_cfgr = cfgr;
+
+	writel(FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_1, FLASH_ACR);
+	cfgr &= ~(RCC_CFGR_PLLMUL_MASK | RCC_CFGR_PLLSRC_MASK);
+	writel(cfgr | RCC_CFGR_PLLMUL(12), RCC_CFGR);
+	writel(readl(RCC_CR) | RCC_CR_PLLON, RCC_CR);
+	while (!(readl(RCC_CR) & RCC_CR_PLLRDY)) ;
+	writel(cfgr | RCC_CFGR_PLLMUL(12) | RCC_CFGR_SW_PLL, RCC_CFGR);
+	while ((readl(RCC_CFGR) & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_PLL) ;
+
+	*hz = HSI_HZ / 2 * 12;
+	return ERR_NONE;
+}
+
+static int clock_restore(void) {
+	writel(saved_cfgr & ~RCC_CFGR_SW_MASK, RCC_CFGR);
+	while ((readl(RCC_CFGR) & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_HSI) ;
+	writel(readl(RCC_CR) & ~RCC_CR_PLLON, RCC_CR);
+	while (readl(RCC_CR) & RCC_CR_PLLRDY) ;
+	writel(saved_cfgr, RCC_CFGR);
+	writel(saved_acr, FLASH_ACR);
+	return ERR_NONE;
+}
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	switch (op) {
+	case OP_CLOCK_BOOST:
+		return clock_boost(ptr);
+	case OP_CLOCK_RESTORE:
+		return clock_restore();
+	case OP_PACK:
+		return pack_words(ptr);
+	default:
+		return ERR_INVALID;
+	}
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
@@ -147,6 +226,7 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.data_size =	0x1000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	FLASH_SIZE,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
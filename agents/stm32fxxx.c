@@ -15,10 +15,13 @@
 // limitations under the License.
 
 #include <agent/flash.h>
+#include <agent/pack.h>
 #include <fw/io.h>
 
 #define _FLASH_BASE		0x40023C00
 #define FLASH_ACR		(_FLASH_BASE + 0x00)
+#define FLASH_ACR_LATENCY(n)	((n) & 15) // wait states
+#define FLASH_ACR_LATENCY_MASK	15
 
 #define FLASH_KEYR		(_FLASH_BASE + 0x04)
 #define FLASH_KEYR_KEY1		0x45670123
@@ -43,13 +46,18 @@
 #define FLASH_CR_PSIZE_16	(1 << 8)
 #define FLASH_CR_PSIZE_32	(2 << 8)
 #define FLASH_CR_PSIZE_64	(3 << 8)
-#define FLASH_CR_SNB(n)		(((n) & 15) << 3) // sector number
-#define FLASH_CR_MER		(1 << 2) // mass erase
+#define FLASH_CR_MER1		(1 << 15) // bank 2 mass erase
+#define FLASH_CR_SNB(n)		(((n) & 31) << 3) // sector number
+#define FLASH_CR_MER		(1 << 2) // (bank 1) mass erase
 #define FLASH_CR_SER		(1 << 1) // sector erase
 #define FLASH_CR_PG		(1 << 0) // programming
 
 
-#define SECTORS 12
+// dual-bank parts (2MB F42x/43x) repeat the bank 1 layout in
+// bank 2, as sectors 12..23
+#define SECTORS 24
+#define BANK_SECTORS 12
+#define BANK_SIZE 0x00100000
 
 static uint32_t sectors[SECTORS + 1] = {
 	0x00000000,
@@ -65,9 +73,74 @@ static uint32_t sectors[SECTORS + 1] = {
 	0x000C0000,
 	0x000E0000,
 	0x00100000,
+	0x00104000,
+	0x00108000,
+	0x0010C000,
+	0x00110000,
+	0x00120000,
+	0x00140000,
+	0x00160000,
+	0x00180000,
+	0x001A0000,
+	0x001C0000,
+	0x001E0000,
+	0x00200000,
 };
 
+// .bss is not zeroed on agent download
+static int nsectors = BANK_SECTORS;
+
+#define DBGMCU_IDCODE		0xE0042000
+#define FLASH_SIZE_KB		0x1FFF7A22 // F4 device signature (16bit)
+#define RAM_BASE		0x20000000
+
+#define _RCC_BASE		0x40023800
+#define RCC_CR			(_RCC_BASE + 0x00)
+#define RCC_CR_PLLRDY		(1 << 25)
+#define RCC_CR_PLLON		(1 << 24)
+#define RCC_PLLCFGR		(_RCC_BASE + 0x04)
+#define RCC_PLLCFGR_M(n)	((n) & 63)
+#define RCC_PLLCFGR_N(n)	(((n) & 511) << 6)
+#define RCC_PLLCFGR_P(n)	(((((n) / 2) - 1) & 3) << 16)
+#define RCC_PLLCFGR_SRC_HSE	(1 << 22)
+#define RCC_PLLCFGR_Q(n)	(((n) & 15) << 24)
+#define RCC_PLLCFGR_MASK	0x0F437FFF // fields common to all parts
+#define RCC_CFGR		(_RCC_BASE + 0x08)
+#define RCC_CFGR_PPRE1_DIV2	(4 << 10)
+#define RCC_CFGR_PPRE1_MASK	(7 << 10)
+#define RCC_CFGR_SWS_MASK	(3 << 2)
+#define RCC_CFGR_SWS_HSI	(0 << 2)
+#define RCC_CFGR_SWS_PLL	(2 << 2)
+#define RCC_CFGR_SW_MASK	(3 << 0)
+#define RCC_CFGR_SW_PLL		(2 << 0)
+
+#define HSI_HZ			16000000
+
+// contiguous sram from RAM_BASE, by DBGMCU DEV_ID
+static uint32_t sram_size(void) {
+	switch (readl(DBGMCU_IDCODE) & 0xFFF) {
+	case 0x413: return 128 * 1024; // F405/407/415/417
+	case 0x419: return 192 * 1024; // F42x/43x
+	case 0x423: return 64 * 1024;  // F401xB/C
+	case 0x433: return 96 * 1024;  // F401xD/E
+	case 0x431: return 128 * 1024; // F411
+	case 0x421: return 128 * 1024; // F446
+	default: return 0;
+	}
+}
+
 int flash_agent_setup(flash_agent *agent) {
+	uint32_t ram_size = sram_size();
+	if (ram_size) {
+		// use all ram above the agent as the data buffer
+		agent->data_size = (RAM_BASE + ram_size - agent->data_addr) & (~0xFFF);
+	}
+	if (((readl(DBGMCU_IDCODE) & 0xFFF) == 0x419) &&
+		(readw(FLASH_SIZE_KB) == 2048)) {
+		nsectors = SECTORS;
+		agent->flash_size = 2 * BANK_SIZE;
+	}
+
 	writel(FLASH_KEYR_KEY1, FLASH_KEYR);
 	writel(FLASH_KEYR_KEY2, FLASH_KEYR);
 	if (readl(FLASH_CR) & FLASH_CR_LOCK) {
@@ -77,23 +150,47 @@ int flash_agent_setup(flash_agent *agent) {
 	}
 }
 
-int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
+static int flash_wait(void) {
 	uint32_t v;
+	while ((v = readl(FLASH_SR)) & FLASH_SR_BSY) ;
+	writel(0, FLASH_CR);
+	return (v & FLASH_SR_ERRMASK) ? ERR_FAIL : ERR_NONE;
+}
+
+// sectors in bank 2 are numbered from 16 in FLASH_CR.SNB
+static uint32_t sector_snb(int n) {
+	return FLASH_CR_SNB((n < BANK_SECTORS) ? n : (n + 4));
+}
+
+int flash_agent_erase(uint32_t flash_addr, uint32_t length) {
 	int n;
-	for (n = 0; n < SECTORS; n++) {
+	for (n = 0; n < nsectors; n++) {
 		if (flash_addr == sectors[n]) goto ok;
 	}
 	return ERR_ALIGNMENT;
 ok:
+	// a whole bank: bank mass erase is much faster than
+	// erasing its sectors one by one
+	if (((n % BANK_SECTORS) == 0) && (length >= BANK_SIZE)) {
+		uint32_t mer = FLASH_CR_MER1;
+		if (n == 0) {
+			mer = FLASH_CR_MER;
+			if ((nsectors == SECTORS) && (length >= 2 * BANK_SIZE)) {
+				mer |= FLASH_CR_MER1;
+			}
+		}
+		writel(mer | FLASH_CR_PSIZE_32, FLASH_CR);
+		writel(mer | FLASH_CR_PSIZE_32 | FLASH_CR_STRT, FLASH_CR);
+		return flash_wait();
+	}
 	for (;;) {
-		writel(FLASH_CR_SER | FLASH_CR_SNB(n), FLASH_CR);
-		writel(FLASH_CR_STRT | FLASH_CR_SER | FLASH_CR_SNB(n), FLASH_CR);
-		while ((v = readl(FLASH_SR)) & FLASH_SR_BSY) ;
-		if (v & FLASH_SR_ERRMASK) {
+		writel(FLASH_CR_SER | sector_snb(n), FLASH_CR);
+		writel(FLASH_CR_STRT | FLASH_CR_SER | sector_snb(n), FLASH_CR);
+		if (flash_wait() != ERR_NONE) {
 			return ERR_FAIL;
 		}
 		n++;
-		if (n == SECTORS) break;
+		if (n == nsectors) break;
 		if ((sectors[n] - flash_addr) >= length) break;
 	}
 	return ERR_NONE;
@@ -121,19 +218,108 @@ int flash_agent_write(uint32_t flash_addr, const void *_data, uint32_t length) {
 	return ERR_NONE;
 }
 
+static uint32_t saved_acr;
+static uint32_t saved_cfgr;
+static uint32_t saved_pllcfgr;
+
+// HSI/8 x 168 / 4 = 84MHz, which every part in sram_size() runs
+// at the reset voltage scale with 2 wait states (2.7-3.6V) and
+// APB1 at half speed.  Program/erase timing is self-clocked.
+static int clock_boost(uint32_t *hz) {
+	uint32_t cfgr = readl(RCC_CFGR);
+	if (sram_size() == 0) {
+		return ERR_INVALID;
+	}
+	if ((cfgr & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_HSI) {
+		return ERR_FAIL;
+	}
+	saved_acr = readl(FLASH_ACR);
+	saved_cfgr = cfgr;
+	saved_pllcfgr = readl(RCC_PLLCFGR);
+
+	// the agent runs from sram, so caches and prefetch would
+	// only risk stale reads of freshly programmed flash
+	writel((saved_acr & ~FLASH_ACR_LATENCY_MASK) | FLASH_ACR_LATENCY(2),
+		FLASH_ACR);
+	if ((readl(FLASH_ACR) & FLASH_ACR_LATENCY_MASK) != 2) {
+		writel(saved_acr, FLASH_ACR);
+		return ERR_FAIL;
+	}
+	writel((saved_pllcfgr & ~RCC_PLLCFGR_MASK) |
+		RCC_PLLCFGR_M(8) | RCC_PLLCFGR_N(168) |
+		RCC_PLLCFGR_P(4) | RCC_PLLCFGR_Q(7), RCC_PLLCFGR);
+	writel(readl(RCC_CR) | RCC_CR_PLLON, RCC_CR);
+	while (!(readl(RCC_CR) & RCC_CR_PLLRDY)) ;
+	cfgr = (cfgr & ~RCC_CFGR_PPRE1_MASK) | RCC_CFGR_PPRE1_DIV2;
+	writel(cfgr, RCC_CFGR);
+	writel(cfgr | RCC_CFGR_SW_PLL, RCC_CFGR);
+	while ((readl(RCC_CFGR) & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_PLL) ;
+
+	*hz = HSI_HZ / 8 * 168 / 4;
+	return ERR_NONE;
+}
+
+static int clock_restore(void) {
+	writel(saved_cfgr & ~RCC_CFGR_SW_MASK, RCC_CFGR);
+	while ((readl(RCC_CFGR) & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_HSI) ;
+	writel(readl(RCC_CR) & ~RCC_CR_PLLON, RCC_CR);
+	while (readl(RCC_CR) & RCC_CR_PLLRDY) ;
+	writel(saved_pllcfgr, RCC_PLLCFGR);
+	writel(saved_cfgr, RCC_CFGR);
+	writel(saved_acr, FLASH_ACR);
+	return ERR_NONE;
+}
+
+// each bank is 4 x 16K, 1 x 64K, then 128K sectors
+static int get_regions(flash_region *r, uint32_t max) {
+	uint32_t banks = nsectors / BANK_SECTORS;
+	uint32_t n = 0;
+	for (uint32_t b = 0; b < banks; b++) {
+		uint32_t base = FLASH_BASE + b * BANK_SIZE;
+		uint32_t end = base + ((banks > 1) ? BANK_SIZE : FLASH_SIZE);
+		if ((n + 3) > max) {
+			break;
+		}
+		r[n].addr = base;
+		r[n].size = 0x10000;
+		r[n].erase_size = 0x4000;
+		r[n + 1].addr = base + 0x10000;
+		r[n + 1].size = 0x10000;
+		r[n + 1].erase_size = 0x10000;
+		r[n + 2].addr = base + 0x20000;
+		r[n + 2].size = end - (base + 0x20000);
+		r[n + 2].erase_size = 0x20000;
+		r[n].bank = r[n + 1].bank = r[n + 2].bank = b;
+		n += 3;
+	}
+	return n;
+}
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	switch (op) {
+	case OP_GET_REGIONS:
+		return get_regions(ptr, arg0);
+	case OP_CLOCK_BOOST:
+		return clock_boost(ptr);
+	case OP_CLOCK_RESTORE:
+		return clock_restore();
+	case OP_PACK:
+		return pack_words(ptr);
+	default:
+		return ERR_INVALID;
+	}
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
-	.flags =	0,
+	.flags =	FLAG_DOUBLE_BUFFER,
 	.load_addr =	LOADADDR,
 	.data_addr =	LOADADDR + 0x400,
 	.data_size =	0x8000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	FLASH_SIZE,
+	.image_end =	(uint32_t) &__bss_end__,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
@@ -0,0 +1,37 @@
+// agent/crc32.h
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _AGENT_CRC32_H_
+#define _AGENT_CRC32_H_
+
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3, as zlib), shared by agents implementing
+// OP_CRC32 and the host.  Tableless, to keep agents small.
+// Start with crc = 0, pass the result back in to continue.
+static uint32_t crc32_update(uint32_t crc, const void *data, uint32_t len) {
+	const uint8_t *p = data;
+	crc = ~crc;
+	while (len-- > 0) {
+		crc ^= *p++;
+		for (int n = 0; n < 8; n++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (-(crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+#endif
@@ -33,7 +33,7 @@ typedef struct flash_agent {
 	uint32_t flash_addr;
 	uint32_t flash_size; // bytes
 
-	uint32_t reserved0;
+	uint32_t image_end; // end of code, data, and bss (0 if unknown)
 	uint32_t reserved1;
 	uint32_t reserved2;
 	uint32_t reserved3;
@@ -52,6 +52,9 @@ typedef struct flash_agent {
 } flash_agent;
 
 #ifndef _AGENT_HOST_
+// from agent.ld
+extern uint32_t __bss_end__;
+
 int flash_agent_setup(flash_agent *agent);
 int flash_agent_erase(uint32_t flash_addr, uint32_t length);
 int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length);
@@ -70,6 +73,25 @@ int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1);
 #define FLAG_WSZ_4K		0x00001000
 // optional hints as to underlying write block sizes
 
+#define OP_CLOCK_BOOST		1
+#define OP_CLOCK_RESTORE	2
+#define OP_CRC32		3
+#define OP_GET_REGIONS		4
+#define OP_PACK			5
+
+typedef struct flash_region {
+	uint32_t addr;
+	uint32_t size; // bytes
+	uint32_t bank; // independent bank this region belongs to
+	uint32_t erase_size; // erase block size (0 if unknown)
+} flash_region;
+
+#define FLAG_DOUBLE_BUFFER	0x00000002
+// The host may download into one half of the data buffer while
+// fa.write() programs from the other: fa.data_size / 2 meets the
+// write block size requirements, and fa.erase() and fa.write()
+// never touch the buffer outside the range they were given.
+
 #define FLAG_BOOT_ROM_HACK	0x00000001
 // Allow a boot ROM to run after RESET by setting a watchpoint
 // at 0 and running until the watchpoint is hit.  Necessary on
@@ -81,6 +103,10 @@ int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1);
 // fa.load_addr.  The memory below this address will be used as
 // the stack for method calls.  It should be sized appropriately.
 //
+// fa.image_end (&__bss_end__) lets the host check that the data
+// buffer does not overlap the agent's zero-initialized state,
+// which is not part of the downloaded binary.
+//
 // The fa.magic field will be replaced with 0xbe00be00 (two
 // Thumb BKPT instructions) before download to device.
 //
@@ -124,8 +150,36 @@ int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1);
 // possible.
 //
 // fa.ioctl() must return ERR_INVALID if op is unsupported.
-// Currently no ops are defined, but OTP/EEPROM/Config bits are
-// planned to be managed with ioctls.
+// OTP/EEPROM/Config bits are planned to be managed with ioctls.
+//
+// fa.ioctl(OP_CLOCK_BOOST, ptr, 0, 0) may switch the core (and
+// flash controller, if separately clocked) from the reset clock
+// to a faster PLL configuration for the rest of the session, and
+// on success stores the new core clock in Hz to *ptr.  The host
+// may raise the debug clock accordingly.
+//
+// fa.ioctl(OP_CLOCK_RESTORE, 0, 0, 0) returns to the clock
+// configuration in effect before OP_CLOCK_BOOST.  The host must
+// lower the debug clock to its original rate before calling this.
+//
+// fa.ioctl(OP_CRC32, ptr, flash_addr, length) stores the CRC-32
+// (see agent/crc32.h) of the given flash range to *ptr, so the
+// host can verify a write without reading the flash back.
+//
+// fa.ioctl(OP_GET_REGIONS, ptr, max, 0) stores up to max
+// flash_region entries describing the flash to ptr, in address
+// order, and returns the number stored.  Regions with different
+// bank numbers are separately erasable banks (read-while-write):
+// the host splits images at bank boundaries and schedules each
+// bank's erase against transfers for its neighbour.  Agents that
+// do not implement this describe a single bank covering
+// fa.flash_addr .. fa.flash_addr + fa.flash_size.
+//
+// fa.ioctl(OP_PACK, ptr, 0, 0) run-length packs memory (flash,
+// or ram outside the agent) as described by the flash_pack block
+// at ptr (see agent/pack.h), so the host can skip reading erased
+// or zero-filled areas.  It may pack less than asked for: the host
+// calls again from the updated address until done.
 //
 // Bogus parameters may cause failure (ERR_INVALID)
 //
@@ -0,0 +1,93 @@
+// agent/pack.h
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _AGENT_PACK_H_
+#define _AGENT_PACK_H_
+
+#include <stdint.h>
+
+// Parameter block for fa.ioctl(OP_PACK, ptr, 0, 0), followed
+// in memory by space for the packed records.
+typedef struct flash_pack {
+	uint32_t addr;   // in: words to pack, out: advanced past them
+	uint32_t length; // in: bytes to pack (multiple of 4)
+	uint32_t size;   // in: space for records, out: bytes used
+	uint32_t count;  // out: bytes packed
+} flash_pack;
+
+// Records are a header word followed by payload words:
+// PACK_RUN | n, value    n copies of value
+// n, w0 .. wn-1           n literal words
+#define PACK_RUN	0x80000000
+#define PACK_COUNT	0x7FFFFFFF
+
+// runs shorter than this are cheaper as literals
+#define PACK_MIN_RUN	3
+
+// words scanned per step: the agent stops while there is still
+// room for the worst case encoding of one more block
+#define PACK_BLOCK	256
+
+#ifndef _AGENT_HOST_
+static int pack_words(flash_pack *p) {
+	const uint32_t *src = (const uint32_t *) p->addr;
+	uint32_t *out = (uint32_t *) (p + 1);
+	uint32_t max = p->size / 4;
+	uint32_t left = p->length / 4;
+	uint32_t used = 0;
+	uint32_t run = ~0; // index of the open run record
+	uint32_t lit = ~0; // index of the open literal record
+
+	while ((left > 0) && ((max - used) >= (PACK_BLOCK + 2))) {
+		uint32_t blk = (left < PACK_BLOCK) ? left : PACK_BLOCK;
+		left -= blk;
+		while (blk > 0) {
+			uint32_t v = src[0];
+			uint32_t n = 1;
+			while ((n < blk) && (src[n] == v)) {
+				n++;
+			}
+			if ((run != ~0U) && (out[run + 1] == v)) {
+				// continues the previous run (across blocks)
+				out[run] += n;
+			} else if (n >= PACK_MIN_RUN) {
+				run = used;
+				lit = ~0;
+				out[used++] = PACK_RUN | n;
+				out[used++] = v;
+			} else {
+				if (lit == ~0U) {
+					lit = used;
+					run = ~0;
+					out[used++] = 0;
+				}
+				out[lit] += n;
+				for (uint32_t i = 0; i < n; i++) {
+					out[used++] = v;
+				}
+			}
+			src += n;
+			blk -= n;
+		}
+	}
+	p->count = ((uint32_t) src) - p->addr;
+	p->addr = (uint32_t) src;
+	p->size = used * 4;
+	return ERR_NONE;
+}
+#endif
+
+#endif
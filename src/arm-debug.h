@@ -20,6 +20,8 @@
 #define DP_RDBUFF                 0x0C // RO
 #define DP_TARGETSEL              0x0C // WO v2
 
+#define DP_DPIDR_VERSION(n)       (((n) >> 12) & 0xFU)
+
 #define DP_ABORT_DAPABORT         0x01U // Abort Current AP Txn
 #define DP_ABORT_STKCMPCLR        0x02U // clear CS.STICKYCMP
 #define DP_ABORT_STKERRCLR        0x04U // clear CS.STICKYERR
@@ -105,3 +107,74 @@
 #define MAP_CSW_DBG_SW_EN       0x80000000U // Debug SW Access Enable
 
 #define MAP_CSW_KEEP            0xFF00FF00U // preserve mode/type/prot fields
+
+// CoreSight component identification (offsets from component base)
+// see: ARM IHI 0029E, CoreSight Architecture Specification
+
+#define CS_PIDR4   0xFD0
+#define CS_PIDR0   0xFE0
+#define CS_PIDR1   0xFE4
+#define CS_PIDR2   0xFE8
+#define CS_PIDR3   0xFEC
+#define CS_CIDR0   0xFF0
+#define CS_CIDR1   0xFF4
+#define CS_CIDR2   0xFF8
+#define CS_CIDR3   0xFFC
+#define CS_LAR     0xFB0 // WO Lock Access (write CS_LAR_KEY to unlock)
+
+#define CS_LAR_KEY          0xC5ACCE55U
+#define CS_CIDR1_CLASS(n)   (((n) >> 4) & 0xFU)
+#define CS_CLASS_ROMTABLE   0x1U
+#define CS_CLASS_CORESIGHT  0x9U
+#define CS_PIDR_PART(p0,p1) (((p0) & 0xFFU) | (((p1) & 0xFU) << 8))
+
+// ROM table entries (offsets from the table base, ADIv5 format)
+#define CS_ROM_PRESENT      0x00000001U
+#define CS_ROM_FORMAT       0x00000002U // 1 = 32bit format
+#define CS_ROM_OFFSET(n)    ((n) & 0xFFFFF000U) // signed, from table base
+#define CS_ROM_MAX          960 // entries before the ID registers
+
+#define CS_PART_MTB_M0P     0x932U // Micro Trace Buffer (Cortex-M0+)
+#define CS_PART_ETB         0x907U // Embedded Trace Buffer
+
+// MTB (offsets from component base)
+// see: ARM DDI 0486B, CoreSight MTB-M0+ Technical Reference Manual
+#define MTB_POSITION        0x000 // RW write pointer (offset into trace sram)
+#define MTB_MASTER          0x004 // RW
+#define MTB_FLOW            0x008 // RW watermark
+#define MTB_BASE            0x00C // RO address of trace sram
+
+#define MTB_POSITION_WRAP   0x00000004U
+#define MTB_POSITION_PTR(n) ((n) & 0xFFFFFFF8U)
+#define MTB_MASTER_EN       0x80000000U
+#define MTB_MASTER_HALTREQ  0x00000200U
+#define MTB_MASTER_MASK(n)  ((n) & 0x1FU) // buffer is 1 << (MASK + 4) bytes
+
+// packets are two words: branch source | A (exception entry),
+// branch destination | S (first packet after trace start)
+#define MTB_PKT_A           0x00000001U
+#define MTB_PKT_S           0x00000001U
+
+// ETB (offsets from component base)
+// see: ARM DDI 0242B, CoreSight ETB Technical Reference Manual
+#define ETB_RDP             0x004 // RO ram depth (words)
+#define ETB_STS             0x00C // RO status
+#define ETB_RRD             0x010 // RO ram read data (auto-increments RRP)
+#define ETB_RRP             0x014 // RW ram read pointer
+#define ETB_RWP             0x018 // RW ram write pointer
+#define ETB_TRG             0x01C // RW trigger counter
+#define ETB_CTL             0x020 // RW control
+#define ETB_FFSR            0x300 // RO formatter and flush status
+#define ETB_FFCR            0x304 // RW formatter and flush control
+
+#define ETB_STS_FULL        0x00000001U // ram has wrapped
+#define ETB_CTL_CAPTEN      0x00000001U
+#define ETB_FFSR_FTSTOPPED  0x00000002U
+#define ETB_FFCR_ENFTC      0x00000001U // formatting enabled
+#define ETB_FFCR_ENFCONT    0x00000002U // continuous formatting
+#define ETB_FFCR_FONMAN     0x00000040U // manual flush
+#define ETB_FFCR_STOPFL     0x00001000U // stop on flush complete
+
+#define MAP_BASE_PRESENT 0x00000001U
+#define MAP_BASE_FORMAT  0x00000002U // 1 = ADIv5 format
+#define MAP_BASE_ADDR(n) ((n) & 0xFFFFF000U)
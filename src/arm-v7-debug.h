@@ -76,6 +76,53 @@
 // 64..95 S0..S31 (v7M w/ FPU)
 
 
+// Data Watchpoint and Trace unit (v6M has up to 2 comparators)
+#define DWT_CTRL        0xE0001000
+#define DWT_PCSR        0xE000101C // RO sampled pc (~0 when halted)
+#define DWT_COMP(n)     (0xE0001020 + (n) * 16)
+#define DWT_MASK(n)     (0xE0001024 + (n) * 16)
+#define DWT_FUNCTION(n) (0xE0001028 + (n) * 16)
+
+#define DWT_FN_DISABLED 0x00000000
+#define DWT_FN_PC       0x00000004 // halt on instruction fetch
+#define DWT_FN_RD       0x00000005 // halt on data read
+#define DWT_FN_WR       0x00000006 // halt on data write
+#define DWT_FN_RW       0x00000007 // halt on data read or write
+#define DWT_FN_MATCHED  0x01000000 // RO, cleared on read
+
+// Flash Patch and Breakpoint unit (v6M: BPU, same layout as FPB v1)
+#define FP_CTRL         0xE0002000
+#define FP_REMAP        0xE0002004
+#define FP_COMP(n)      (0xE0002008 + (n) * 4)
+
+#define FP_CTRL_ENABLE  0x00000001
+#define FP_CTRL_KEY     0x00000002 // must be 1 for a write to take effect
+#define FP_CTRL_NUM_CODE(n) ((((n) >> 8) & 0x70) | (((n) >> 4) & 0x0F))
+#define FP_CTRL_REV(n)  (((n) >> 28) & 0xF) // 0: v1, 1: v2
+
+// v1: COMP[28:2] match, code region (below 0x20000000) only
+#define FP_COMP_ENABLE  0x00000001
+#define FP_COMP_BP_LO   0x40000000 // break on lower halfword
+#define FP_COMP_BP_HI   0x80000000 // break on upper halfword
+// v2: BPADDR[31:1] match, any address, bit 0 is BE (enable)
+
+// ETM (v7M): program ETMCR with PROG set, then clear it to run
+#define ETM_BASE        0xE0041000
+#define ETM_CR          (ETM_BASE + 0x000)
+#define ETM_SR          (ETM_BASE + 0x010)
+#define ETM_TEEVR       (ETM_BASE + 0x020) // TraceEnable event
+#define ETM_TECR1       (ETM_BASE + 0x024) // TraceEnable control
+#define ETM_TRACEIDR    (ETM_BASE + 0x200)
+#define ETM_LAR         (ETM_BASE + 0xFB0)
+
+#define ETM_CR_PWRDN    0x00000001
+#define ETM_CR_BRANCH   0x00000100 // branch output (all branch addresses)
+#define ETM_CR_PROG     0x00000400
+#define ETM_CR_ETMEN    0x00000800
+#define ETM_SR_PROG     0x00000002
+#define ETM_EVT_ALWAYS  0x0000006F
+#define ETM_TECR1_EXCL  0x01000000 // exclude (nothing): trace everything
+
 #define DEMCR_VC_CORERESET 0x00000001 // Halt on Reset Vector *
 #define DEMCR_VC_MMERR     0x00000010 // Halt on MemManage exception
 #define DEMCR_VC_NOCPERR   0x00000020 // Halt on UsageFault for coproc access
@@ -127,6 +127,32 @@
 // XFER as above but not ValueMatch/MatchMask/TimeStamp
 // Response SHORT(Count) BYTE(Response) WORD(Data)*
 
+#define DAP_UART_Transport 0x1F // BYTE(Transport)
+// Response BYTE(Status)
+#define UART_TRANSPORT_NONE 0
+#define UART_TRANSPORT_USB_COM 1
+#define UART_TRANSPORT_DAP 2
+
+#define DAP_UART_Configure 0x20 // BYTE(Control) WORD(Baudrate)
+// Response BYTE(Status) WORD(Baudrate)
+#define UART_CFG_8N1 0x00
+
+#define DAP_UART_Control 0x22 // BYTE(Control)
+// Response BYTE(Status)
+#define UART_CTL_RX_ENABLE  0x01
+#define UART_CTL_RX_DISABLE 0x02
+#define UART_CTL_RX_FLUSH   0x04
+#define UART_CTL_TX_ENABLE  0x10
+#define UART_CTL_TX_DISABLE 0x20
+#define UART_CTL_TX_FLUSH   0x40
+
+#define DAP_UART_Transfer 0x23 // SHORT(TxCount) BYTE(TxData)*
+// Response BYTE(Status) SHORT(TxCount) SHORT(RxCount) BYTE(RxData)*
+// TxCount in the response is how many bytes the probe accepted
+#define UART_ST_RX_LOST 0x01
+#define UART_ST_FRAMING 0x02
+#define UART_ST_PARITY  0x04
+
 #define DAP_ExecuteCommands 0x7F
 // BYTE(Count) Count x Commands
 // Response BYTE(Count) Count x Responses
@@ -0,0 +1,1330 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "target-profiles.h"
+#include "arm-v7-debug.h"
+#include "arm-v7-system-control.h"
+
+#define _AGENT_HOST_
+#include <agent/flash.h>
+#include <agent/crc32.h>
+#include <agent/pack.h>
+
+int do_reset_stop(DC* dc, CC* cc);
+
+// agent selected with the agent command (overrides target profile)
+static char agent_name[64] = "";
+
+// agent header as read back after setup()
+static flash_agent fa;
+
+// Agentless ("direct") flashing, for controllers that program
+// flash through plain bus writes once enabled: the host drives
+// the registers over SWD and streams data straight to flash.
+// setup() fills in fa.flash_addr, fa.flash_size, and the (uniform)
+// erase block size.
+typedef struct {
+	const char* name;
+	int (*setup)(DC* dc);
+	int (*erase)(DC* dc, uint32_t addr, uint32_t len);
+	int (*write)(DC* dc, uint32_t addr, const uint32_t* data, uint32_t len);
+} direct_flash_t;
+
+static uint32_t direct_erase_size;
+
+#define NVMC_READY		0x4001E400
+#define NVMC_CONFIG		0x4001E504
+#define NVMC_CONFIG_REN		0
+#define NVMC_CONFIG_WEN		1
+#define NVMC_CONFIG_EEN		2
+#define NVMC_ERASEPAGE		0x4001E508
+#define FICR_CODEPAGESIZE	0x10000010
+#define FICR_CODESIZE		0x10000014
+
+// page erase takes up to ~90ms: let the probe spin on READY
+#define NVMC_MATCH_RETRY	65535
+
+static uint32_t nrf52_page_size;
+
+static int nrf52_setup(DC* dc) {
+	uint32_t count;
+	dc_q_init(dc);
+	dc_q_region(dc, DC_Q_RELAXED);
+	dc_q_mem_rd32(dc, FICR_CODEPAGESIZE, &nrf52_page_size);
+	dc_q_mem_rd32(dc, FICR_CODESIZE, &count);
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	if ((nrf52_page_size == 0) || (nrf52_page_size & 3) || (count == 0)) {
+		ERROR("nrf52: bogus FICR page size %u, count %u\n",
+			nrf52_page_size, count);
+		return DBG_ERR;
+	}
+	fa.flash_addr = 0;
+	fa.flash_size = nrf52_page_size * count;
+	direct_erase_size = nrf52_page_size;
+	return 0;
+}
+
+static int nrf52_erase(DC* dc, uint32_t addr, uint32_t len) {
+	unsigned retry;
+	int r;
+	if (addr & (nrf52_page_size - 1)) {
+		ERROR("nrf52: erase not page aligned\n");
+		return DBG_ERR;
+	}
+	retry = dc_set_match_retry(dc, NVMC_MATCH_RETRY);
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, NVMC_CONFIG, NVMC_CONFIG_EEN);
+	for (uint32_t n = 0; n < len; n += nrf52_page_size) {
+		dc_q_mem_wr32(dc, NVMC_ERASEPAGE, addr + n);
+		dc_q_set_mask(dc, 1);
+		dc_q_mem_match32(dc, NVMC_READY, 1);
+	}
+	dc_q_mem_wr32(dc, NVMC_CONFIG, NVMC_CONFIG_REN);
+	r = dc_q_exec(dc);
+	dc_set_match_retry(dc, retry);
+	return r;
+}
+
+// word writes stall the bus (SWD WAIT) while the NVMC is busy,
+// so whole pages stream in auto-increment blocks, with a match
+// on READY between pages
+static int nrf52_write(DC* dc, uint32_t addr, const uint32_t* data, uint32_t len) {
+	unsigned retry;
+	int r;
+	if (addr & 3) {
+		ERROR("nrf52: write not word aligned\n");
+		return DBG_ERR;
+	}
+	retry = dc_set_match_retry(dc, NVMC_MATCH_RETRY);
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, NVMC_CONFIG, NVMC_CONFIG_WEN);
+	len = (len + 3) / 4;
+	while (len > 0) {
+		uint32_t xfer = (nrf52_page_size - (addr & (nrf52_page_size - 1))) / 4;
+		if (xfer > len) {
+			xfer = len;
+		}
+		dc_q_mem_wr_words(dc, addr, xfer, data);
+		dc_q_set_mask(dc, 1);
+		dc_q_mem_match32(dc, NVMC_READY, 1);
+		addr += xfer * 4;
+		data += xfer;
+		len -= xfer;
+	}
+	dc_q_mem_wr32(dc, NVMC_CONFIG, NVMC_CONFIG_REN);
+	r = dc_q_exec(dc);
+	dc_set_match_retry(dc, retry);
+	return r;
+}
+
+static const direct_flash_t direct_drivers[] = {
+	{ "nrf52-nvmc", nrf52_setup, nrf52_erase, nrf52_write },
+};
+
+// set when the current session is agentless
+static const direct_flash_t* direct = NULL;
+
+// ask agents to run the core from a faster clock while programming
+static int agent_boost_enabled = 1;
+static int agent_boosted = 0;
+
+static void *load_agent(const char* name, size_t* sz) {
+	void* data;
+	if ((data = get_builtin_file(name, sz)) != NULL) {
+		void* copy = malloc(*sz);
+		if (copy != NULL) {
+			memcpy(copy, data, *sz);
+		}
+		return copy;
+	}
+	return load_file(name, sz);
+}
+
+// Start an agent method (see include/agent/flash.h for the calling
+// convention).  Register setup and resume go out in one batch.  The
+// host may keep using the memory bus (but not core registers) until
+// agent_finish() waits for the core to hit the BKPT at load_addr.
+static int agent_start(DC* dc, uint32_t func, uint32_t r0, uint32_t r1,
+			uint32_t r2, uint32_t r3) {
+	int r;
+
+	dc_q_init(dc);
+	dc_q_core_reg_wr(dc, 0, r0);
+	dc_q_core_reg_wr(dc, 1, r1);
+	dc_q_core_reg_wr(dc, 2, r2);
+	dc_q_core_reg_wr(dc, 3, r3);
+	dc_q_core_reg_wr(dc, 13, fa.load_addr - 4);
+	dc_q_core_reg_wr(dc, 14, fa.load_addr | 1);
+	dc_q_core_reg_wr(dc, 15, func & ~1);
+	// after reset-stop on a part with garbage at the reset vector
+	// an exception may be active: clear it and give the core a
+	// sane (Thumb) PSR
+	dc_q_mem_wr32(dc, AIRCR, AIRCR_VECTKEY | AIRCR_VECTCLRACTIVE);
+	dc_q_core_reg_wr(dc, 16, 0x01000000);
+	dc_q_mem_wr32(dc, DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN);
+	if ((r = dc_q_exec(dc)) < 0) {
+		ERROR("agent: cannot start method @%08x\n", func);
+	}
+	return r;
+}
+
+static int agent_finish(DC* dc, uint32_t* result) {
+	uint32_t pc = 0;
+	int r;
+
+	if ((r = dc_core_wait_halt(dc)) < 0) {
+		ERROR("agent: method did not complete\n");
+		dc_core_halt(dc);
+		return r;
+	}
+	dc_q_init(dc);
+	dc_q_core_reg_rd(dc, 0, result);
+	dc_q_core_reg_rd(dc, 15, &pc);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	if (pc != fa.load_addr) {
+		ERROR("agent: halted at %08x, not %08x\n", pc, fa.load_addr);
+		return DC_ERR_FAILED;
+	}
+	return 0;
+}
+
+static int agent_invoke(DC* dc, uint32_t func, uint32_t r0, uint32_t r1,
+			uint32_t r2, uint32_t r3, uint32_t* result) {
+	int r;
+	if ((r = agent_start(dc, func, r0, r1, r2, r3)) < 0) {
+		return r;
+	}
+	return agent_finish(dc, result);
+}
+
+// let the boot rom run after reset, halting on its first read
+// of the vector table at 0 (parts with FLAG_BOOT_ROM_HACK need
+// rom initialization of flash timing, etc)
+static int agent_reset_boot_rom(DC* dc) {
+	int r;
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, DEMCR, DEMCR_TRCENA);
+	dc_q_mem_wr32(dc, DWT_COMP(0), 0);
+	dc_q_mem_wr32(dc, DWT_MASK(0), 0);
+	dc_q_mem_wr32(dc, DWT_FUNCTION(0), DWT_FN_RD);
+	dc_q_mem_wr32(dc, AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+	dc_q_exec(dc);
+	r = dc_core_wait_halt(dc);
+	dc_mem_wr32(dc, DWT_FUNCTION(0), DWT_FN_DISABLED);
+	return r;
+}
+
+static int direct_setup(DC* dc) {
+	const target_profile_t* tp = target_current();
+	direct = NULL;
+	if ((tp == NULL) || (tp->direct == NULL)) {
+		ERROR("agent: no direct flash support for this target\n");
+		return DBG_ERR;
+	}
+	for (unsigned n = 0; n < sizeof(direct_drivers)/sizeof(direct_drivers[0]); n++) {
+		if (!strcmp(direct_drivers[n].name, tp->direct)) {
+			direct = direct_drivers + n;
+		}
+	}
+	if (direct == NULL) {
+		ERROR("agent: unknown direct flash driver '%s'\n", tp->direct);
+		return DBG_ERR;
+	}
+	if ((do_reset_stop(dc, NULL) < 0) || (direct->setup(dc) < 0)) {
+		direct = NULL;
+		return DBG_ERR;
+	}
+	INFO("agent: direct (%s), flash %08x..%08x\n", direct->name,
+		fa.flash_addr, fa.flash_addr + fa.flash_size - 1);
+	return 0;
+}
+
+// the data buffer must not overlap the agent's code, data, or
+// bss (older agents do not say where bss ends: use the image)
+static int agent_check_overlap(const char* name, uint32_t sz) {
+	uint32_t end = fa.image_end ? fa.image_end : (fa.load_addr + sz);
+	if ((end < (fa.load_addr + sz)) ||
+		((fa.data_addr < end) && ((fa.data_addr + fa.data_size) > fa.load_addr))) {
+		ERROR("agent: '%s' (%08x..%08x) overlaps its data buffer\n",
+			name, fa.load_addr, end - 1);
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// an agent built for a larger sibling part may put its image or
+// data buffer past the end of this part's ram (when known)
+static int agent_check_ram(const char* name, uint32_t sz) {
+	const target_profile_t* tp = target_current();
+	if ((tp == NULL) || (tp->ram_size == 0)) {
+		return 0;
+	}
+	uint32_t end = tp->ram_addr + tp->ram_size;
+	uint32_t image_end = fa.image_end ? fa.image_end : (fa.load_addr + sz);
+	if ((fa.load_addr < tp->ram_addr) || (image_end > end)) {
+		ERROR("agent: '%s' (%08x..%08x) not within %s ram\n",
+			name, fa.load_addr, image_end - 1, tp->name);
+		return DBG_ERR;
+	}
+	if ((fa.data_addr < tp->ram_addr) || (fa.data_addr > end) ||
+		(fa.data_size > (end - fa.data_addr))) {
+		ERROR("agent: buffer %08x..%08x not within %s ram\n",
+			fa.data_addr, fa.data_addr + fa.data_size - 1, tp->name);
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// reset the target, download the agent, and run its setup()
+static int agent_setup(DC* dc) {
+	const char* name = agent_name;
+	flash_agent* hdr;
+	uint32_t status;
+	size_t sz;
+	int r;
+
+	direct = NULL;
+	if (!strcmp(name, "direct")) {
+		return direct_setup(dc);
+	}
+	if (name[0] == 0) {
+		const target_profile_t* tp = target_current();
+		if ((tp != NULL) && (tp->agent == NULL) && (tp->direct != NULL)) {
+			return direct_setup(dc);
+		}
+		if ((tp == NULL) || (tp->agent == NULL)) {
+			ERROR("agent: none for this target, use: agent <name>\n");
+			return DBG_ERR;
+		}
+		name = tp->agent;
+	}
+	if ((hdr = load_agent(name, &sz)) == NULL) {
+		ERROR("agent: cannot load '%s'\n", name);
+		return DBG_ERR;
+	}
+	if ((sz < sizeof(flash_agent)) || (hdr->magic != AGENT_MAGIC) ||
+		((hdr->version >> 16) != (AGENT_VERSION >> 16))) {
+		ERROR("agent: '%s' is not a valid agent\n", name);
+		goto fail;
+	}
+	memcpy(&fa, hdr, sizeof(fa));
+	if (agent_check_overlap(name, sz) < 0) {
+		goto fail;
+	}
+
+	if ((r = do_reset_stop(dc, NULL)) < 0) {
+		goto fail;
+	}
+	if ((fa.flags & FLAG_BOOT_ROM_HACK) && (agent_reset_boot_rom(dc) < 0)) {
+		ERROR("agent: boot rom did not reach vector table\n");
+		goto fail;
+	}
+
+	// the magic word becomes two BKPTs, where methods return to
+	hdr->magic = 0xbe00be00;
+	if (dc_mem_wr_words(dc, fa.load_addr, (sz + 3) / 4, (void*) hdr) < 0) {
+		ERROR("agent: download failed\n");
+		goto fail;
+	}
+	if ((r = agent_invoke(dc, fa.setup, fa.load_addr, 0, 0, 0, &status)) < 0) {
+		goto fail;
+	}
+	if (status != ERR_NONE) {
+		ERROR("agent: setup() failed (%d)\n", (int) status);
+		goto fail;
+	}
+
+	// setup() may have resized flash and the data buffer
+	if (dc_mem_rd_words(dc, fa.load_addr, sizeof(fa) / 4, (void*) &fa) < 0) {
+		ERROR("agent: cannot read back header\n");
+		goto fail;
+	}
+	if ((fa.data_size == 0) || (fa.data_size & 3)) {
+		ERROR("agent: bogus data buffer size 0x%x\n", fa.data_size);
+		goto fail;
+	}
+	if ((agent_check_overlap(name, sz) < 0) || (agent_check_ram(name, sz) < 0)) {
+		goto fail;
+	}
+	size_t bsz;
+	if ((fa.image_end == 0) && (get_builtin_file(name, &bsz) != NULL)) {
+		// gen/builtins.c was not regenerated with the agent sources
+		INFO("agent: built-in '%s' is stale, rebuild with TOOLCHAIN=arm-none-eabi-\n", name);
+	}
+	INFO("agent: %s, flash %08x..%08x, buffer %u bytes @ %08x\n", name,
+		fa.flash_addr, fa.flash_addr + fa.flash_size - 1,
+		fa.data_size, fa.data_addr);
+	free(hdr);
+	return 0;
+fail:
+	free(hdr);
+	return DBG_ERR;
+}
+
+// optional: raise the core clock (and with it the swd clock)
+// for the rest of the session; agents without OP_CLOCK_BOOST
+// just run at the reset clock
+static void agent_boost(DC* dc) {
+	uint32_t status, hz;
+	agent_boosted = 0;
+	if (!agent_boost_enabled || direct) {
+		return;
+	}
+	if (agent_invoke(dc, fa.ioctl, OP_CLOCK_BOOST, fa.data_addr, 0, 0, &status) < 0) {
+		return;
+	}
+	if (status != ERR_NONE) {
+		if (status != ERR_INVALID) {
+			ERROR("agent: clock boost failed (%d)\n", (int) status);
+		}
+		return;
+	}
+	if (dc_mem_rd32(dc, fa.data_addr, &hz) < 0) {
+		return;
+	}
+	agent_boosted = 1;
+	INFO("agent: core clock %u kHz\n", hz / 1000);
+	swd_clock_boost(dc, hz);
+}
+
+// drop the swd clock first, it may be too fast for the reset clock
+static void agent_unboost(DC* dc) {
+	uint32_t status;
+	if (!agent_boosted) {
+		return;
+	}
+	agent_boosted = 0;
+	swd_clock_restore(dc);
+	if ((agent_invoke(dc, fa.ioctl, OP_CLOCK_RESTORE, 0, 0, 0, &status) < 0) ||
+		(status != ERR_NONE)) {
+		ERROR("agent: cannot restore reset clock\n");
+	}
+}
+
+static int agent_check_range(uint32_t addr, uint32_t len) {
+	if ((addr < fa.flash_addr) ||
+		((addr - fa.flash_addr) > fa.flash_size) ||
+		(len > (fa.flash_size - (addr - fa.flash_addr)))) {
+		ERROR("agent: %08x..%08x not within flash\n", addr, addr + len - 1);
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// with FLAG_DOUBLE_BUFFER the data buffer is used as two halves
+static uint32_t agent_piece_size(void) {
+	if (fa.flags & FLAG_DOUBLE_BUFFER) {
+		return fa.data_size / 2;
+	}
+	return fa.data_size;
+}
+
+static int agent_download(DC* dc, uint32_t buf, uint8_t* data, uint32_t len) {
+	if (len > agent_piece_size()) {
+		len = agent_piece_size();
+	}
+	if (dc_mem_wr_words(dc, buf, (len + 3) / 4, (void*) data) < 0) {
+		ERROR("agent: data download failed\n");
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// erase, and if data is not NULL download its first piece into
+// the data buffer while the agent is busy (see agent_write())
+static int agent_erase_preload(DC* dc, uint32_t addr, uint32_t len, uint8_t* data) {
+	uint32_t status;
+	int r = 0;
+	if (direct) {
+		return direct->erase(dc, addr, len) < 0 ? DBG_ERR : 0;
+	}
+	if (agent_start(dc, fa.erase, addr, len, 0, 0) < 0) {
+		return DBG_ERR;
+	}
+	if (data != NULL) {
+		r = agent_download(dc, fa.data_addr, data, len);
+	}
+	if (agent_finish(dc, &status) < 0) {
+		return DBG_ERR;
+	}
+	if (status != ERR_NONE) {
+		ERROR("agent: erase() failed (%d)\n", (int) status);
+		return DBG_ERR;
+	}
+	return r;
+}
+
+static int agent_erase(DC* dc, uint32_t addr, uint32_t len) {
+	return agent_erase_preload(dc, addr, len, NULL);
+}
+
+// write len bytes (data must have room for padding to a word)
+// in data buffer sized pieces.  With FLAG_DOUBLE_BUFFER the next
+// piece downloads into one half of the buffer while the agent
+// programs from the other.  If preloaded, the first piece is
+// already in the buffer (see agent_erase_preload()).
+static int agent_write(DC* dc, uint32_t addr, uint8_t* data, uint32_t len, int preloaded) {
+	uint32_t piece = agent_piece_size();
+	uint32_t buf = fa.data_addr;
+	uint32_t status;
+	if (direct) {
+		return direct->write(dc, addr, (void*) data, len) < 0 ? DBG_ERR : 0;
+	}
+	if (!preloaded && (len > 0) && (agent_download(dc, buf, data, len) < 0)) {
+		return DBG_ERR;
+	}
+	while (len > 0) {
+		uint32_t xfer = (len > piece) ? piece : len;
+		uint32_t next = buf;
+		int r = 0;
+		if (agent_start(dc, fa.write, addr, buf, xfer, 0) < 0) {
+			return DBG_ERR;
+		}
+		if ((fa.flags & FLAG_DOUBLE_BUFFER) && (len > xfer)) {
+			next = (buf == fa.data_addr) ? (fa.data_addr + piece) : fa.data_addr;
+			r = agent_download(dc, next, data + xfer, len - xfer);
+		}
+		if (agent_finish(dc, &status) < 0) {
+			return DBG_ERR;
+		}
+		if (status != ERR_NONE) {
+			ERROR("agent: write() @%08x failed (%d)\n", addr, (int) status);
+			return DBG_ERR;
+		}
+		if (r < 0) {
+			return DBG_ERR;
+		}
+		addr += xfer;
+		data += xfer;
+		len -= xfer;
+		if ((next == buf) && (len > 0) && (agent_download(dc, buf, data, len) < 0)) {
+			return DBG_ERR;
+		}
+		buf = next;
+	}
+	return 0;
+}
+
+#define MAX_REGIONS 8
+
+// the agent's bank layout, or one bank covering all of flash
+// (erase block size unknown, unless flashing directly)
+static unsigned agent_regions(DC* dc, flash_region* rgn, unsigned max) {
+	uint32_t status;
+	if (!direct &&
+		(agent_invoke(dc, fa.ioctl, OP_GET_REGIONS, fa.data_addr, max, 0, &status) == 0) &&
+		((int) status > 0)) {
+		if (status > max) {
+			status = max;
+		}
+		if (dc_mem_rd_words(dc, fa.data_addr, status * sizeof(flash_region) / 4,
+			(void*) rgn) == 0) {
+			return status;
+		}
+	}
+	rgn[0].addr = fa.flash_addr;
+	rgn[0].size = fa.flash_size;
+	rgn[0].bank = 0;
+	rgn[0].erase_size = direct ? direct_erase_size : 0;
+	return 1;
+}
+
+// length of the part of addr..addr+len that lies in addr's bank
+static uint32_t agent_bank_clip(flash_region* rgn, unsigned n, uint32_t addr, uint32_t len) {
+	for (unsigned i = 0; i < n; i++) {
+		if ((addr - rgn[i].addr) < rgn[i].size) {
+			uint32_t end = rgn[i].addr + rgn[i].size;
+			while ((++i < n) && (rgn[i].bank == rgn[i - 1].bank) && (rgn[i].addr == end)) {
+				end += rgn[i].size;
+			}
+			return (len > (end - addr)) ? (end - addr) : len;
+		}
+	}
+	return len;
+}
+
+// flash is memory-mapped: CRC a read back on the host
+static int direct_crc32(DC* dc, uint32_t addr, uint32_t len, uint32_t* crc) {
+	uint32_t* buf;
+	int r;
+	if ((buf = malloc(len + 4)) == NULL) {
+		return DBG_ERR;
+	}
+	if ((r = dc_mem_rd_words(dc, addr, (len + 3) / 4, buf)) == 0) {
+		*crc = crc32_update(0, buf, len);
+	}
+	free(buf);
+	return r;
+}
+
+// CRC-32 of a flash range, from the agent or a read back
+// (agents without OP_CRC32 fall back to reading flash back)
+static int agent_crc32(DC* dc, uint32_t addr, uint32_t len, uint32_t* crc) {
+	uint32_t status = ERR_INVALID;
+	if (!direct &&
+		(agent_invoke(dc, fa.ioctl, OP_CRC32, fa.data_addr, addr, len, &status) < 0)) {
+		return DBG_ERR;
+	}
+	if (status == ERR_INVALID) {
+		if (direct_crc32(dc, addr, len, crc) < 0) {
+			ERROR("agent: cannot read back flash\n");
+			return DBG_ERR;
+		}
+		return 0;
+	}
+	if ((status != ERR_NONE) || (dc_mem_rd32(dc, fa.data_addr, crc) < 0)) {
+		ERROR("agent: crc32() failed (%d)\n", (int) status);
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// compare the agent's CRC of a flash range with the host's
+static int agent_verify(DC* dc, uint32_t addr, const void* data, uint32_t len) {
+	uint32_t crc;
+	if (agent_crc32(dc, addr, len, &crc) < 0) {
+		return DBG_ERR;
+	}
+	if (crc != crc32_update(0, data, len)) {
+		ERROR("agent: verify failed @%08x..%08x\n", addr, addr + len - 1);
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// Erase and program one bank at a time: each bank is erased while
+// its first piece of data downloads, then programmed with downloads
+// running ahead.  data must have room to pad its tail to a word.
+static int agent_program(DC* dc, flash_region* rgn, unsigned nrgn,
+			uint32_t addr, uint8_t* data, uint32_t sz) {
+	uint32_t off, len;
+	for (off = 0; off < sz; off += len) {
+		uint32_t a = addr + off;
+		len = agent_bank_clip(rgn, nrgn, a, sz - off);
+		INFO("flash: erasing %08x..%08x\n", a, a + len - 1);
+		if (agent_erase_preload(dc, a, len, data + off) < 0) return DBG_ERR;
+		INFO("flash: writing %u bytes\n", len);
+		if (agent_write(dc, a, data + off, len, 1) < 0) return DBG_ERR;
+	}
+	return 0;
+}
+
+int do_agent(DC* dc, CC* cc) {
+	const char* name;
+	if (cmd_arg_str_opt(cc, 1, &name, NULL) || (name == NULL)) {
+		INFO("agent: %s, clock boost %s\n",
+			agent_name[0] ? agent_name : "(from target profile)",
+			agent_boost_enabled ? "on" : "off");
+		for (unsigned n = 0; (name = get_builtin_filename(n)) != NULL; n++) {
+			INFO("builtin: %s\n", name);
+		}
+		return 0;
+	}
+	if (!strcmp(name, "boost")) {
+		agent_boost_enabled = 1;
+	} else if (!strcmp(name, "noboost")) {
+		agent_boost_enabled = 0;
+	} else if (!strcmp(name, "auto")) {
+		agent_name[0] = 0;
+	} else if (strlen(name) < sizeof(agent_name)) {
+		strcpy(agent_name, name);
+	} else {
+		ERROR("agent: name too long\n");
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+int do_erase(DC* dc, CC* cc) {
+	uint32_t addr, len;
+	int r;
+	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
+	if (cmd_arg_u32(cc, 2, &len)) return DBG_ERR;
+	if (agent_setup(dc) < 0) return DBG_ERR;
+	if (agent_check_range(addr, len) < 0) return DBG_ERR;
+	agent_boost(dc);
+	INFO("erase: %08x..%08x\n", addr, addr + len - 1);
+	r = agent_erase(dc, addr, len);
+	agent_unboost(dc);
+	return r;
+}
+
+// expand packed records into exactly nout words
+static int agent_unpack(uint32_t* rec, uint32_t nrec, uint32_t* out, uint32_t nout) {
+	uint32_t i = 0;
+	while (i < nrec) {
+		uint32_t hdr = rec[i++];
+		uint32_t n = hdr & PACK_COUNT;
+		if (n > nout) {
+			return DBG_ERR;
+		}
+		if (hdr & PACK_RUN) {
+			if (i == nrec) {
+				return DBG_ERR;
+			}
+			for (uint32_t v = rec[i++], k = 0; k < n; k++) {
+				out[k] = v;
+			}
+		} else {
+			if (n > (nrec - i)) {
+				return DBG_ERR;
+			}
+			memcpy(out, rec + i, n * 4);
+			i += n;
+		}
+		out += n;
+		nout -= n;
+	}
+	return nout ? DBG_ERR : 0;
+}
+
+// The agent scans memory in blocks and sends uniform stretches
+// (erased flash, zeroed ram) as run records, so only the data
+// that is actually there crosses the wire.
+int agent_upload(DC* dc, uint32_t addr, uint32_t len, void* data) {
+	uint32_t* out = data;
+	uint32_t* rec = NULL;
+	uint32_t cap, status;
+	flash_pack pk;
+	int r = DBG_ERR;
+
+	if (agent_setup(dc) < 0) {
+		return DBG_ERR;
+	}
+	if (direct) {
+		ERROR("agent: direct mode cannot pack\n");
+		return DBG_ERR;
+	}
+	// the agent, its stack (below load_addr), and its buffer
+	if ((addr < (fa.data_addr + fa.data_size)) &&
+		((addr + len) > (fa.load_addr - 0x400))) {
+		ERROR("agent: %08x..%08x overlaps the agent\n", addr, addr + len - 1);
+		return DBG_ERR;
+	}
+	cap = (fa.data_size - sizeof(pk)) & ~3;
+	if ((rec = malloc(cap)) == NULL) {
+		return DBG_ERR;
+	}
+	agent_boost(dc);
+	while (len > 0) {
+		pk.addr = addr;
+		pk.length = len;
+		pk.size = cap;
+		pk.count = 0;
+		if (dc_mem_wr_words(dc, fa.data_addr, sizeof(pk) / 4, (void*) &pk) < 0) {
+			goto done;
+		}
+		if (agent_invoke(dc, fa.ioctl, OP_PACK, fa.data_addr, 0, 0, &status) < 0) {
+			goto done;
+		}
+		if (status != ERR_NONE) {
+			ERROR("agent: cannot pack (%d)\n", (int) status);
+			goto done;
+		}
+		if (dc_mem_rd_words(dc, fa.data_addr, sizeof(pk) / 4, (void*) &pk) < 0) {
+			goto done;
+		}
+		if ((pk.count == 0) || (pk.count > len) || (pk.count & 3) || (pk.size > cap)) {
+			ERROR("agent: bogus pack result\n");
+			goto done;
+		}
+		if (dc_mem_rd_words(dc, fa.data_addr + sizeof(pk), pk.size / 4, rec) < 0) {
+			goto done;
+		}
+		if (agent_unpack(rec, pk.size / 4, out, pk.count / 4) < 0) {
+			ERROR("agent: corrupt pack records\n");
+			goto done;
+		}
+		addr += pk.count;
+		len -= pk.count;
+		out += pk.count / 4;
+	}
+	r = 0;
+done:
+	agent_unboost(dc);
+	free(rec);
+	return r;
+}
+
+int do_flash(DC* dc, CC* cc) {
+	int status = DBG_ERR;
+	const char* fn;
+	const char* opt;
+	uint32_t addr;
+	uint8_t* data;
+	long long t0, t1;
+	size_t sz;
+	flash_region rgn[MAX_REGIONS];
+	unsigned nrgn;
+
+	if (cmd_arg_str(cc, 1, &fn)) return DBG_ERR;
+	if (cmd_arg_u32(cc, 2, &addr)) return DBG_ERR;
+	cmd_arg_str_opt(cc, 3, &opt, "");
+	if (opt[0] && strcmp(opt, "verify")) {
+		ERROR("flash <file> <addr> [ verify ]\n");
+		return DBG_ERR;
+	}
+
+	if ((data = load_file(fn, &sz)) == NULL) {
+		ERROR("cannot read '%s'\n", fn);
+		return DBG_ERR;
+	}
+	// load_file() leaves room to pad the tail to a word
+	memset(data + sz, 0, 4);
+
+	if (agent_setup(dc) < 0) goto done;
+	if (agent_check_range(addr, sz) < 0) goto done;
+
+	agent_boost(dc);
+	t0 = now();
+	nrgn = agent_regions(dc, rgn, MAX_REGIONS);
+	if (agent_program(dc, rgn, nrgn, addr, data, sz) < 0) goto done;
+	if (opt[0] && (agent_verify(dc, addr, data, sz) < 0)) goto done;
+	t1 = now();
+	INFO("flash: %lld uS -> %lld B/s\n", (t1 - t0),
+		(((long long)sz) * 1000000LL) / (t1 - t0));
+	status = 0;
+done:
+	agent_unboost(dc);
+	free(data);
+	return status;
+}
+
+// Flash several images in one agent session, from a manifest:
+//
+//   # comment
+//   <file> <addr> [ skip-same ] [ verify ]
+//
+// Relative file names are relative to the manifest.  Images that
+// share an erase block are merged so each block is erased once, and
+// verification is a single pass at the end.  Spans are widened to
+// whole erase blocks: flash around and between the images is read
+// back and rewritten as it was.  A merged span is only skipped if
+// every image in it is skip-same and already matches.  This needs
+// the erase block sizes (OP_GET_REGIONS): without them only a
+// single image is flashed, as the flash command would.
+typedef struct {
+	uint32_t addr;
+	uint32_t len;
+	uint8_t* data;
+	uint8_t skip_same;
+	uint8_t verify;
+} manifest_image_t;
+
+#define MAX_IMAGES 16
+
+// start (and optionally size) of the erase block holding addr,
+// or addr itself (and size 0) if the agent did not say
+static uint32_t manifest_block(flash_region* rgn, unsigned nrgn, uint32_t addr,
+				uint32_t* bsize) {
+	for (unsigned i = 0; i < nrgn; i++) {
+		if (((addr - rgn[i].addr) < rgn[i].size) && rgn[i].erase_size) {
+			uint32_t size = rgn[i].erase_size;
+			if (bsize) {
+				*bsize = size;
+			}
+			return rgn[i].addr + ((addr - rgn[i].addr) / size) * size;
+		}
+	}
+	if (bsize) {
+		*bsize = 0;
+	}
+	return addr;
+}
+
+// fill the parts of span (flash from addr to end) not covered by
+// images first..last with the current flash contents, then copy
+// the images in
+static int manifest_fill(DC* dc, manifest_image_t* img, unsigned first, unsigned last,
+			uint8_t* span, uint32_t addr, uint32_t end) {
+	uint32_t pos = addr;
+	for (unsigned i = first; i <= (last + 1); i++) {
+		uint32_t hole = (i <= last) ? img[i].addr : end;
+		if (hole > pos) {
+			uint32_t lo = pos & ~3;
+			uint32_t hi = (hole + 3) & ~3;
+			if (dc_mem_rd_words(dc, lo, (hi - lo) / 4, (void*) (span + (lo - addr))) < 0) {
+				ERROR("flash: cannot read back %08x..%08x\n", lo, hi - 1);
+				return DBG_ERR;
+			}
+		}
+		if (i <= last) {
+			pos = img[i].addr + img[i].len;
+		}
+	}
+	for (unsigned i = first; i <= last; i++) {
+		memcpy(span + (img[i].addr - addr), img[i].data, img[i].len);
+	}
+	return 0;
+}
+
+static int manifest_cmp(const void* a, const void* b) {
+	const manifest_image_t* x = a;
+	const manifest_image_t* y = b;
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int manifest_load(const char* mfn, manifest_image_t* img, unsigned* count) {
+	const char* slash = strrchr(mfn, '/');
+	char path[1024];
+	char* text;
+	char* line;
+	char* next;
+	unsigned n = 0, lineno = 0;
+	size_t sz;
+	int r = DBG_ERR;
+
+	if ((text = load_file(mfn, &sz)) == NULL) {
+		ERROR("cannot read '%s'\n", mfn);
+		return DBG_ERR;
+	}
+	text[sz] = 0;
+	for (line = text; line != NULL; line = next) {
+		char* save;
+		char* tok;
+		char* end;
+		size_t isz;
+		if ((next = strchr(line, '\n')) != NULL) {
+			*next++ = 0;
+		}
+		lineno++;
+		if (strchr(line, '#')) {
+			*strchr(line, '#') = 0;
+		}
+		if ((tok = strtok_r(line, " \t\r", &save)) == NULL) {
+			continue;
+		}
+		if (n == MAX_IMAGES) {
+			ERROR("%s:%u: too many images\n", mfn, lineno);
+			goto done;
+		}
+		if ((tok[0] != '/') && (slash != NULL)) {
+			snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - mfn), mfn, tok);
+		} else {
+			snprintf(path, sizeof(path), "%s", tok);
+		}
+		memset(img + n, 0, sizeof(*img));
+		if ((tok = strtok_r(NULL, " \t\r", &save)) != NULL) {
+			img[n].addr = strtoul(tok, &end, 0);
+		}
+		if ((tok == NULL) || *end) {
+			ERROR("%s:%u: expected <file> <addr>\n", mfn, lineno);
+			goto done;
+		}
+		while ((tok = strtok_r(NULL, " \t\r", &save)) != NULL) {
+			if (!strcmp(tok, "skip-same")) {
+				img[n].skip_same = 1;
+			} else if (!strcmp(tok, "verify")) {
+				img[n].verify = 1;
+			} else {
+				ERROR("%s:%u: unknown option '%s'\n", mfn, lineno, tok);
+				goto done;
+			}
+		}
+		if ((img[n].data = load_file(path, &isz)) == NULL) {
+			ERROR("%s:%u: cannot read '%s'\n", mfn, lineno, path);
+			goto done;
+		}
+		img[n].len = isz;
+		n++;
+		if (img[n - 1].len == 0) {
+			ERROR("%s:%u: '%s' is empty\n", mfn, lineno, path);
+			goto done;
+		}
+	}
+	qsort(img, n, sizeof(*img), manifest_cmp);
+	for (unsigned i = 1; i < n; i++) {
+		if ((img[i].addr - img[i - 1].addr) < img[i - 1].len) {
+			ERROR("manifest: images @%08x and @%08x overlap\n",
+				img[i - 1].addr, img[i].addr);
+			goto done;
+		}
+	}
+	r = 0;
+done:
+	*count = n;
+	free(text);
+	return r;
+}
+
+// does the image already match flash?
+static int manifest_same(DC* dc, manifest_image_t* img) {
+	uint32_t crc;
+	if (agent_crc32(dc, img->addr, img->len, &crc) < 0) {
+		return 0;
+	}
+	return crc == crc32_update(0, img->data, img->len);
+}
+
+int do_flash_manifest(DC* dc, CC* cc) {
+	manifest_image_t img[MAX_IMAGES];
+	flash_region rgn[MAX_REGIONS];
+	unsigned count = 0, nrgn, first, last;
+	uint32_t total = 0;
+	int known = 1;
+	long long t0, t1;
+	const char* mfn;
+	uint8_t* span;
+	int status = DBG_ERR;
+	int r;
+
+	if (cmd_arg_str(cc, 1, &mfn)) return DBG_ERR;
+	if (manifest_load(mfn, img, &count) < 0) goto done;
+	if (count == 0) {
+		ERROR("manifest: no images\n");
+		goto done;
+	}
+
+	if (agent_setup(dc) < 0) goto done;
+	for (unsigned i = 0; i < count; i++) {
+		if (agent_check_range(img[i].addr, img[i].len) < 0) goto done;
+	}
+	agent_boost(dc);
+	t0 = now();
+	nrgn = agent_regions(dc, rgn, MAX_REGIONS);
+	for (unsigned i = 0; i < count; i++) {
+		uint32_t size0, size1;
+		manifest_block(rgn, nrgn, img[i].addr, &size0);
+		manifest_block(rgn, nrgn, img[i].addr + img[i].len - 1, &size1);
+		known = known && size0 && size1;
+	}
+	if (!known) {
+		if (count > 1) {
+			ERROR("manifest: agent does not report erase block sizes, "
+				"flash the images one at a time\n");
+			goto done;
+		}
+		INFO("manifest: erase block size unknown, flash beside the image "
+			"in its erase blocks is not preserved\n");
+	}
+
+	for (first = 0; first < count; first = last + 1) {
+		uint32_t addr = img[first].addr;
+		uint32_t end = addr + img[first].len;
+		int skip = img[first].skip_same;
+
+		// extend the span while the next image starts in the
+		// erase block the span ends in
+		for (last = first; (last + 1) < count; last++) {
+			if (manifest_block(rgn, nrgn, img[last + 1].addr, NULL) !=
+				manifest_block(rgn, nrgn, end - 1, NULL)) {
+				break;
+			}
+			end = img[last + 1].addr + img[last + 1].len;
+		}
+		for (unsigned i = first; skip && (i <= last); i++) {
+			skip = img[i].skip_same && manifest_same(dc, img + i);
+		}
+		if (skip) {
+			INFO("flash: %08x..%08x unchanged, skipped\n", addr, end - 1);
+			for (unsigned i = first; i <= last; i++) {
+				img[i].verify = 0;
+			}
+			continue;
+		}
+
+		// widen to whole erase blocks (within flash)
+		if (known) {
+			uint32_t size;
+			addr = manifest_block(rgn, nrgn, addr, NULL);
+			end = manifest_block(rgn, nrgn, end - 1, &size) + size;
+		}
+		if ((end - fa.flash_addr) > fa.flash_size) {
+			end = fa.flash_addr + fa.flash_size;
+		}
+		if ((span = malloc(end - addr + 4)) == NULL) {
+			ERROR("out of memory\n");
+			goto done;
+		}
+		memset(span + (end - addr), 0, 4);
+		if ((r = manifest_fill(dc, img, first, last, span, addr, end)) == 0) {
+			r = agent_program(dc, rgn, nrgn, addr, span, end - addr);
+		}
+		free(span);
+		if (r < 0) goto done;
+		total += end - addr;
+	}
+	for (unsigned i = 0; i < count; i++) {
+		if (img[i].verify && (agent_verify(dc, img[i].addr, img[i].data, img[i].len) < 0)) {
+			goto done;
+		}
+	}
+	t1 = now();
+	INFO("flash: %u bytes, %lld uS -> %lld B/s\n", total, (t1 - t0),
+		(((long long)total) * 1000000LL) / (t1 - t0));
+	status = 0;
+done:
+	agent_unboost(dc);
+	for (unsigned i = 0; i < count; i++) {
+		free(img[i].data);
+	}
+	return status;
+}
+
+// Mass erase through debug-port mechanisms: vendor access ports,
+// or the flash controller's own mass erase driven by bus writes.
+// Completion is polled by the probe (value match), and the host
+// keeps re-issuing the match for slow parts.
+typedef struct {
+	const char* name;
+	int (*erase)(DC* dc);
+} mass_erase_t;
+
+#define MASSERASE_TIMEOUT_US 60000000LL
+
+// wait for (reg & mask) == val, where reg is an AP register
+// (is_ap) or a word of target memory
+static int masserase_wait(DC* dc, int is_ap, uint32_t addr, uint32_t mask, uint32_t val) {
+	long long deadline = now() + MASSERASE_TIMEOUT_US;
+	unsigned retry = dc_set_match_retry(dc, 65535);
+	uint32_t v;
+	int r;
+	for (;;) {
+		dc_q_init(dc);
+		if (is_ap) {
+			dc_q_ap_rd(dc, addr, &v);
+		} else {
+			dc_q_mem_rd32(dc, addr, &v);
+		}
+		if ((r = dc_q_exec(dc)) < 0) {
+			break;
+		}
+		if ((v & mask) == val) {
+			break;
+		}
+		if (now() > deadline) {
+			r = DC_ERR_TIMEOUT;
+			break;
+		}
+		dc_q_init(dc);
+		dc_q_poll(dc);
+		dc_q_set_mask(dc, mask);
+		if (is_ap) {
+			dc_q_ap_match(dc, addr, val);
+		} else {
+			dc_q_mem_match32(dc, addr, val);
+		}
+		if (((r = dc_q_exec(dc)) == 0) || (r != DC_ERR_MATCH)) {
+			break;
+		}
+	}
+	dc_set_match_retry(dc, retry);
+	return r;
+}
+
+// nRF52 CTRL-AP (AP #1): works even with APPROTECT enabled
+#define NRF_CTRLAP_RESET		0x100
+#define NRF_CTRLAP_ERASEALL		0x104
+#define NRF_CTRLAP_ERASEALLSTATUS	0x108
+#define NRF_CTRLAP_IDR			0x1FC
+#define NRF_CTRLAP_IDR_VALUE		0x02880000
+
+static int nrf52_ctrlap_erase(DC* dc) {
+	uint32_t idr;
+	int r;
+	if ((r = dc_ap_rd(dc, NRF_CTRLAP_IDR, &idr)) < 0) {
+		return r;
+	}
+	if (idr != NRF_CTRLAP_IDR_VALUE) {
+		ERROR("masserase: AP1 is not a CTRL-AP (IDR %08x)\n", idr);
+		return DBG_ERR;
+	}
+	if ((r = dc_ap_wr(dc, NRF_CTRLAP_ERASEALL, 1)) < 0) {
+		return r;
+	}
+	if ((r = masserase_wait(dc, 1, NRF_CTRLAP_ERASEALLSTATUS, 1, 0)) < 0) {
+		return r;
+	}
+	// pulse the soft reset so the part comes back up erased
+	dc_q_init(dc);
+	dc_q_ap_wr(dc, NRF_CTRLAP_RESET, 1);
+	dc_q_ap_wr(dc, NRF_CTRLAP_RESET, 0);
+	dc_q_ap_wr(dc, NRF_CTRLAP_ERASEALL, 0);
+	return dc_q_exec(dc);
+}
+
+#define STM32F0_FLASH_KEYR	0x40022004
+#define STM32F0_FLASH_SR	0x4002200C
+#define STM32F0_FLASH_CR	0x40022010
+#define STM32F0_SR_BSY		(1 << 0)
+#define STM32F0_SR_ERRORS	0x14 // WRPRTERR, PGERR
+#define STM32F0_CR_MER		(1 << 2)
+#define STM32F0_CR_STRT		(1 << 6)
+#define STM32F0_CR_LOCK		(1 << 7)
+
+#define STM32F4_FLASH_KEYR	0x40023C04
+#define STM32F4_FLASH_SR	0x40023C0C
+#define STM32F4_FLASH_CR	0x40023C10
+#define STM32F4_SR_BSY		(1 << 16)
+#define STM32F4_SR_ERRORS	0xF2 // PGSERR, PGPERR, PGAERR, WRPERR, OPERR
+#define STM32F4_CR_MER		(1 << 2)
+#define STM32F4_CR_PSIZE_32	(2 << 8)
+#define STM32F4_CR_MER1		(1 << 15) // second bank (F42x/43x)
+#define STM32F4_CR_STRT		(1 << 16)
+#define STM32F4_CR_LOCK		(1U << 31)
+#define STM32F4_DBGMCU_IDCODE	0xE0042000
+
+#define STM32_FLASH_KEY1	0x45670123
+#define STM32_FLASH_KEY2	0xCDEF89AB
+
+// after BSY clears, any error flag means the erase did not happen
+static int stm32_check_sr(DC* dc, uint32_t sr_addr, uint32_t errors, int r) {
+	uint32_t sr;
+	if (r < 0) {
+		return r;
+	}
+	if ((r = dc_mem_rd32(dc, sr_addr, &sr)) < 0) {
+		return r;
+	}
+	if (sr & errors) {
+		ERROR("masserase: flash error (SR %08x)\n", sr);
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// Halt the core, so firmware cannot race us on the flash controller
+// (or run from flash being erased), and unlock the controller unless
+// it already is: a key sequence while unlocked is a bus error that
+// locks it until reset.
+static int stm32_unlock(DC* dc, uint32_t keyr, uint32_t cr_addr, uint32_t lock) {
+	uint32_t cr;
+	int r;
+	if ((r = dc_core_halt(dc)) < 0) {
+		return r;
+	}
+	if ((r = dc_mem_rd32(dc, cr_addr, &cr)) < 0) {
+		return r;
+	}
+	if (!(cr & lock)) {
+		return 0;
+	}
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, keyr, STM32_FLASH_KEY1);
+	dc_q_mem_wr32(dc, keyr, STM32_FLASH_KEY2);
+	dc_q_mem_rd32(dc, cr_addr, &cr);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	if (cr & lock) {
+		ERROR("masserase: flash controller stays locked (reset the target)\n");
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// error flags left over from earlier operations are cleared
+// (write one to clear) so they neither block nor fail this one
+static int stm32f0_erase(DC* dc) {
+	int r;
+	if ((r = stm32_unlock(dc, STM32F0_FLASH_KEYR, STM32F0_FLASH_CR, STM32F0_CR_LOCK)) < 0) {
+		return r;
+	}
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, STM32F0_FLASH_SR, STM32F0_SR_ERRORS);
+	dc_q_mem_wr32(dc, STM32F0_FLASH_CR, STM32F0_CR_MER);
+	dc_q_mem_wr32(dc, STM32F0_FLASH_CR, STM32F0_CR_MER | STM32F0_CR_STRT);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	r = masserase_wait(dc, 0, STM32F0_FLASH_SR, STM32F0_SR_BSY, 0);
+	r = stm32_check_sr(dc, STM32F0_FLASH_SR, STM32F0_SR_ERRORS, r);
+	dc_mem_wr32(dc, STM32F0_FLASH_CR, STM32F0_CR_LOCK);
+	return r;
+}
+
+static int stm32f4_erase(DC* dc) {
+	uint32_t cr = STM32F4_CR_MER | STM32F4_CR_PSIZE_32;
+	uint32_t id;
+	int r;
+	if ((r = dc_mem_rd32(dc, STM32F4_DBGMCU_IDCODE, &id)) < 0) {
+		return r;
+	}
+	if ((id & 0xFFF) == 0x419) {
+		cr |= STM32F4_CR_MER1;
+	}
+	if ((r = stm32_unlock(dc, STM32F4_FLASH_KEYR, STM32F4_FLASH_CR, STM32F4_CR_LOCK)) < 0) {
+		return r;
+	}
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, STM32F4_FLASH_SR, STM32F4_SR_ERRORS);
+	dc_q_mem_wr32(dc, STM32F4_FLASH_CR, cr);
+	dc_q_mem_wr32(dc, STM32F4_FLASH_CR, cr | STM32F4_CR_STRT);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	r = masserase_wait(dc, 0, STM32F4_FLASH_SR, STM32F4_SR_BSY, 0);
+	r = stm32_check_sr(dc, STM32F4_FLASH_SR, STM32F4_SR_ERRORS, r);
+	dc_mem_wr32(dc, STM32F4_FLASH_CR, STM32F4_CR_LOCK);
+	return r;
+}
+
+static const mass_erase_t mass_erasers[] = {
+	{ "nrf52-ctrlap", nrf52_ctrlap_erase },
+	{ "stm32f0", stm32f0_erase },
+	{ "stm32f4", stm32f4_erase },
+};
+
+static const mass_erase_t* masserase_find(const char* name) {
+	for (unsigned n = 0; n < sizeof(mass_erasers)/sizeof(mass_erasers[0]); n++) {
+		if (!strcmp(mass_erasers[n].name, name)) {
+			return mass_erasers + n;
+		}
+	}
+	return NULL;
+}
+
+// The method comes from the command line, the target profile, or
+// failing those an nRF52 CTRL-AP found by its IDR (a part locked by
+// APPROTECT cannot be identified through its FICR, so it gets no
+// profile).  Otherwise the agent erases all of flash.
+int do_masserase(DC* dc, CC* cc) {
+	const target_profile_t* tp = target_current();
+	const mass_erase_t* me = NULL;
+	long long t0 = now();
+	const char* name;
+	uint32_t idr;
+	int r;
+
+	if (cmd_arg_str_opt(cc, 1, &name, NULL)) return DBG_ERR;
+	if (name != NULL) {
+		if ((me = masserase_find(name)) == NULL) {
+			ERROR("masserase: unknown method '%s'\n", name);
+			return DBG_ERR;
+		}
+	} else if ((tp != NULL) && (tp->masserase != NULL)) {
+		me = masserase_find(tp->masserase);
+	} else if ((dc_ap_rd(dc, NRF_CTRLAP_IDR, &idr) == 0) && (idr == NRF_CTRLAP_IDR_VALUE)) {
+		me = masserase_find("nrf52-ctrlap");
+	}
+	if (me != NULL) {
+		INFO("masserase: %s\n", me->name);
+		if ((r = me->erase(dc)) < 0) {
+			ERROR("masserase: failed (%d)\n", r);
+			return DBG_ERR;
+		}
+		INFO("masserase: done in %lld ms, reset required\n", (now() - t0) / 1000);
+		return 0;
+	}
+
+	// no debug-port mechanism: erase the whole range with the agent
+	INFO("masserase: no debug-port method, using flash agent\n");
+	if (agent_setup(dc) < 0) return DBG_ERR;
+	agent_boost(dc);
+	r = agent_erase(dc, fa.flash_addr, fa.flash_size);
+	agent_unboost(dc);
+	if (r == 0) {
+		INFO("masserase: done in %lld ms\n", (now() - t0) / 1000);
+	}
+	return r;
+}
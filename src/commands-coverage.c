@@ -0,0 +1,411 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// strdup()
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "arm-v7-debug.h"
+
+// Sampling code coverage without instrumentation.  The free FPB
+// comparators rotate over the basic blocks not yet seen: a comparator
+// is retired as soon as its block executes (halting once), and every
+// pass of the loop is one batch that re-arms retired comparators,
+// resumes the core if it stopped on one, and reads a run of DWT_PCSR
+// samples plus DHCSR.  Sampled pcs retire blocks too, armed or not.
+//
+// Blocks are loaded from a text file, one "<hexaddr>[-<hexend>]
+// [ <function> ]" per line (e.g. from objdump), since there is no ELF
+// loader here.  A block ends at its given end or where the next one
+// starts, whichever comes first.
+
+#define COV_PCSR_SAMPLES 32
+
+// the last block, if given no end, takes sampled pcs this close
+#define COV_BLOCK_MAX 1024
+
+// comparators used at once
+#define COV_MAX_COMP 32
+
+typedef struct {
+	uint32_t addr;
+	uint32_t end;  // exclusive
+	unsigned func;
+	uint8_t hit;
+	uint8_t armed;
+} cov_block_t;
+
+static cov_block_t* block;
+static unsigned block_count;
+static char** func;
+static unsigned func_count;
+
+static int block_cmp(const void* a, const void* b) {
+	uint32_t x = ((const cov_block_t*) a)->addr;
+	uint32_t y = ((const cov_block_t*) b)->addr;
+	return (x < y) ? -1 : (x > y);
+}
+
+static void cov_free(void) {
+	for (unsigned n = 0; n < func_count; n++) {
+		free(func[n]);
+	}
+	free(func);
+	free(block);
+	func = NULL;
+	block = NULL;
+	func_count = 0;
+	block_count = 0;
+}
+
+static int cov_load(const char* fn) {
+	unsigned bmax = 0, fmax = 0;
+	char line[256];
+	FILE* fp;
+	void* p;
+
+	if ((fp = fopen(fn, "r")) == NULL) {
+		ERROR("cov: cannot open '%s'\n", fn);
+		return DBG_ERR;
+	}
+	cov_free();
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char* name = line;
+		char* end;
+		uint32_t addr = strtoul(line, &end, 16);
+		uint32_t last = 0;
+		if ((end == line) || (line[0] == '#')) {
+			continue;
+		}
+		if (*end == '-') {
+			char* x = end + 1;
+			last = strtoul(x, &end, 16);
+			if ((end == x) || (last <= (addr & ~1))) {
+				ERROR("cov: bad block range: %s", line);
+				goto fail;
+			}
+		}
+		name = end + strspn(end, " \t");
+		name[strcspn(name, " \t\r\n")] = 0;
+		if (name[0] == 0) {
+			name = "?";
+		}
+		if (block_count == bmax) {
+			bmax = bmax ? bmax * 2 : 1024;
+			if ((p = realloc(block, bmax * sizeof(cov_block_t))) == NULL) {
+				goto oops;
+			}
+			block = p;
+		}
+		// blocks of a function are usually listed together
+		if ((func_count == 0) || strcmp(func[func_count - 1], name)) {
+			if (func_count == fmax) {
+				fmax = fmax ? fmax * 2 : 256;
+				if ((p = realloc(func, fmax * sizeof(char*))) == NULL) {
+					goto oops;
+				}
+				func = p;
+			}
+			if ((func[func_count] = strdup(name)) == NULL) {
+				goto oops;
+			}
+			func_count++;
+		}
+		block[block_count].addr = addr & ~1;
+		block[block_count].end = last;
+		block[block_count].func = func_count - 1;
+		block[block_count].hit = 0;
+		block[block_count].armed = 0;
+		block_count++;
+	}
+	fclose(fp);
+	qsort(block, block_count, sizeof(cov_block_t), block_cmp);
+	for (unsigned n = 0; n < block_count; n++) {
+		uint32_t next = (n + 1 < block_count) ? block[n + 1].addr :
+			(block[n].addr + COV_BLOCK_MAX);
+		if ((block[n].end == 0) || (block[n].end > next)) {
+			block[n].end = next;
+		}
+	}
+	INFO("cov: %u blocks in %u functions\n", block_count, func_count);
+	return 0;
+oops:
+	ERROR("cov: out of memory\n");
+fail:
+	fclose(fp);
+	cov_free();
+	return DBG_ERR;
+}
+
+// the block containing a sampled pc, or NULL
+static cov_block_t* cov_lookup(uint32_t pc) {
+	unsigned lo = 0, hi = block_count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (block[mid].addr <= pc) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo == 0) || (pc >= block[lo - 1].end)) {
+		return NULL;
+	}
+	return block + lo - 1;
+}
+
+static int cov_run(DC* dc, uint32_t secs) {
+	cov_block_t* slot[COV_MAX_COMP];
+	unsigned comp[COV_MAX_COMP];
+	uint8_t live[COV_MAX_COMP]; // comparator holds an address
+	uint32_t val[COV_MAX_COMP];
+	uint32_t pcs[COV_PCSR_SAMPLES];
+	uint32_t dhcsr, demcr, ctrl, pc = 0;
+	unsigned ncomp = 0, npcs = 0, next = 0;
+	unsigned halts = 0, batches = 0, hits = 0, left = 0;
+	int count, halted, r;
+
+	if ((count = dc_fpb_enable(dc)) < 0) {
+		return count;
+	}
+	if (count > COV_MAX_COMP) {
+		count = COV_MAX_COMP;
+	}
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, DHCSR, &dhcsr);
+	dc_q_mem_rd32(dc, DEMCR, &demcr);
+	dc_q_mem_rd32(dc, FP_CTRL, &ctrl);
+	dc_q_region(dc, DC_Q_RELAXED);
+	for (int n = 0; n < count; n++) {
+		dc_q_mem_rd32(dc, FP_COMP(n), val + n);
+	}
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	for (int n = 0; n < count; n++) {
+		if (!(val[n] & FP_COMP_ENABLE)) {
+			slot[ncomp] = NULL;
+			live[ncomp] = 0;
+			comp[ncomp++] = n;
+		}
+	}
+	// pc sampling needs TRCENA, and is optional on v6M
+	// (DEMCR is put back as found on the way out)
+	if (dc_mem_wr32(dc, DEMCR, demcr | DEMCR_TRCENA) == 0) {
+		uint32_t x;
+		if ((dc_mem_rd32(dc, DWT_PCSR, &x) == 0) && (x != 0)) {
+			npcs = COV_PCSR_SAMPLES;
+		}
+	}
+	if ((ncomp == 0) && (npcs == 0)) {
+		ERROR("cov: no free comparators and no pc sampling\n");
+		dc_mem_wr32(dc, DEMCR, demcr);
+		return DBG_ERR;
+	}
+	if ((halted = ((dhcsr & DHCSR_S_HALT) != 0))) {
+		if ((r = dc_core_reg_rd(dc, 15, &pc)) < 0) {
+			dc_mem_wr32(dc, DEMCR, demcr);
+			return r;
+		}
+	}
+	INFO("cov: %u comparators, %s pc sampling, ESC to stop\n",
+		ncomp, npcs ? "with" : "no");
+
+	for (unsigned n = 0; n < block_count; n++) {
+		left += !block[n].hit;
+	}
+
+	uint32_t keep = DHCSR_DBGKEY | DHCSR_C_DEBUGEN | (dhcsr & DHCSR_C_MASKINTS);
+	uint32_t attn = dc_get_attn_value(dc);
+	long long t0 = now();
+	for (;;) {
+		if ((attn != dc_get_attn_value(dc)) || (hits == left)) {
+			break;
+		}
+		if (secs && ((now() - t0) >= (secs * 1000000LL))) {
+			break;
+		}
+
+		// re-arm retired comparators, resume, sample
+		dc_q_init(dc);
+		for (unsigned k = 0; k < ncomp; k++) {
+			if (slot[k] != NULL) {
+				continue;
+			}
+			for (unsigned n = 0; n < block_count; n++) {
+				cov_block_t* b = block + ((next + n) % block_count);
+				if (b->hit || b->armed || (halted && (b->addr == pc)) ||
+					(!FP_CTRL_REV(ctrl) && (b->addr >= 0x20000000))) {
+					continue;
+				}
+				next = (b - block) + 1;
+				b->armed = 1;
+				slot[k] = b;
+				break;
+			}
+			if (slot[k] || live[k]) {
+				dc_q_fpb_set(dc, comp[k], slot[k] ? slot[k]->addr : DC_FPB_OFF);
+				live[k] = (slot[k] != NULL);
+			}
+		}
+		if (halted) {
+			dc_q_mem_wr32(dc, DHCSR, keep);
+			halted = 0;
+		}
+		for (unsigned n = 0; n < npcs; n++) {
+			dc_q_mem_rd32(dc, DWT_PCSR, pcs + n);
+		}
+		dc_q_mem_rd32(dc, DHCSR, &dhcsr);
+		if ((r = dc_q_exec(dc)) < 0) {
+			ERROR("cov: batch failed\n");
+			break;
+		}
+		batches++;
+
+		for (unsigned n = 0; n < npcs; n++) {
+			cov_block_t* b;
+			if ((pcs[n] == 0xFFFFFFFF) || ((b = cov_lookup(pcs[n])) == NULL)) {
+				continue;
+			}
+			if (!b->hit) {
+				b->hit = 1;
+				hits++;
+			}
+		}
+		if (dhcsr & DHCSR_S_HALT) {
+			if ((r = dc_core_reg_rd(dc, 15, &pc)) < 0) {
+				break;
+			}
+			cov_block_t* b = NULL;
+			for (unsigned k = 0; k < ncomp; k++) {
+				if (slot[k] && (slot[k]->addr == pc)) {
+					b = slot[k];
+				}
+			}
+			if (b == NULL) {
+				INFO("cov: core halted at %08x\n", pc);
+				break;
+			}
+			if (!b->hit) {
+				b->hit = 1;
+				hits++;
+			}
+			halts++;
+			halted = 1;
+		}
+		// retire comparators whose blocks were seen
+		unsigned armed = 0;
+		for (unsigned k = 0; k < ncomp; k++) {
+			if (slot[k] && slot[k]->hit) {
+				slot[k]->armed = 0;
+				slot[k] = NULL;
+			}
+			armed += (slot[k] != NULL);
+		}
+		if ((armed == 0) && (npcs == 0) && !halted) {
+			// nothing left that a comparator can catch
+			break;
+		}
+	}
+
+	// comparators off, DEMCR as found, and keep the core
+	// running if we stopped it
+	dc_q_init(dc);
+	for (unsigned k = 0; k < ncomp; k++) {
+		if (slot[k] != NULL) {
+			slot[k]->armed = 0;
+		}
+		dc_q_fpb_set(dc, comp[k], DC_FPB_OFF);
+	}
+	dc_q_mem_wr32(dc, DEMCR, demcr);
+	if (halted) {
+		dc_q_mem_wr32(dc, DHCSR, keep);
+	}
+	if (dc_q_exec(dc) < 0) {
+		ERROR("cov: cannot restore comparators and DEMCR\n");
+		return DBG_ERR;
+	}
+	INFO("cov: %u new blocks, %u halts in %u batches\n", hits, halts, batches);
+	return 0;
+}
+
+static int cov_report(const char* fn) {
+	unsigned* total = calloc(func_count, sizeof(unsigned));
+	unsigned* seen = calloc(func_count, sizeof(unsigned));
+	unsigned all = 0;
+	FILE* fp = NULL;
+
+	if ((total == NULL) || (seen == NULL)) {
+		free(total);
+		free(seen);
+		return DBG_ERR;
+	}
+	if ((fn != NULL) && ((fp = fopen(fn, "w")) == NULL)) {
+		ERROR("cov: cannot open '%s'\n", fn);
+		free(total);
+		free(seen);
+		return DBG_ERR;
+	}
+	for (unsigned n = 0; n < block_count; n++) {
+		total[block[n].func]++;
+		seen[block[n].func] += block[n].hit;
+		all += block[n].hit;
+	}
+	for (unsigned n = 0; n < func_count; n++) {
+		if (total[n] == 0) {
+			continue;
+		}
+		if (fp) {
+			fprintf(fp, "%u %u %s\n", seen[n], total[n], func[n]);
+		} else {
+			INFO("%5.1f%% %5u/%-5u %s\n", 100.0 * seen[n] / total[n],
+				seen[n], total[n], func[n]);
+		}
+	}
+	INFO("cov: %u/%u blocks (%.1f%%)\n", all, block_count,
+		block_count ? (100.0 * all / block_count) : 0.0);
+	if (fp) {
+		fclose(fp);
+	}
+	free(total);
+	free(seen);
+	return 0;
+}
+
+int do_cov(DC* dc, CC* cc) {
+	const char* opt;
+	if (cmd_arg_str_opt(cc, 1, &opt, NULL)) return DBG_ERR;
+	if ((opt != NULL) && !strcmp(opt, "load")) {
+		const char* fn;
+		if (cmd_arg_str(cc, 2, &fn)) return DBG_ERR;
+		return cov_load(fn);
+	}
+	if (block_count == 0) {
+		ERROR("cov: no blocks loaded (cov load <file>)\n");
+		return DBG_ERR;
+	}
+	if ((opt == NULL) || !strcmp(opt, "report")) {
+		const char* fn;
+		if (cmd_arg_str_opt(cc, 2, &fn, NULL)) return DBG_ERR;
+		return cov_report(fn);
+	}
+	if (!strcmp(opt, "run")) {
+		uint32_t secs;
+		if (cmd_arg_u32_opt(cc, 2, &secs, 0)) return DBG_ERR;
+		return cov_run(dc, secs);
+	}
+	if (!strcmp(opt, "clear")) {
+		for (unsigned n = 0; n < block_count; n++) {
+			block[n].hit = 0;
+		}
+		return 0;
+	}
+	ERROR("cov [ load <file> | run [ <secs> ] | report [ <file> ] | clear ]\n");
+	return DBG_ERR;
+}
@@ -32,7 +32,7 @@ fail:
 	return NULL;
 }
 
-static long long now() {
+long long now(void) {
 	struct timeval tv;
 	gettimeofday(&tv, 0);
 	return ((long long) tv.tv_usec) + ((long long) tv.tv_sec) * 1000000LL;
@@ -41,6 +41,7 @@ static long long now() {
 int do_upload(DC* dc, CC* cc) {
 	int status = DBG_ERR;
 	const char* fn;
+	const char* opt;
 	uint32_t addr;
 	uint32_t len;
 	uint32_t sz;
@@ -51,6 +52,11 @@ int do_upload(DC* dc, CC* cc) {
 	if (cmd_arg_str(cc, 1, &fn)) return DBG_ERR;
 	if (cmd_arg_u32(cc, 2, &addr)) return DBG_ERR;	
 	if (cmd_arg_u32(cc, 3, &len)) return DBG_ERR;
+	cmd_arg_str_opt(cc, 4, &opt, "");
+	if (opt[0] && strcmp(opt, "pack")) {
+		ERROR("upload <file> <addr> <len> [ pack ]\n");
+		return DBG_ERR;
+	}
 	if (addr & 3) {
 		ERROR("address not word aligned\n");
 		return DBG_ERR;
@@ -68,7 +74,12 @@ int do_upload(DC* dc, CC* cc) {
 
 	INFO("upload: reading %d bytes...\n", sz);
 	t0 = now();
-	if (dc_mem_rd_words(dc, addr, sz / 4, data) < 0) {
+	if (opt[0]) {
+		r = agent_upload(dc, addr, sz, data);
+	} else {
+		r = dc_mem_rd_words(dc, addr, sz / 4, data);
+	}
+	if (r < 0) {
 		ERROR("failed to read data\n");
 		goto done;
 	}
@@ -78,7 +89,7 @@ int do_upload(DC* dc, CC* cc) {
 
 	char *x = data;
 	while (len > 0) {
-		r = write(fd, x, sz);
+		r = write(fd, x, len);
 		if (r < 0) {
 			if (errno == EINTR) continue;
 			ERROR("write error\n");
@@ -0,0 +1,308 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// strdup() and usleep()
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "arm-v7-debug.h"
+
+// Halting call-stack sampler.  Each sample is one batch: halt, wait
+// for S_HALT, read pc, lr, sp and a window of stack words, resume.
+// The window is placed around the previous sample's sp (sp is not
+// known until the batch has run), which covers the stack in the
+// steady state; samples where it does not keep just pc and lr.
+//
+// Stacks are unwound afterwards by scanning for words that look like
+// return addresses (odd, in the code range, right after a BL or BLX),
+// and written as folded stacks ("caller;callee count" per line, hex
+// addresses) for flame graph tools.  Symbolize with addr2line.
+
+#define PROF_MAX_WORDS 256
+#define PROF_MAX_FRAMES 32
+
+// stack window words below the previous sp
+#define PROF_MARGIN 32
+
+typedef struct {
+	uint32_t pc;
+	uint32_t lr;
+	uint32_t count; // stack words from sp
+	uint32_t* stack;
+} prof_sample_t;
+
+static uint32_t code_lo = 0x00000000;
+static uint32_t code_hi = 0x20000000;
+
+// code words read while unwinding (direct mapped)
+#define CODE_CACHE 4096
+static struct {
+	uint32_t addr;
+	uint32_t val;
+} code_cache[CODE_CACHE];
+
+static int code_hw(DC* dc, uint32_t addr, uint32_t* hw) {
+	uint32_t wa = addr & ~3;
+	unsigned n = (wa >> 2) & (CODE_CACHE - 1);
+	if (code_cache[n].addr != wa) {
+		if (dc_mem_rd32(dc, wa, &code_cache[n].val) < 0) {
+			return DBG_ERR;
+		}
+		code_cache[n].addr = wa;
+	}
+	*hw = (addr & 2) ? (code_cache[n].val >> 16) : (code_cache[n].val & 0xFFFF);
+	return 0;
+}
+
+// a return address: just past a BL or BLX <reg>
+static int is_return(DC* dc, uint32_t val) {
+	uint32_t a = val & ~1, hw1, hw2;
+	if (!(val & 1) || (a < (code_lo + 4)) || (a >= code_hi)) {
+		return 0;
+	}
+	if (code_hw(dc, a - 2, &hw2) < 0) {
+		return 0;
+	}
+	if ((hw2 & 0xFF87) == 0x4780) {
+		return 1;
+	}
+	if (code_hw(dc, a - 4, &hw1) < 0) {
+		return 0;
+	}
+	return ((hw1 & 0xF800) == 0xF000) && ((hw2 & 0xD000) == 0xD000);
+}
+
+static unsigned unwind(DC* dc, prof_sample_t* s, uint32_t* frame) {
+	unsigned n = 0;
+	frame[n++] = s->pc;
+	if (is_return(dc, s->lr)) {
+		frame[n++] = s->lr & ~1;
+	}
+	for (unsigned i = 0; (i < s->count) && (n < PROF_MAX_FRAMES); i++) {
+		if (is_return(dc, s->stack[i]) && ((s->stack[i] & ~1) != frame[n - 1])) {
+			frame[n++] = s->stack[i] & ~1;
+		}
+	}
+	return n;
+}
+
+typedef struct {
+	char* text;
+	uint32_t hash;
+	unsigned count;
+} folded_t;
+
+static folded_t* folded;
+static unsigned folded_count;
+static unsigned folded_max;
+
+static int fold(const char* text) {
+	uint32_t hash = 5381;
+	for (const char* s = text; *s; s++) {
+		hash = hash * 33 + *s;
+	}
+	for (unsigned n = 0; n < folded_count; n++) {
+		if ((folded[n].hash == hash) && !strcmp(folded[n].text, text)) {
+			folded[n].count++;
+			return 0;
+		}
+	}
+	if (folded_count == folded_max) {
+		unsigned max = folded_max ? folded_max * 2 : 256;
+		folded_t* f = realloc(folded, max * sizeof(folded_t));
+		if (f == NULL) {
+			return DBG_ERR;
+		}
+		folded = f;
+		folded_max = max;
+	}
+	if ((folded[folded_count].text = strdup(text)) == NULL) {
+		return DBG_ERR;
+	}
+	folded[folded_count].hash = hash;
+	folded[folded_count].count = 1;
+	folded_count++;
+	return 0;
+}
+
+static void fold_reset(void) {
+	for (unsigned n = 0; n < folded_count; n++) {
+		free(folded[n].text);
+	}
+	folded_count = 0;
+}
+
+static int prof_write(DC* dc, const char* fn, prof_sample_t* sample, unsigned count) {
+	uint32_t frame[PROF_MAX_FRAMES];
+	char text[PROF_MAX_FRAMES * 9 + 1];
+	FILE* fp;
+
+	memset(code_cache, 0xFF, sizeof(code_cache));
+	fold_reset();
+	for (unsigned n = 0; n < count; n++) {
+		unsigned depth = unwind(dc, sample + n, frame);
+		char* p = text;
+		// root first
+		while (depth-- > 0) {
+			p += sprintf(p, "%08x%s", frame[depth], depth ? ";" : "");
+		}
+		if (fold(text) < 0) {
+			ERROR("profile: out of memory\n");
+			return DBG_ERR;
+		}
+	}
+	if ((fp = fopen(fn, "w")) == NULL) {
+		ERROR("profile: cannot open '%s'\n", fn);
+		return DBG_ERR;
+	}
+	for (unsigned n = 0; n < folded_count; n++) {
+		fprintf(fp, "%s %u\n", folded[n].text, folded[n].count);
+	}
+	fclose(fp);
+	INFO("profile: %u samples, %u distinct stacks\n", count, folded_count);
+	return 0;
+}
+
+static int prof_run(DC* dc, const char* fn, uint32_t hz, uint32_t count, uint32_t words) {
+	uint32_t window[PROF_MAX_WORDS + PROF_MARGIN];
+	uint32_t dhcsr, sp = 0, t0, t1;
+	uint32_t* t0p = dc_get_timer_freq(dc) ? &t0 : NULL;
+	uint32_t* t1p = dc_get_timer_freq(dc) ? &t1 : NULL;
+	double smin = 1.0, smax = 0.0, stotal = 0.0;
+	unsigned misses = 0, taken = 0;
+	prof_sample_t* sample;
+	uint32_t* stack;
+	int r;
+
+	if ((r = dc_mem_rd32(dc, DHCSR, &dhcsr)) < 0) {
+		return r;
+	}
+	if (dhcsr & DHCSR_S_HALT) {
+		ERROR("profile: core is halted\n");
+		return DBG_ERR;
+	}
+	sample = calloc(count, sizeof(prof_sample_t));
+	stack = malloc(count * words * 4);
+	if ((sample == NULL) || (stack == NULL)) {
+		ERROR("profile: out of memory\n");
+		r = DBG_ERR;
+		goto done;
+	}
+
+	uint32_t keep = DHCSR_DBGKEY | DHCSR_C_DEBUGEN | (dhcsr & DHCSR_C_MASKINTS);
+	uint32_t nwin = words + PROF_MARGIN;
+	uint32_t attn = dc_get_attn_value(dc);
+	long long period = 1000000LL / hz;
+	long long next = now();
+	INFO("profile: sampling, ESC to stop\n");
+	while (taken < count) {
+		prof_sample_t* s = sample + taken;
+		uint32_t base = (sp > (PROF_MARGIN * 4)) ? (sp - PROF_MARGIN * 4) : 0;
+		if (attn != dc_get_attn_value(dc)) {
+			break;
+		}
+		long long t = now();
+		if (t < next) {
+			usleep(next - t);
+		}
+		next += period;
+
+		t = now();
+		dc_q_init(dc);
+		if (t0p) {
+			dc_q_mem_wr32_ts(dc, DHCSR, keep | DHCSR_C_HALT, t0p);
+		} else {
+			dc_q_mem_wr32(dc, DHCSR, keep | DHCSR_C_HALT);
+		}
+		dc_q_set_mask(dc, DHCSR_S_HALT);
+		dc_q_mem_match32(dc, DHCSR, DHCSR_S_HALT);
+		dc_q_core_reg_rd(dc, 15, &s->pc);
+		dc_q_core_reg_rd(dc, 14, &s->lr);
+		dc_q_core_reg_rd(dc, 13, &sp);
+		if (sp) {
+			dc_q_region(dc, DC_Q_RELAXED);
+			for (uint32_t n = 0; n < nwin; n++) {
+				dc_q_mem_rd32(dc, base + n * 4, window + n);
+			}
+			dc_q_region(dc, DC_Q_ORDERED);
+		}
+		if (t1p) {
+			dc_q_mem_wr32_ts(dc, DHCSR, keep, t1p);
+		} else {
+			dc_q_mem_wr32(dc, DHCSR, keep);
+		}
+		if ((r = dc_q_exec(dc)) < 0) {
+			// the window may have run off the end of ram:
+			// make sure the core runs, and shrink it
+			if ((r = dc_mem_wr32(dc, DHCSR, keep)) < 0) {
+				ERROR("profile: cannot resume core\n");
+				break;
+			}
+			if (nwin <= (PROF_MARGIN + 1)) {
+				ERROR("profile: sampling failed\n");
+				r = DBG_ERR;
+				break;
+			}
+			nwin = PROF_MARGIN + (nwin - PROF_MARGIN) / 2;
+			sp = 0;
+			continue;
+		}
+		double stop = t0p ? dc_ticks_to_sec(dc, t1 - t0) :
+			((double) (now() - t)) / 1000000.0;
+		if (stop < smin) smin = stop;
+		if (stop > smax) smax = stop;
+		stotal += stop;
+
+		s->stack = stack + taken * words;
+		s->count = 0;
+		if ((sp >= base) && (((sp - base) / 4) < nwin)) {
+			uint32_t off = (sp - base) / 4;
+			s->count = nwin - off;
+			if (s->count > words) {
+				s->count = words;
+			}
+			memcpy(s->stack, window + off, s->count * 4);
+		} else {
+			misses++;
+		}
+		taken++;
+	}
+	if (taken) {
+		INFO("profile: stop per sample %.0f/%.0f/%.0f us (min/avg/max%s), "
+			"%u stack window misses\n", smin * 1000000.0,
+			stotal * 1000000.0 / taken, smax * 1000000.0,
+			t0p ? "" : ", host timed", misses);
+		r = prof_write(dc, fn, sample, taken);
+	}
+done:
+	free(sample);
+	free(stack);
+	return r;
+}
+
+int do_profile(DC* dc, CC* cc) {
+	uint32_t hz, count, words;
+	const char* fn;
+
+	if (cmd_arg_str(cc, 1, &fn)) return DBG_ERR;
+	if (!strcmp(fn, "range")) {
+		if (cmd_arg_u32(cc, 2, &code_lo)) return DBG_ERR;
+		if (cmd_arg_u32(cc, 3, &code_hi)) return DBG_ERR;
+		return 0;
+	}
+	if (cmd_arg_u32_opt(cc, 2, &hz, 100)) return DBG_ERR;
+	if (cmd_arg_u32_opt(cc, 3, &count, 1000)) return DBG_ERR;
+	if (cmd_arg_u32_opt(cc, 4, &words, 64)) return DBG_ERR;
+	if ((hz < 1) || (count < 1) || (words < 1) || (words > PROF_MAX_WORDS)) {
+		ERROR("profile: bad rate, count, or stack words (max %u)\n", PROF_MAX_WORDS);
+		return DBG_ERR;
+	}
+	return prof_run(dc, fn, hz, count, words);
+}
@@ -0,0 +1,493 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "arm-debug.h"
+#include "arm-v7-debug.h"
+#include "arm-v7-system-control.h"
+
+// On-chip branch trace buffers.  The MTB (Cortex-M0+) writes a
+// source/destination packet per taken branch into a window of
+// system sram.  The ETB (Cortex-M3/M4) captures the ETM's formatted
+// trace stream into dedicated ram.  Both are found through the ROM
+// table (or given by address), and read back in one bulk batch.
+//
+// MTB history is decoded into the executed path: each packet's
+// destination runs sequentially up to the next packet's source.
+// ETB data is deformatted into the ETM byte stream and written out
+// for an external ETMv3 decoder.
+
+#define TRACE_NONE 0
+#define TRACE_MTB 1
+#define TRACE_ETB 2
+
+#define ETM_TRACE_ID 1
+
+// deepest ROM table nesting followed
+#define ROM_MAX_DEPTH 4
+
+// instruction counts only for plausible straight-line runs
+#define MAX_RUN_BYTES 4096
+
+static unsigned trace_kind = TRACE_NONE;
+static uint32_t trace_addr;
+
+static const char* trace_name[] = { "none", "mtb", "etb" };
+
+static int rom_scan(DC* dc, uint32_t base, unsigned depth) {
+	uint32_t entry[32];
+	if (depth > ROM_MAX_DEPTH) {
+		return 0;
+	}
+	for (unsigned n = 0; n < CS_ROM_MAX; n += 32) {
+		if (dc_mem_rd_words(dc, base + n * 4, 32, entry) < 0) {
+			return DBG_ERR;
+		}
+		for (unsigned i = 0; i < 32; i++) {
+			uint32_t cidr1, pidr0, pidr1, addr;
+			if (entry[i] == 0) {
+				return 0;
+			}
+			if ((entry[i] & (CS_ROM_PRESENT | CS_ROM_FORMAT)) !=
+				(CS_ROM_PRESENT | CS_ROM_FORMAT)) {
+				continue;
+			}
+			addr = base + CS_ROM_OFFSET(entry[i]);
+			dc_q_init(dc);
+			dc_q_mem_rd32(dc, addr + CS_CIDR1, &cidr1);
+			dc_q_mem_rd32(dc, addr + CS_PIDR0, &pidr0);
+			dc_q_mem_rd32(dc, addr + CS_PIDR1, &pidr1);
+			if (dc_q_exec(dc) < 0) {
+				continue;
+			}
+			switch (CS_CIDR1_CLASS(cidr1)) {
+			case CS_CLASS_ROMTABLE:
+				if (rom_scan(dc, addr, depth + 1) < 0) {
+					return DBG_ERR;
+				}
+				break;
+			case CS_CLASS_CORESIGHT:
+				switch (CS_PIDR_PART(pidr0, pidr1)) {
+				case CS_PART_MTB_M0P:
+					trace_kind = TRACE_MTB;
+					trace_addr = addr;
+					break;
+				case CS_PART_ETB:
+					trace_kind = TRACE_ETB;
+					trace_addr = addr;
+					break;
+				}
+				break;
+			}
+			if (trace_kind != TRACE_NONE) {
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+static int trace_detect(DC* dc) {
+	uint32_t base;
+	if (trace_kind != TRACE_NONE) {
+		return 0;
+	}
+	if (dc_ap_rd(dc, MAP_BASE, &base) < 0) {
+		return DBG_ERR;
+	}
+	if ((base & (MAP_BASE_PRESENT | MAP_BASE_FORMAT)) ==
+		(MAP_BASE_PRESENT | MAP_BASE_FORMAT)) {
+		if (rom_scan(dc, MAP_BASE_ADDR(base), 0) < 0) {
+			return DBG_ERR;
+		}
+	}
+	if (trace_kind == TRACE_NONE) {
+		ERROR("trace: no MTB or ETB found (use trace mtb|etb <addr>)\n");
+		return DBG_ERR;
+	}
+	INFO("trace: %s @%08x\n", trace_name[trace_kind], trace_addr);
+	return 0;
+}
+
+// the trace sram window and the oldest packet's offset in it
+typedef struct {
+	uint32_t master;
+	uint32_t sram;
+	uint32_t size;
+	uint32_t start;
+	uint32_t count;
+} mtb_state_t;
+
+static int mtb_state(DC* dc, mtb_state_t* st) {
+	uint32_t pos, base;
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, trace_addr + MTB_POSITION, &pos);
+	dc_q_mem_rd32(dc, trace_addr + MTB_MASTER, &st->master);
+	dc_q_mem_rd32(dc, trace_addr + MTB_BASE, &base);
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	st->size = 1U << (MTB_MASTER_MASK(st->master) + 4);
+	st->sram = base + (MTB_POSITION_PTR(pos) & ~(st->size - 1));
+	if (pos & MTB_POSITION_WRAP) {
+		st->start = MTB_POSITION_PTR(pos) & (st->size - 1);
+		st->count = st->size;
+	} else {
+		st->start = 0;
+		st->count = MTB_POSITION_PTR(pos) & (st->size - 1);
+	}
+	return 0;
+}
+
+// The MTB window is ordinary sram, shared with the application.
+// Use the window the firmware set up (if it enabled the MTB), the
+// one last given, or one given now (which the firmware must leave
+// alone: typically a linker-reserved, size-aligned buffer).
+static uint32_t mtb_window = 0;
+
+static int mtb_start(DC* dc, uint32_t bytes, uint32_t addr) {
+	uint32_t master, pos, base, vtor, sp0, mask = 0;
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, trace_addr + MTB_MASTER, &master);
+	dc_q_mem_rd32(dc, trace_addr + MTB_POSITION, &pos);
+	dc_q_mem_rd32(dc, trace_addr + MTB_BASE, &base);
+	dc_q_mem_rd32(dc, VTOR, &vtor);
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	if (bytes) {
+		if ((bytes < 16) || (bytes & (bytes - 1))) {
+			ERROR("trace: mtb size must be a power of two >= 16\n");
+			return DBG_ERR;
+		}
+		while ((16U << mask) < bytes) {
+			mask++;
+		}
+	} else {
+		mask = MTB_MASTER_MASK(master);
+	}
+	uint32_t size = 16U << mask;
+	uint32_t fwsize = 16U << MTB_MASTER_MASK(master);
+	if (addr == 0) {
+		if (master & MTB_MASTER_EN) {
+			addr = base + (MTB_POSITION_PTR(pos) & ~(fwsize - 1));
+			if (size > fwsize) {
+				INFO("trace: warning: growing the firmware's %u byte mtb window\n", fwsize);
+			}
+		} else if (mtb_window) {
+			addr = mtb_window;
+		} else {
+			ERROR("trace: firmware has no mtb window, use trace start <bytes> <addr>\n");
+			return DBG_ERR;
+		}
+	} else if (dc_mem_rd32(dc, vtor, &sp0) == 0) {
+		// the application's ram runs up to its initial stack pointer
+		if ((addr < sp0) && ((addr + size) > base)) {
+			INFO("trace: warning: %08x..%08x is below the initial sp (%08x), "
+				"the firmware must not use it\n", addr, addr + size - 1, sp0);
+		}
+	}
+	if ((addr < base) || ((addr - base) & (size - 1))) {
+		ERROR("trace: mtb window %08x must be above %08x and %u byte aligned\n",
+			addr, base, size);
+		return DBG_ERR;
+	}
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, trace_addr + MTB_MASTER, 0);
+	dc_q_mem_wr32(dc, trace_addr + MTB_POSITION, addr - base);
+	dc_q_mem_wr32(dc, trace_addr + MTB_FLOW, 0);
+	dc_q_mem_wr32(dc, trace_addr + MTB_MASTER, MTB_MASTER_EN | mask);
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	mtb_window = addr;
+	INFO("trace: mtb on, %u bytes @%08x\n", size, addr);
+	return 0;
+}
+
+static int etb_start(DC* dc) {
+	uint32_t demcr;
+	if (dc_mem_rd32(dc, DEMCR, &demcr) < 0) {
+		return DBG_ERR;
+	}
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, DEMCR, demcr | DEMCR_TRCENA);
+	dc_q_mem_wr32(dc, trace_addr + CS_LAR, CS_LAR_KEY);
+	dc_q_mem_wr32(dc, trace_addr + ETB_CTL, 0);
+	dc_q_mem_wr32(dc, trace_addr + ETB_RWP, 0);
+	dc_q_mem_wr32(dc, trace_addr + ETB_TRG, 0);
+	dc_q_mem_wr32(dc, trace_addr + ETB_FFCR, ETB_FFCR_ENFTC | ETB_FFCR_ENFCONT);
+	dc_q_mem_wr32(dc, trace_addr + ETB_CTL, ETB_CTL_CAPTEN);
+	dc_q_mem_wr32(dc, ETM_LAR, CS_LAR_KEY);
+	dc_q_mem_wr32(dc, ETM_CR, ETM_CR_PROG | ETM_CR_ETMEN | ETM_CR_BRANCH);
+	dc_q_set_mask(dc, ETM_SR_PROG);
+	dc_q_mem_match32(dc, ETM_SR, ETM_SR_PROG);
+	dc_q_mem_wr32(dc, ETM_TRACEIDR, ETM_TRACE_ID);
+	dc_q_mem_wr32(dc, ETM_TEEVR, ETM_EVT_ALWAYS);
+	dc_q_mem_wr32(dc, ETM_TECR1, ETM_TECR1_EXCL);
+	dc_q_mem_wr32(dc, ETM_CR, ETM_CR_ETMEN | ETM_CR_BRANCH);
+	if (dc_q_exec(dc) < 0) {
+		ERROR("trace: cannot start etm/etb\n");
+		return DBG_ERR;
+	}
+	INFO("trace: etb on\n");
+	return 0;
+}
+
+static int trace_stop(DC* dc) {
+	dc_q_init(dc);
+	if (trace_kind == TRACE_MTB) {
+		uint32_t master;
+		dc_q_mem_rd32(dc, trace_addr + MTB_MASTER, &master);
+		if (dc_q_exec(dc) < 0) {
+			return DBG_ERR;
+		}
+		return dc_mem_wr32(dc, trace_addr + MTB_MASTER, master & ~MTB_MASTER_EN);
+	}
+	// stop the etm, flush the formatter, then stop capture
+	dc_q_mem_wr32(dc, ETM_CR, ETM_CR_PROG | ETM_CR_ETMEN | ETM_CR_BRANCH);
+	dc_q_mem_wr32(dc, trace_addr + ETB_FFCR, ETB_FFCR_ENFTC | ETB_FFCR_ENFCONT |
+		ETB_FFCR_STOPFL | ETB_FFCR_FONMAN);
+	dc_q_set_mask(dc, ETB_FFSR_FTSTOPPED);
+	dc_q_mem_match32(dc, trace_addr + ETB_FFSR, ETB_FFSR_FTSTOPPED);
+	dc_q_mem_wr32(dc, trace_addr + ETB_CTL, 0);
+	return dc_q_exec(dc);
+}
+
+// packets oldest first, as word pairs
+static int mtb_read(DC* dc, uint32_t** out, uint32_t* count) {
+	mtb_state_t st;
+	uint32_t* buf;
+	if (mtb_state(dc, &st) < 0) {
+		return DBG_ERR;
+	}
+	if ((buf = malloc(st.size)) == NULL) {
+		return DBG_ERR;
+	}
+	// one bulk read of the window, then rotate
+	if (dc_mem_rd_words(dc, st.sram, st.size / 4, buf) < 0) {
+		free(buf);
+		return DBG_ERR;
+	}
+	if (st.start) {
+		uint32_t* tmp = malloc(st.size);
+		if (tmp == NULL) {
+			free(buf);
+			return DBG_ERR;
+		}
+		memcpy(tmp, (uint8_t*) buf + st.start, st.size - st.start);
+		memcpy((uint8_t*) tmp + st.size - st.start, buf, st.start);
+		free(buf);
+		buf = tmp;
+	}
+	*out = buf;
+	*count = st.count / 8;
+	return 0;
+}
+
+// ETM stream (trace id ETM_TRACE_ID) from formatter frames, oldest first
+static int etb_read(DC* dc, uint8_t** out, uint32_t* count) {
+	uint32_t depth, sts, rwp;
+	uint32_t* buf;
+	uint8_t* data;
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, trace_addr + ETB_RDP, &depth);
+	dc_q_mem_rd32(dc, trace_addr + ETB_STS, &sts);
+	dc_q_mem_rd32(dc, trace_addr + ETB_RWP, &rwp);
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	uint32_t words = (sts & ETB_STS_FULL) ? depth : rwp;
+	words &= ~3; // whole frames
+	if ((buf = malloc(words * 4 + 4)) == NULL) {
+		return DBG_ERR;
+	}
+	// RRD auto-increments RRP (wrapping), so this is one batch
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, trace_addr + ETB_RRP, (sts & ETB_STS_FULL) ? rwp : 0);
+	for (uint32_t n = 0; n < words; n++) {
+		dc_q_mem_rd32(dc, trace_addr + ETB_RRD, buf + n);
+	}
+	if ((dc_q_exec(dc) < 0) || ((data = malloc(words * 4)) == NULL)) {
+		free(buf);
+		return DBG_ERR;
+	}
+
+	unsigned id = 0, len = 0;
+	for (uint32_t f = 0; f < words; f += 4) {
+		uint8_t b[16];
+		memcpy(b, buf + f, 16);
+		for (unsigned i = 0; i < 8; i++) {
+			unsigned aux = (b[15] >> i) & 1;
+			uint8_t c = b[2 * i];
+			if (c & 1) {
+				// id change: aux set means the next byte is still the old id's
+				unsigned nid = c >> 1;
+				if ((i < 7) && aux && (id == ETM_TRACE_ID)) {
+					data[len++] = b[2 * i + 1];
+				}
+				if ((i < 7) && !aux && (nid == ETM_TRACE_ID)) {
+					data[len++] = b[2 * i + 1];
+				}
+				id = nid;
+			} else if (id == ETM_TRACE_ID) {
+				data[len++] = (c & 0xFE) | aux;
+				if (i < 7) {
+					data[len++] = b[2 * i + 1];
+				}
+			}
+		}
+	}
+	free(buf);
+	*out = data;
+	*count = len;
+	return 0;
+}
+
+// a 32bit thumb instruction starts with 0b11101, 0b11110, or 0b11111
+static int count_insns(DC* dc, uint32_t lo, uint32_t hi) {
+	uint32_t base = lo & ~3;
+	uint32_t words = ((hi & ~3) - base) / 4 + 1;
+	uint32_t* buf;
+	int count = 0;
+	if ((hi < lo) || ((hi - lo) > MAX_RUN_BYTES)) {
+		return -1;
+	}
+	if ((buf = malloc(words * 4)) == NULL) {
+		return -1;
+	}
+	if (dc_mem_rd_words(dc, base, words, buf) < 0) {
+		free(buf);
+		return -1;
+	}
+	for (uint32_t a = lo; a <= hi; count++) {
+		uint32_t w = buf[(a - base) / 4];
+		uint32_t hw = (a & 2) ? (w >> 16) : (w & 0xFFFF);
+		a += ((hw >> 11) >= 0x1D) ? 4 : 2;
+	}
+	free(buf);
+	return count;
+}
+
+static void mtb_show_run(DC* dc, uint32_t lo, uint32_t hi) {
+	int n = count_insns(dc, lo, hi);
+	if (n < 0) {
+		INFO("  %08x..%08x\n", lo, hi);
+	} else {
+		INFO("  %08x..%08x  %d insn%s\n", lo, hi, n, (n == 1) ? "" : "s");
+	}
+}
+
+static int mtb_show(DC* dc, uint32_t max) {
+	uint32_t* pkt;
+	uint32_t count, pc;
+	if (mtb_read(dc, &pkt, &count) < 0) {
+		ERROR("trace: cannot read mtb\n");
+		return DBG_ERR;
+	}
+	uint32_t first = (max && (count > max)) ? (count - max) : 0;
+	INFO("trace: %u of %u branches, oldest first\n", count - first, count);
+	for (uint32_t n = first; n < count; n++) {
+		uint32_t src = pkt[n * 2];
+		uint32_t dst = pkt[n * 2 + 1];
+		if (dst & MTB_PKT_S) {
+			INFO("  (trace start)\n");
+		} else if (n > first) {
+			mtb_show_run(dc, pkt[n * 2 - 1] & ~1, src & ~1);
+		}
+		INFO("  %08x -> %08x%s\n", src & ~1, dst & ~1,
+			(src & MTB_PKT_A) ? " exception" : "");
+	}
+	// the last run ends where the core stopped
+	if (count && (dc_core_check_halt(dc) == 1) && (dc_core_reg_rd(dc, 15, &pc) == 0)) {
+		mtb_show_run(dc, pkt[count * 2 - 1] & ~1, pc);
+		INFO("  %08x (halted)\n", pc);
+	}
+	free(pkt);
+	return 0;
+}
+
+static int trace_dump(DC* dc, const char* fn) {
+	void* data;
+	uint32_t count, bytes;
+	FILE* fp;
+	if (trace_kind == TRACE_MTB) {
+		if (mtb_read(dc, (uint32_t**) &data, &count) < 0) {
+			ERROR("trace: cannot read mtb\n");
+			return DBG_ERR;
+		}
+		bytes = count * 8;
+	} else {
+		if (etb_read(dc, (uint8_t**) &data, &bytes) < 0) {
+			ERROR("trace: cannot read etb\n");
+			return DBG_ERR;
+		}
+	}
+	if ((fp = fopen(fn, "w")) == NULL) {
+		ERROR("trace: cannot open '%s'\n", fn);
+		free(data);
+		return DBG_ERR;
+	}
+	if (fwrite(data, 1, bytes, fp) != bytes) {
+		ERROR("trace: cannot write '%s'\n", fn);
+	}
+	fclose(fp);
+	free(data);
+	INFO("trace: %u bytes of %s data\n", bytes,
+		(trace_kind == TRACE_MTB) ? "mtb packet" : "etm");
+	return 0;
+}
+
+int do_trace(DC* dc, CC* cc) {
+	const char* opt;
+	int r;
+
+	if (cmd_arg_str_opt(cc, 1, &opt, NULL)) return DBG_ERR;
+	if ((opt != NULL) && (!strcmp(opt, "mtb") || !strcmp(opt, "etb"))) {
+		if (cmd_arg_u32(cc, 2, &trace_addr)) return DBG_ERR;
+		trace_kind = !strcmp(opt, "mtb") ? TRACE_MTB : TRACE_ETB;
+		return 0;
+	}
+	if (trace_detect(dc) < 0) {
+		return DBG_ERR;
+	}
+	if (opt == NULL) {
+		return 0;
+	}
+	if (!strcmp(opt, "start")) {
+		uint32_t bytes, addr;
+		if (trace_kind == TRACE_ETB) {
+			return etb_start(dc);
+		}
+		if (cmd_arg_u32_opt(cc, 2, &bytes, 0)) return DBG_ERR;
+		if (cmd_arg_u32_opt(cc, 3, &addr, 0)) return DBG_ERR;
+		return mtb_start(dc, bytes, addr);
+	}
+	if (!strcmp(opt, "stop")) {
+		if ((r = trace_stop(dc)) < 0) {
+			ERROR("trace: cannot stop %s\n", trace_name[trace_kind]);
+		}
+		return r;
+	}
+	if (!strcmp(opt, "dump")) {
+		const char* fn;
+		if (cmd_arg_str(cc, 2, &fn)) return DBG_ERR;
+		return trace_dump(dc, fn);
+	}
+	if (!strcmp(opt, "show")) {
+		uint32_t max;
+		if (cmd_arg_u32_opt(cc, 2, &max, 0)) return DBG_ERR;
+		if (trace_kind != TRACE_MTB) {
+			ERROR("trace: etm decode is external, use trace dump\n");
+			return DBG_ERR;
+		}
+		return mtb_show(dc, max);
+	}
+	ERROR("trace [ mtb|etb <addr> | start [ <bytes> [ <addr> ] ] | stop | show [ <n> ] | dump <file> ]\n");
+	return DBG_ERR;
+}
@@ -0,0 +1,343 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "arm-v7-debug.h"
+
+// Non-stop tracepoints: a code address and a collect list of core
+// registers and memory ranges.  "tp run" arms them on FPB comparators
+// and resumes.  The probe polls for the halt and reads pc right
+// behind it, then one batch reads that tracepoint's collect list,
+// steps past its comparator (with interrupts masked, so the
+// tracepoint instruction is what executes) and resumes.  A halt
+// anywhere else (BKPT, vector catch, ...) stops the run with the
+// core halted.
+//
+// Output file records (host byte order):
+//   u32 addr   tracepoint address
+//   u32 hit    hit number (over all tracepoints)
+//   u32 ts     probe timestamp of the halt (0 without a probe timer)
+//   u32 count  data words following
+//   u32 data[count]  collect list values, in definition order
+
+#define MAX_TP 8
+#define MAX_TP_ITEMS 14
+#define MAX_TP_WORDS 256
+
+typedef struct {
+	uint32_t addr;  // memory address, or core register id
+	uint32_t words; // memory words, 0 for a register
+} tp_item_t;
+
+typedef struct {
+	uint32_t addr;
+	unsigned comp;
+	unsigned count;
+	unsigned words;
+	tp_item_t item[MAX_TP_ITEMS];
+	uint32_t data[MAX_TP_WORDS];
+} tracepoint_t;
+
+static tracepoint_t tplist[MAX_TP];
+static unsigned tpcount = 0;
+
+static const char* regname[] = {
+	"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+	"r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc",
+	"psr", "msp", "psp",
+};
+
+static int tp_parse_item(const char* s, tp_item_t* item) {
+	char* end;
+	for (unsigned n = 0; n < sizeof(regname)/sizeof(regname[0]); n++) {
+		if (!strcmp(s, regname[n])) {
+			item->addr = n;
+			item->words = 0;
+			return 0;
+		}
+	}
+	// <addr>:<bytes>
+	item->addr = strtoul(s, &end, 16);
+	if ((end == s) || (*end != ':')) {
+		return DBG_ERR;
+	}
+	s = end + 1;
+	item->words = (strtoul(s, &end, 16) + 3) / 4;
+	if ((end == s) || (*end != 0) || (item->words == 0) || (item->addr & 3)) {
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+static void tp_show(tracepoint_t* tp) {
+	INFO("tp %08x:", tp->addr);
+	for (unsigned n = 0; n < tp->count; n++) {
+		if (tp->item[n].words) {
+			INFO(" %08x:%x", tp->item[n].addr, tp->item[n].words * 4);
+		} else {
+			INFO(" %s", regname[tp->item[n].addr]);
+		}
+	}
+	INFO("\n");
+}
+
+static int tp_define(DC* dc, CC* cc, uint32_t addr) {
+	tracepoint_t* tp = NULL;
+	tracepoint_t def;
+	const char* s;
+
+	addr &= ~1;
+	for (unsigned n = 0; n < tpcount; n++) {
+		if (tplist[n].addr == addr) {
+			tp = tplist + n;
+		}
+	}
+	if (tp == NULL) {
+		if (tpcount == MAX_TP) {
+			ERROR("tp: at most %u tracepoints\n", MAX_TP);
+			return DBG_ERR;
+		}
+		tp = tplist + tpcount;
+	}
+
+	// parse into def, so a bad item leaves things as they were
+	def.addr = addr;
+	def.count = 0;
+	def.words = 0;
+	for (unsigned n = 2; ; n++) {
+		cmd_arg_str_opt(cc, n, &s, NULL);
+		if (s == NULL) {
+			break;
+		}
+		tp_item_t* item = def.item + def.count;
+		if (def.count == MAX_TP_ITEMS) {
+			ERROR("tp: at most %u collect items\n", MAX_TP_ITEMS);
+			return DBG_ERR;
+		}
+		if (tp_parse_item(s, item) < 0) {
+			ERROR("tp: bad collect item '%s' (register or <addr>:<bytes>)\n", s);
+			return DBG_ERR;
+		}
+		unsigned words = item->words ? item->words : 1;
+		if ((def.words + words) > MAX_TP_WORDS) {
+			ERROR("tp: at most %u words collected per hit\n", MAX_TP_WORDS);
+			return DBG_ERR;
+		}
+		def.words += words;
+		def.count++;
+	}
+	if (tp == (tplist + tpcount)) {
+		tpcount++;
+	}
+	memcpy(tp, &def, sizeof(def));
+	tp_show(tp);
+	return 0;
+}
+
+// claim a free comparator for each tracepoint
+static int tp_arm(DC* dc) {
+	uint32_t comp[128];
+	int count, r;
+	if ((count = dc_fpb_enable(dc)) <= 0) {
+		ERROR("tp: no breakpoint unit\n");
+		return DBG_ERR;
+	}
+	dc_q_init(dc);
+	dc_q_region(dc, DC_Q_RELAXED);
+	for (int n = 0; n < count; n++) {
+		dc_q_mem_rd32(dc, FP_COMP(n), comp + n);
+	}
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	int n = count;
+	for (unsigned i = 0; i < tpcount; i++) {
+		while ((--n >= 0) && (comp[n] & FP_COMP_ENABLE)) ;
+		if (n < 0) {
+			ERROR("tp: not enough free breakpoint comparators\n");
+			return DBG_ERR;
+		}
+		tplist[i].comp = n;
+	}
+	dc_q_init(dc);
+	for (unsigned i = 0; i < tpcount; i++) {
+		dc_q_fpb_set(dc, tplist[i].comp, tplist[i].addr);
+	}
+	if ((r = dc_q_exec(dc)) < 0) {
+		ERROR("tp: cannot set breakpoints\n");
+	}
+	return r;
+}
+
+static void tp_disarm(DC* dc) {
+	dc_q_init(dc);
+	for (unsigned i = 0; i < tpcount; i++) {
+		dc_q_fpb_set(dc, tplist[i].comp, DC_FPB_OFF);
+	}
+	dc_q_exec(dc);
+}
+
+// queue collection of a tracepoint's list, stepping past it and
+// resuming: the core spends one batch halted
+static void tp_q_hit(DC* dc, tracepoint_t* tp, uint32_t dhcsr, uint32_t* ts) {
+	uint32_t keep = DHCSR_DBGKEY | DHCSR_C_DEBUGEN;
+	uint32_t* data = tp->data;
+	for (unsigned n = 0; n < tp->count; n++) {
+		tp_item_t* item = tp->item + n;
+		if (item->words == 0) {
+			dc_q_core_reg_rd(dc, item->addr, data++);
+			continue;
+		}
+		dc_q_region(dc, DC_Q_RELAXED);
+		for (unsigned w = 0; w < item->words; w++) {
+			dc_q_mem_rd32(dc, item->addr + w * 4, data++);
+		}
+		dc_q_region(dc, DC_Q_ORDERED);
+	}
+	dc_q_fpb_set(dc, tp->comp, DC_FPB_OFF);
+	// C_MASKINTS may only change while writing C_HALT
+	dc_q_mem_wr32(dc, DHCSR, keep | DHCSR_C_HALT | DHCSR_C_MASKINTS);
+	dc_q_mem_wr32(dc, DHCSR, keep | DHCSR_C_STEP | DHCSR_C_MASKINTS);
+	dc_q_set_mask(dc, DHCSR_S_HALT);
+	dc_q_mem_match32(dc, DHCSR, DHCSR_S_HALT);
+	dc_q_fpb_set(dc, tp->comp, tp->addr);
+	keep |= dhcsr & DHCSR_C_MASKINTS;
+	dc_q_mem_wr32(dc, DHCSR, keep | DHCSR_C_HALT);
+	if (ts) {
+		dc_q_mem_wr32_ts(dc, DHCSR, keep, ts);
+	} else {
+		dc_q_mem_wr32(dc, DHCSR, keep);
+	}
+}
+
+static int tp_run(DC* dc, const char* fn, uint32_t maxhits) {
+	uint32_t dhcsr, pc, t0, t1, v;
+	uint32_t* t0p = dc_get_timer_freq(dc) ? &t0 : NULL;
+	uint32_t* t1p = dc_get_timer_freq(dc) ? &t1 : NULL;
+	double smin = 1.0, smax = 0.0, stotal = 0.0;
+	uint32_t hits = 0;
+	int fd, r;
+
+	if (tpcount == 0) {
+		ERROR("tp: no tracepoints\n");
+		return DBG_ERR;
+	}
+	if ((fd = open(fn, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		ERROR("tp: cannot open '%s'\n", fn);
+		return DBG_ERR;
+	}
+	if ((r = dc_mem_rd32(dc, DHCSR, &dhcsr)) < 0) {
+		goto done;
+	}
+	if ((r = tp_arm(dc)) < 0) {
+		goto done;
+	}
+	if (dhcsr & DHCSR_S_HALT) {
+		if ((r = dc_core_resume(dc)) < 0) {
+			goto disarm;
+		}
+	}
+
+	uint32_t attn = dc_get_attn_value(dc);
+	unsigned retry = dc_set_match_retry(dc, 1024);
+	INFO("tp: running, ESC to stop\n");
+	while ((maxhits == 0) || (hits < maxhits)) {
+		if (attn != dc_get_attn_value(dc)) {
+			break;
+		}
+		// the timestamped read and pc go out right behind a
+		// successful match, marking when the halt was seen
+		dc_q_init(dc);
+		dc_q_poll(dc);
+		dc_q_set_mask(dc, DHCSR_S_HALT);
+		dc_q_mem_match32(dc, DHCSR, DHCSR_S_HALT);
+		if (t0p) {
+			dc_q_mem_rd32_ts(dc, DHCSR, &v, t0p);
+		}
+		dc_q_core_reg_rd(dc, 15, &pc);
+		if ((r = dc_q_exec(dc)) == DC_ERR_MATCH) {
+			continue;
+		}
+		if (r < 0) {
+			break;
+		}
+		tracepoint_t* tp = NULL;
+		for (unsigned i = 0; i < tpcount; i++) {
+			if (tplist[i].addr == pc) {
+				tp = tplist + i;
+			}
+		}
+		if (tp == NULL) {
+			INFO("tp: core halted at %08x, not a tracepoint\n", pc);
+			break;
+		}
+		long long start = now();
+		dc_q_init(dc);
+		tp_q_hit(dc, tp, dhcsr, t1p);
+		if ((r = dc_q_exec(dc)) < 0) {
+			ERROR("tp: hit handling failed, core may be halted\n");
+			break;
+		}
+		double stall = t0p ? dc_ticks_to_sec(dc, t1 - t0) :
+			((double) (now() - start)) / 1000000.0;
+		if (stall < smin) smin = stall;
+		if (stall > smax) smax = stall;
+		stotal += stall;
+
+		uint32_t hdr[4] = { tp->addr, hits, t0p ? t0 : 0, tp->words };
+		if ((write(fd, hdr, sizeof(hdr)) != sizeof(hdr)) ||
+			(write(fd, tp->data, tp->words * 4) != (tp->words * 4))) {
+			ERROR("tp: write to '%s' failed\n", fn);
+			r = DBG_ERR;
+		}
+		hits++;
+		if (r < 0) {
+			break;
+		}
+	}
+	dc_set_match_retry(dc, retry);
+	if (hits) {
+		INFO("tp: %u hits, stall per hit %.0f/%.0f/%.0f us (min/avg/max%s)\n",
+			hits, smin * 1000000.0, stotal * 1000000.0 / hits, smax * 1000000.0,
+			t0p ? "" : ", host timed");
+	} else {
+		INFO("tp: no hits\n");
+	}
+disarm:
+	tp_disarm(dc);
+done:
+	close(fd);
+	return (r == DC_ERR_MATCH) ? 0 : r;
+}
+
+int do_tp(DC* dc, CC* cc) {
+	const char* s;
+	uint32_t n;
+
+	if (cmd_arg_str_opt(cc, 1, &s, NULL) || (s == NULL)) {
+		for (unsigned i = 0; i < tpcount; i++) {
+			tp_show(tplist + i);
+		}
+		return 0;
+	}
+	if (!strcmp(s, "clear")) {
+		tpcount = 0;
+		return 0;
+	}
+	if (!strcmp(s, "run")) {
+		if (cmd_arg_str(cc, 2, &s)) return DBG_ERR;
+		if (cmd_arg_u32_opt(cc, 3, &n, 0)) return DBG_ERR;
+		return tp_run(dc, s, n);
+	}
+	if (cmd_arg_u32(cc, 1, &n)) {
+		ERROR("tp [ <addr> [ <reg> | <addr>:<bytes> ]... | clear | run <file> [ <hits> ] ]\n");
+		return DBG_ERR;
+	}
+	return tp_define(dc, cc, n);
+}
@@ -0,0 +1,152 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// posix_openpt() and friends
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "tui.h"
+
+// Target console over the probe's uart bridge.  Received data goes
+// to the TUI (as "uart: " lines), and optionally to a log file and
+// a pseudo-terminal.  Pty input and "/text" command lines go back
+// to the target.
+
+static tui_ch_t* uart_ch;
+static int uart_bol = 1;
+static int uart_logfd = -1;
+static int uart_ptyfd = -1;
+
+static void uart_show(const char* data, unsigned len) {
+	while (len > 0) {
+		const char* nl = memchr(data, '\n', len);
+		unsigned n = nl ? (nl - data + 1) : len;
+		if (uart_bol) {
+			tui_ch_printf(uart_ch, "uart: ");
+		}
+		tui_ch_printf(uart_ch, "%.*s", (int) n, data);
+		uart_bol = (nl != NULL);
+		data += n;
+		len -= n;
+	}
+}
+
+// called on every poll, with or without rx data
+static void uart_callback(void* cookie, const void* data, unsigned len) {
+	DC* dc = cookie;
+	if (len > 0) {
+		uart_show(data, len);
+		if ((uart_logfd >= 0) && (write(uart_logfd, data, len) != len)) {
+			ERROR("uart: log write failed, closing log\n");
+			close(uart_logfd);
+			uart_logfd = -1;
+		}
+		if (uart_ptyfd >= 0) {
+			// nobody reading the pty is not an error: drop
+			if (write(uart_ptyfd, data, len) < 0) {}
+		}
+	}
+	if (uart_ptyfd >= 0) {
+		char buf[64];
+		int n = read(uart_ptyfd, buf, sizeof(buf));
+		if (n > 0) {
+			dc_uart_write(dc, buf, n);
+		}
+	}
+}
+
+static int uart_open_pty(void) {
+	int fd;
+	if (uart_ptyfd >= 0) {
+		INFO("uart: pty %s\n", ptsname(uart_ptyfd));
+		return 0;
+	}
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+		ERROR("uart: cannot open pty: %s\n", strerror(errno));
+		return DBG_ERR;
+	}
+	if ((grantpt(fd) < 0) || (unlockpt(fd) < 0)) {
+		ERROR("uart: cannot set up pty: %s\n", strerror(errno));
+		close(fd);
+		return DBG_ERR;
+	}
+	uart_ptyfd = fd;
+	INFO("uart: pty %s\n", ptsname(fd));
+	return 0;
+}
+
+int do_uart(DC* dc, CC* cc) {
+	const char* opt;
+	uint32_t baud, actual;
+	int r;
+
+	if (cmd_arg_str_opt(cc, 1, &opt, NULL) || (opt == NULL)) {
+		ERROR("uart [ <baud> | off | log <file> | nolog | pty ]\n");
+		return DBG_ERR;
+	}
+	if (!strcmp(opt, "off")) {
+		return dc_uart_disable(dc) < 0 ? DBG_ERR : 0;
+	}
+	if (!strcmp(opt, "log")) {
+		const char* fn;
+		int fd;
+		if (cmd_arg_str(cc, 2, &fn)) return DBG_ERR;
+		if ((fd = open(fn, O_CREAT | O_APPEND | O_WRONLY, 0644)) < 0) {
+			ERROR("cannot open '%s'\n", fn);
+			return DBG_ERR;
+		}
+		if (uart_logfd >= 0) {
+			close(uart_logfd);
+		}
+		uart_logfd = fd;
+		return 0;
+	}
+	if (!strcmp(opt, "nolog")) {
+		if (uart_logfd >= 0) {
+			close(uart_logfd);
+			uart_logfd = -1;
+		}
+		return 0;
+	}
+	if (!strcmp(opt, "pty")) {
+		return uart_open_pty();
+	}
+	if (cmd_arg_u32(cc, 1, &baud)) return DBG_ERR;
+
+	if ((uart_ch == NULL) && (tui_ch_create(&uart_ch, 0) < 0)) {
+		return DBG_ERR;
+	}
+	dc_uart_set_callback(dc, uart_callback, dc);
+	if ((r = dc_uart_enable(dc, baud, &actual)) < 0) {
+		if (r == DC_ERR_UNSUPPORTED) {
+			ERROR("uart: probe has no uart bridge\n");
+		} else {
+			ERROR("uart: cannot enable (%d)\n", r);
+		}
+		return DBG_ERR;
+	}
+	INFO("uart: %u baud\n", actual);
+	return 0;
+}
+
+// "/text" on the command line
+int do_wconsole(DC* dc, CC* cc) {
+	const char* text;
+	unsigned len;
+	if (cmd_arg_str(cc, 1, &text)) return DBG_ERR;
+	len = strlen(text);
+	if ((dc_uart_write(dc, text, len) != len) ||
+		(dc_uart_write(dc, "\n", 1) != 1)) {
+		ERROR("uart: tx buffer full\n");
+		return DBG_ERR;
+	}
+	return 0;
+}
@@ -5,16 +5,60 @@
 
 #include "xdebug.h"
 #include "transport.h"
+#include "target-profiles.h"
 #include "arm-v7-debug.h"
 #include "arm-v7-system-control.h"
 
 
 static uint32_t swd_clock_freq = 1000000;
+static int swd_clock_user = 0;
 
 int do_attach(DC* dc, CC* cc) {
+	const char* mode;
+	unsigned flags = 0;
+	unsigned recovery = DC_RECOVER_NONE;
+	int recover_profile = 0;
 	uint32_t n;
+	// recovery is opt-in: reset recovery halts a running target
+	for (unsigned i = 1; !cmd_arg_str_opt(cc, i, &mode, NULL) && mode; i++) {
+		if (!strcmp(mode, "reset")) {
+			flags = DC_UNDER_RESET;
+		} else if (!strcmp(mode, "recover")) {
+			// the profile's strategy, once the part is known
+			recovery = DC_RECOVER_ATTACH;
+			recover_profile = 1;
+		} else if (!strcmp(mode, "recover-attach")) {
+			recovery = DC_RECOVER_ATTACH;
+			recover_profile = 0;
+		} else if (!strcmp(mode, "recover-reset")) {
+			recovery = DC_RECOVER_RESET;
+			recover_profile = 0;
+		} else {
+			ERROR("attach [ reset ] [ recover | recover-attach | recover-reset ]\n");
+			return DBG_ERR;
+		}
+	}
+	dc_set_recovery(dc, recovery);
 	dc_set_clock(dc, swd_clock_freq);
-	return dc_attach(dc, 0, 0, &n);
+	int r;
+	if ((r = dc_attach(dc, flags, 0, &n)) < 0) {
+		return r;
+	}
+
+	// attach at the conservative clock, then switch to the
+	// tuned settings for the part, unless told otherwise
+	const target_profile_t* tp = target_identify(dc);
+	target_apply(dc, tp);
+	if (recover_profile && tp->recovery) {
+		dc_set_recovery(dc, tp->recovery);
+	}
+	if (tp->swd_hz && !swd_clock_user) {
+		dc_set_clock(dc, tp->swd_hz);
+		INFO("attach: target %s, %u kHz\n", tp->name, tp->swd_hz / 1000);
+	} else {
+		INFO("attach: target %s\n", tp->name);
+	}
+	return 0;
 }
 
 int do_setclock(DC* dc, CC* cc) {
@@ -24,10 +68,43 @@ int do_setclock(DC* dc, CC* cc) {
 		return DBG_ERR;
 	}
 	swd_clock_freq = mhz * 1000000;
+	swd_clock_user = 1;
 	dc_set_clock(dc, swd_clock_freq);
 	return 0;
 }
 
+// the clock in effect: user's choice, else the target profile's
+static uint32_t swd_clock_active(void) {
+	const target_profile_t* tp = target_current();
+	if (!swd_clock_user && (tp != NULL) && tp->swd_hz) {
+		return tp->swd_hz;
+	}
+	return swd_clock_freq;
+}
+
+// SWCLK is synchronized into the core clock domain by the debug
+// logic, so stay well below the core clock
+#define SWD_CLOCK_MAX 20000000
+#define SWD_CORE_RATIO 6
+
+void swd_clock_boost(DC* dc, uint32_t core_hz) {
+	uint32_t hz = core_hz / SWD_CORE_RATIO;
+	if (swd_clock_user) {
+		return;
+	}
+	if (hz > SWD_CLOCK_MAX) {
+		hz = SWD_CLOCK_MAX;
+	}
+	if (hz > swd_clock_active()) {
+		dc_set_clock(dc, hz);
+		INFO("swd clock: %u kHz\n", hz / 1000);
+	}
+}
+
+void swd_clock_restore(DC* dc) {
+	dc_set_clock(dc, swd_clock_active());
+}
+
 static uint32_t reglist[20] = {
 	0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
 	10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
@@ -172,6 +249,98 @@ int do_wr(DC* dc, CC* cc) {
 	return r;
 }
 
+// sample a word repeatedly in one batch, reporting each change
+// with the probe-side capture time (free of USB jitter)
+int do_watch(DC* dc, CC* cc) {
+	struct {
+		uint32_t ts; // precedes the data in the response
+		uint32_t val;
+	} sample[1024];
+	uint32_t addr, count;
+	int r;
+
+	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
+	if (cmd_arg_u32_opt(cc, 2, &count, 64)) return DBG_ERR;
+	if (count > 1024) count = 1024;
+	if (count < 1) count = 1;
+
+	dc_q_init(dc);
+	for (unsigned n = 0; n < count; n++) {
+		dc_q_mem_rd32_ts(dc, addr, &sample[n].val, &sample[n].ts);
+	}
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	INFO("%08x: %08x\n", addr, sample[0].val);
+	for (unsigned n = 1; n < count; n++) {
+		if (sample[n].val != sample[n-1].val) {
+			INFO("%08x: %08x @ +%.6fs\n", addr, sample[n].val,
+				dc_ticks_to_sec(dc, sample[n].ts - sample[0].ts));
+		}
+	}
+	INFO("watch: %u samples over %.6fs\n", count,
+		dc_ticks_to_sec(dc, sample[count-1].ts - sample[0].ts));
+	return 0;
+}
+
+// each match batch spins in the probe for up to this many reads
+// (tens to hundreds of ms), bounding ESC and timeout latency
+#define WAITMEM_MATCH_RETRY 4096
+
+// wait for (word & mask) == value with the probe doing the polling,
+// repeating match batches until the timeout (ms, 0 = forever)
+int do_waitmem(DC* dc, CC* cc) {
+	uint32_t addr, mask, val, timeout, cur;
+	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
+	if (cmd_arg_u32(cc, 2, &mask)) return DBG_ERR;
+	if (cmd_arg_u32(cc, 3, &val)) return DBG_ERR;
+	if (cmd_arg_u32_opt(cc, 4, &timeout, 10000)) return DBG_ERR;
+
+	long long start = now();
+	uint32_t attn = dc_get_attn_value(dc);
+	unsigned retry = dc_set_match_retry(dc, WAITMEM_MATCH_RETRY);
+	int r;
+	for (;;) {
+		dc_q_init(dc);
+		dc_q_poll(dc);
+		dc_q_set_mask(dc, mask);
+		dc_q_mem_match32(dc, addr, val & mask);
+		if ((r = dc_q_exec(dc)) != DC_ERR_MATCH) {
+			break;
+		}
+		if (attn != dc_get_attn_value(dc)) {
+			r = DC_ERR_INTERRUPTED;
+			break;
+		}
+		if (timeout && ((now() - start) >= (timeout * 1000LL))) {
+			r = DC_ERR_TIMEOUT;
+			break;
+		}
+	}
+	dc_set_match_retry(dc, retry);
+
+	double t = ((double) (now() - start)) / 1000000.0;
+	switch (r) {
+	case 0:
+		INFO("waitmem: %08x & %08x == %08x after %.3fs\n", addr, mask, val & mask, t);
+		break;
+	case DC_ERR_TIMEOUT:
+	case DC_ERR_INTERRUPTED:
+		if (dc_mem_rd32(dc, addr, &cur) == 0) {
+			ERROR("waitmem: %s after %.3fs (%08x: %08x)\n",
+				(r == DC_ERR_TIMEOUT) ? "timeout" : "cancelled", t, addr, cur);
+		} else {
+			ERROR("waitmem: %s after %.3fs\n",
+				(r == DC_ERR_TIMEOUT) ? "timeout" : "cancelled", t);
+		}
+		break;
+	default:
+		ERROR("waitmem: failed (%d)\n", r);
+		break;
+	}
+	return r;
+}
+
 int do_stop(DC* dc, CC* cc) {
 	int r;
 	if ((r = dc_core_halt(dc)) < 0) {
@@ -198,6 +367,207 @@ int do_step(DC* dc, CC* cc) {
 	return read_show_regs(dc);
 }
 
+// Temporary breakpoints: point a free FPB comparator at the stop
+// address, resume, let the probe poll for the halt, then free the
+// comparator again.  One resume replaces any number of steps.
+
+#define MAX_FPB_COMP 128
+
+static int core_halted(DC* dc) {
+	int r = dc_core_check_halt(dc);
+	if (r == 0) {
+		ERROR("core not halted\n");
+		return DBG_ERR;
+	}
+	return (r < 0) ? r : 0;
+}
+
+// the highest comparator not in use, or < 0
+static int fpb_free_comp(DC* dc) {
+	uint32_t comp[MAX_FPB_COMP];
+	int count;
+	if ((count = dc_fpb_enable(dc)) <= 0) {
+		ERROR("no breakpoint unit\n");
+		return DBG_ERR;
+	}
+	dc_q_init(dc);
+	dc_q_region(dc, DC_Q_RELAXED);
+	for (int n = 0; n < count; n++) {
+		dc_q_mem_rd32(dc, FP_COMP(n), comp + n);
+	}
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	while (--count >= 0) {
+		if (!(comp[count] & FP_COMP_ENABLE)) {
+			return count;
+		}
+	}
+	ERROR("no free breakpoint comparator\n");
+	return DBG_ERR;
+}
+
+static int run_to(DC* dc, uint32_t addr) {
+	int n, r;
+	if ((n = fpb_free_comp(dc)) < 0) {
+		return n;
+	}
+	dc_q_init(dc);
+	dc_q_fpb_set(dc, n, addr);
+	if ((r = dc_q_exec(dc)) < 0) {
+		ERROR("cannot break at %08x\n", addr);
+		return r;
+	}
+	if ((r = dc_core_resume(dc)) == 0) {
+		r = dc_core_wait_halt(dc);
+	}
+	if (r == DC_ERR_INTERRUPTED) {
+		INFO("interrupted\n");
+		dc_core_halt(dc);
+	}
+	dc_q_init(dc);
+	dc_q_fpb_set(dc, n, DC_FPB_OFF);
+	dc_q_exec(dc);
+	return r;
+}
+
+// size of the call (BL, BLX reg) at pc, 0 if it is something else
+static int call_size(DC* dc, uint32_t pc) {
+	uint32_t w[2];
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, pc & ~3, w + 0);
+	dc_q_mem_rd32(dc, (pc & ~3) + 4, w + 1);
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	uint32_t hw1 = (pc & 2) ? (w[0] >> 16) : (w[0] & 0xFFFF);
+	uint32_t hw2 = (pc & 2) ? (w[1] & 0xFFFF) : (w[0] >> 16);
+	if (((hw1 & 0xF800) == 0xF000) && ((hw2 & 0xD000) == 0xD000)) {
+		return 4;
+	}
+	if ((hw1 & 0xFF87) == 0x4780) {
+		return 2;
+	}
+	return 0;
+}
+
+int do_stepover(DC* dc, CC* cc) {
+	uint32_t pc;
+	int n, r;
+	if ((r = core_halted(dc)) < 0) {
+		return r;
+	}
+	if ((r = dc_core_reg_rd(dc, 15, &pc)) < 0) {
+		return r;
+	}
+	if ((n = call_size(dc, pc)) < 0) {
+		return n;
+	}
+	if (n == 0) {
+		return do_step(dc, cc);
+	}
+	if ((r = run_to(dc, pc + n)) < 0) {
+		return r;
+	}
+	return read_show_regs(dc);
+}
+
+// The return address is LR while the function has not reused it.
+// From an exception handler (LR holds EXC_RETURN) it is the PC in
+// the stacked frame: exact for frames on PSP, and for frames on MSP
+// until the handler has pushed anything.
+int do_stepout(DC* dc, CC* cc) {
+	uint32_t lr, sp, ret;
+	int r;
+	if ((r = core_halted(dc)) < 0) {
+		return r;
+	}
+	if ((r = dc_core_reg_rd(dc, 14, &lr)) < 0) {
+		return r;
+	}
+	if ((lr & 0xF0000000) == 0xF0000000) {
+		if ((r = dc_core_reg_rd(dc, (lr & 4) ? 18 : 17, &sp)) < 0) {
+			return r;
+		}
+		if ((r = dc_mem_rd32(dc, sp + 24, &ret)) < 0) {
+			return r;
+		}
+	} else {
+		ret = lr;
+	}
+	if ((r = run_to(dc, ret & ~1)) < 0) {
+		return r;
+	}
+	return read_show_regs(dc);
+}
+
+int do_runto(DC* dc, CC* cc) {
+	uint32_t addr;
+	int r;
+	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
+	if ((r = core_halted(dc)) < 0) {
+		return r;
+	}
+	if ((r = run_to(dc, addr & ~1)) < 0) {
+		return r;
+	}
+	return read_show_regs(dc);
+}
+
+// Range stepping (what a source line step needs, given the line's
+// address range): single steps while pc stays in [lo, hi), each one
+// a single batch, and calls out of the range run to their return
+// (detected by LR pointing just past the previous pc).
+int do_steprange(DC* dc, CC* cc) {
+	uint32_t lo, hi, dhcsr, pc, lr;
+	unsigned steps = 0;
+	int r;
+	if (cmd_arg_u32(cc, 1, &lo)) return DBG_ERR;
+	if (cmd_arg_u32(cc, 2, &hi)) return DBG_ERR;
+	if ((r = core_halted(dc)) < 0) {
+		return r;
+	}
+	if ((r = dc_mem_rd32(dc, DHCSR, &dhcsr)) < 0) {
+		return r;
+	}
+	if ((r = dc_core_reg_rd(dc, 15, &pc)) < 0) {
+		return r;
+	}
+	uint32_t attn = dc_get_attn_value(dc);
+	unsigned retry = dc_set_match_retry(dc, 1024);
+	while ((pc >= lo) && (pc < hi)) {
+		uint32_t prev = pc;
+		if (attn != dc_get_attn_value(dc)) {
+			r = DC_ERR_INTERRUPTED;
+			break;
+		}
+		dc_q_init(dc);
+		dc_q_mem_wr32(dc, DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN |
+			DHCSR_C_STEP | (dhcsr & DHCSR_C_MASKINTS));
+		dc_q_set_mask(dc, DHCSR_S_HALT);
+		dc_q_mem_match32(dc, DHCSR, DHCSR_S_HALT);
+		dc_q_core_reg_rd(dc, 15, &pc);
+		dc_q_core_reg_rd(dc, 14, &lr);
+		if ((r = dc_q_exec(dc)) < 0) {
+			break;
+		}
+		steps++;
+		if (((pc < lo) || (pc >= hi)) &&
+			((lr == ((prev + 2) | 1)) || (lr == ((prev + 4) | 1)))) {
+			if ((r = run_to(dc, lr & ~1)) < 0) {
+				break;
+			}
+			pc = lr & ~1;
+		}
+	}
+	dc_set_match_retry(dc, retry);
+	if (r < 0) {
+		return r;
+	}
+	INFO("steprange: %u steps\n", steps);
+	return read_show_regs(dc);
+}
+
 static uint32_t vcflags = 0;
 
 int do_reset(DC* dc, CC* cc) {
@@ -270,17 +640,37 @@ int do_help(DC* dc, CC* cc);
 int do_upload(DC* dc, CC* cc);
 int do_download(DC* dc, CC* cc);
 
+int do_flash(DC* dc, CC* cc);
+int do_flash_manifest(DC* dc, CC* cc);
+int do_erase(DC* dc, CC* cc);
+int do_agent(DC* dc, CC* cc);
+int do_masserase(DC* dc, CC* cc);
+int do_uart(DC* dc, CC* cc);
+int do_tp(DC* dc, CC* cc);
+int do_profile(DC* dc, CC* cc);
+int do_trace(DC* dc, CC* cc);
+int do_cov(DC* dc, CC* cc);
+int do_wconsole(DC* dc, CC* cc);
+
 struct {
 	const char* name;
 	int (*func)(DC* dc, CC* cc);
 	const char* help;
 } CMDS[] = {
-{ "attach",     do_attach,     "connect to target" },
+{ "attach",     do_attach,     "connect to target     attach [ reset ] [ recover | recover-attach | recover-reset ]" },
 { "stop",       do_stop,       "halt core" },
 { "halt",       do_stop,       NULL },
 { "go",         do_resume,     NULL },
 { "resume",     do_resume,     "resume core" },
 { "step",       do_step,       "single-step core" },
+{ "stepover",   do_stepover,   "step over calls" },
+{ "stepout",    do_stepout,    "run to return address" },
+{ "runto",      do_runto,      "run to address        runto <addr>" },
+{ "steprange",  do_steprange,  "step while in range   steprange <lo> <hi>" },
+{ "cov",        do_cov,        "sampled coverage      cov [ load <file> | run [ <secs> ] | report [ <file> ] | clear ]" },
+{ "profile",    do_profile,    "stack sampler         profile <file> [ <hz> [ <samples> [ <words> ] ] ] | range <lo> <hi>" },
+{ "trace",      do_trace,      "branch trace buffer   trace [ mtb|etb <addr> | start [ <bytes> [ <addr> ] ] | stop | show [ <n> ] | dump <file> ]" },
+{ "tp",         do_tp,         "tracepoints           tp [ <addr> <item>... | clear | run <file> [ <hits> ] ]" },
 { "reset",      do_reset,      "reset core" },
 { "reset-stop", do_reset_stop, "reset core and halt" },
 { "dw",         do_dw,         "dump words            dw <addr> [ <count> ]" },
@@ -288,9 +678,18 @@ struct {
 { "rd",         do_rd,         "read word             rd <addr>" },
 { "dr",         do_rd,         NULL },
 { "wr",         do_wr,         "write word            wr <addr> <val>" },
+{ "watch",      do_watch,      "sample word           watch <addr> [ <count> ]" },
+{ "waitmem",    do_waitmem,    "wait for word         waitmem <addr> <mask> <val> [ <ms> ]" },
 { "regs",       do_regs,       "dump registers" },
 { "download",   do_download,   "write file to memory  download <file> <addr>" },
-{ "upload",     do_upload,     "read memory to file   upload <file> <addr> <len>" },
+{ "upload",     do_upload,     "read memory to file   upload <file> <addr> <len> [pack]" },
+{ "flash",      do_flash,      "write file to flash   flash <file> <addr> [ verify ]" },
+{ "flash-manifest", do_flash_manifest, "write images to flash flash-manifest <file>" },
+{ "erase",      do_erase,      "erase flash           erase <addr> <len>" },
+{ "masserase",  do_masserase,  "erase all flash       masserase [ nrf52-ctrlap | stm32f0 | stm32f4 ]" },
+{ "agent",      do_agent,      "select flash agent    agent [ <name> | auto | direct | boost | noboost ]" },
+{ "uart",       do_uart,       "probe uart console    uart [ <baud> | off | log <file> | nolog | pty ]" },
+{ "wconsole",   do_wconsole,   NULL },
 { "setclock",   do_setclock,   "set SWD clock freq    setclock <mhz>" },
 { "help",       do_help,       "list commands" },
 { "exit",       do_exit,       "exit debugger" },
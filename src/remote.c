@@ -0,0 +1,167 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// getaddrinfo() and friends
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "remote.h"
+
+static void remote_nodelay(int fd) {
+	// frames are small and latency is the whole point
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int remote_connect(const char* hostport) {
+	char host[256];
+	const char* port = REMOTE_DEFAULT_PORT;
+	const char* colon = strrchr(hostport, ':');
+	struct addrinfo hints, *list, *ai;
+	int fd = -1;
+
+	if (colon != NULL) {
+		snprintf(host, sizeof(host), "%.*s", (int) (colon - hostport), hostport);
+		port = colon + 1;
+	} else {
+		snprintf(host, sizeof(host), "%s", hostport);
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &list) != 0) {
+		return -1;
+	}
+	for (ai = list; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	if (fd >= 0) {
+		remote_nodelay(fd);
+	}
+	return fd;
+}
+
+int remote_listen(const char* addr, const char* port) {
+	struct addrinfo hints, *list, *ai;
+	int fd = -1, on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(addr, port, &hints, &list) != 0) {
+		return -1;
+	}
+	for (ai = list; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if ((bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) && (listen(fd, 1) == 0)) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	return fd;
+}
+
+static int remote_wait(int fd, int timeout_ms) {
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	int r;
+	do {
+		r = poll(&pfd, 1, timeout_ms);
+	} while ((r < 0) && (errno == EINTR));
+	return (r == 1) ? 0 : -1;
+}
+
+static int remote_read_all(int fd, void* data, int len, int timeout_ms) {
+	uint8_t* p = data;
+	while (len > 0) {
+		if (remote_wait(fd, timeout_ms) < 0) {
+			return -1;
+		}
+		int r = read(fd, p, len);
+		if (r <= 0) {
+			if ((r < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int remote_send(int fd, const void* data, int len) {
+	uint8_t frame[2 + REMOTE_MAX_FRAME];
+	uint8_t* p = frame;
+	int left;
+	if ((len < 0) || (len > REMOTE_MAX_FRAME)) {
+		return -1;
+	}
+	// one write per frame, so TCP_NODELAY does not split it
+	frame[0] = len;
+	frame[1] = len >> 8;
+	memcpy(frame + 2, data, len);
+	for (left = len + 2; left > 0; ) {
+		int r = write(fd, p, left);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += r;
+		left -= r;
+	}
+	return len;
+}
+
+int remote_recv(int fd, void* data, int max, int timeout_ms) {
+	uint8_t hdr[2];
+	uint8_t discard[256];
+	int len, n;
+	if (remote_read_all(fd, hdr, 2, timeout_ms) < 0) {
+		return -1;
+	}
+	len = hdr[0] | (hdr[1] << 8);
+	n = (len > max) ? max : len;
+	if (remote_read_all(fd, data, n, timeout_ms) < 0) {
+		return -1;
+	}
+	for (int left = len - n; left > 0; ) {
+		int k = (left > sizeof(discard)) ? sizeof(discard) : left;
+		if (remote_read_all(fd, discard, k, timeout_ms) < 0) {
+			return -1;
+		}
+		left -= k;
+	}
+	return n;
+}
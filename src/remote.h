@@ -0,0 +1,38 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+// DAP packet tunnel between xdebug and xdebug-server over TCP.
+//
+// Each CMSIS-DAP command or response travels as one frame: a 16bit
+// little-endian length followed by the packet.  Responses come back
+// in request order.  Clients may have many requests in flight: the
+// server feeds them to the probe as fast as the probe's own packet
+// buffering allows, so a batch of transfers costs one network round
+// trip rather than one per packet.
+
+#define REMOTE_DEFAULT_PORT "5555"
+
+// the server has no authentication: it only listens on loopback
+// unless told otherwise (xdebug-server -listen <addr>)
+#define REMOTE_DEFAULT_ADDR "localhost"
+
+// packets in flight the server advertises to clients (in place of
+// the probe's DI_Max_Packet_Count, which it enforces itself)
+#define REMOTE_PACKET_COUNT 64
+
+#define REMOTE_MAX_FRAME 65535
+
+// connect to "host:port" (or "host", for the default port)
+int remote_connect(const char* hostport);
+
+// listen on the interface with address addr (NULL: all of them)
+int remote_listen(const char* addr, const char* port);
+
+// send a frame, returns len or < 0 on failure
+int remote_send(int fd, const void* data, int len);
+
+// receive a frame into data (truncating to max), returns the bytes
+// stored or < 0 on failure or after timeout_ms (< 0: wait forever)
+int remote_recv(int fd, void* data, int max, int timeout_ms);
@@ -0,0 +1,205 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stddef.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "target-profiles.h"
+#include "arm-debug.h"
+#include "arm-v7-system-control.h"
+
+#define CPUID_MASK      0xFF00FFF0U // implementer and partno
+#define CPUID_M0        0x4100C200U
+#define CPUID_M0P       0x4100C600U
+#define CPUID_M3        0x4100C230U
+#define CPUID_M4        0x4100C240U
+#define CPUID_M7        0x4100C270U
+#define CPUID_M33       0x4100D210U
+
+// SW-DP DPIDR, less the revision
+#define DPIDR_MASK      0x0FFFFFFFU
+#define DPIDR_SWDP_V1   0x0BA01477U // ADIv5 SW-DP (Cortex-M3/M4)
+#define DPIDR_SWDP_M0   0x0BB11477U // ADIv5 SW-DP (Cortex-M0)
+#define DPIDR_SWDP_V2   0x0BC12477U // ADIv5.2 multidrop SW-DP (Cortex-M0+)
+
+// ST's ROM table carries the DBGMCU device id as its part number,
+// with designer 0x20 (JEP106, bank 0); ignore revision and size
+#define ROMPID_ST(id)   (0x000A0000U | (id))
+#define ROMPID_MASK     0x0F0FFFFFU
+
+#define STM32F0_DBGMCU  0x40015800U
+#define STM32F4_DBGMCU  0xE0042000U
+#define NRF52_FICR_PART 0x10000100U
+
+// M0/M0+ MEM-APs only guarantee the 1KB TAR wrap, M3/M4/M7
+// increment across 4KB.  STM32 stop/standby modes gate the debug
+// clocks unless DBGMCU_CR says otherwise, so only a reset gets
+// them back; nRF52 System OFF wakes on a debug connection.
+#define STM32F0(id, nm, ram) { \
+	.name = nm, \
+	.dpidr = DPIDR_SWDP_M0, .dpidr_mask = DPIDR_MASK, \
+	.cpuid = CPUID_M0, .cpuid_mask = CPUID_MASK, \
+	.rompid = ROMPID_ST(id), .rompid_mask = ROMPID_MASK, \
+	.devid_addr = STM32F0_DBGMCU, .devid = id, .devid_mask = 0xFFF, \
+	.swd_hz = 8000000, .idle = 0, .wait = 64, .wrap_size = 0x400, \
+	.agent = "stm32f0xx.bin", .masserase = "stm32f0", \
+	.ram_addr = 0x20000000, .ram_size = ram, \
+	.recovery = DC_RECOVER_RESET, }
+
+#define STM32F4(id, nm, ram) { \
+	.name = nm, \
+	.dpidr = DPIDR_SWDP_V1, .dpidr_mask = DPIDR_MASK, \
+	.cpuid = CPUID_M4, .cpuid_mask = CPUID_MASK, \
+	.rompid = ROMPID_ST(id), .rompid_mask = ROMPID_MASK, \
+	.devid_addr = STM32F4_DBGMCU, .devid = id, .devid_mask = 0xFFF, \
+	.swd_hz = 10000000, .idle = 0, .wait = 128, .wrap_size = 0x1000, \
+	.agent = "stm32f4xx.bin", .masserase = "stm32f4", \
+	.ram_addr = 0x20000000, .ram_size = ram, \
+	.recovery = DC_RECOVER_RESET, }
+
+#define NRF52(id, nm, ram) { \
+	.name = nm, \
+	.dpidr = DPIDR_SWDP_V1, .dpidr_mask = DPIDR_MASK, \
+	.cpuid = CPUID_M4, .cpuid_mask = CPUID_MASK, \
+	.devid_addr = NRF52_FICR_PART, .devid = id, .devid_mask = 0xFFFFFFFF, \
+	.swd_hz = 8000000, .idle = 0, .wait = 64, .wrap_size = 0x1000, \
+	.agent = "nrf528xx.bin", .direct = "nrf52-nvmc", \
+	.masserase = "nrf52-ctrlap", \
+	.ram_addr = 0x20000000, .ram_size = ram, \
+	.recovery = DC_RECOVER_ATTACH, }
+
+#define GENERIC(id, nm, wrap) { \
+	.name = nm, \
+	.cpuid = id, .cpuid_mask = CPUID_MASK, \
+	.idle = 8, .wait = 64, .wrap_size = wrap, }
+
+static const target_profile_t profiles[] = {
+	{
+		.name = "rp2040",
+		.dpidr = DPIDR_SWDP_V2, .dpidr_mask = DPIDR_MASK,
+		.targetid = 0x01002927, .targetid_mask = 0x0FFFFFFF,
+		.swd_hz = 12000000, .idle = 0, .wait = 64, .wrap_size = 0x400,
+		.agent = "pico.bin",
+		.ram_addr = 0x20000000, .ram_size = 0x40000,
+		.recovery = DC_RECOVER_ATTACH,
+	},
+	STM32F0(0x440, "stm32f05x", 0x2000),
+	STM32F0(0x442, "stm32f09x", 0x8000),
+	STM32F0(0x444, "stm32f03x", 0x1000),
+	STM32F0(0x445, "stm32f04x", 0x1800),
+	STM32F0(0x448, "stm32f07x", 0x4000),
+	STM32F4(0x413, "stm32f405/407", 0x20000),
+	STM32F4(0x419, "stm32f42x/43x", 0x30000),
+	STM32F4(0x423, "stm32f401xb/c", 0x10000),
+	STM32F4(0x433, "stm32f401xd/e", 0x18000),
+	STM32F4(0x431, "stm32f411", 0x20000),
+	STM32F4(0x421, "stm32f446", 0x20000),
+	NRF52(0x52832, "nrf52832", 0x10000),
+	NRF52(0x52833, "nrf52833", 0x20000),
+	NRF52(0x52840, "nrf52840", 0x40000),
+	GENERIC(CPUID_M0, "cortex-m0", 0x400),
+	GENERIC(CPUID_M0P, "cortex-m0+", 0x400),
+	GENERIC(CPUID_M3, "cortex-m3", 0x1000),
+	GENERIC(CPUID_M4, "cortex-m4", 0x1000),
+	GENERIC(CPUID_M7, "cortex-m7", 0x1000),
+	GENERIC(CPUID_M33, "cortex-m33", 0x400),
+};
+
+static const target_profile_t generic = {
+	.name = "unknown",
+	.idle = 8, .wait = 64, .wrap_size = 0x400,
+};
+
+static const target_profile_t* current = NULL;
+
+const target_profile_t* target_current(void) {
+	return current;
+}
+
+// pack PIDR0,1,2,4 low bytes: part number, designer, continuation
+static int read_rom_pid(dctx_t* dc, uint32_t* pid) {
+	uint32_t base, p0, p1, p2, p4;
+	if (dc_ap_rd(dc, MAP_BASE, &base) < 0) {
+		return DBG_ERR;
+	}
+	if ((base & (MAP_BASE_PRESENT | MAP_BASE_FORMAT)) !=
+		(MAP_BASE_PRESENT | MAP_BASE_FORMAT)) {
+		return DBG_ERR;
+	}
+	base = MAP_BASE_ADDR(base);
+	dc_q_init(dc);
+	dc_q_region(dc, DC_Q_RELAXED);
+	dc_q_mem_rd32(dc, base + CS_PIDR0, &p0);
+	dc_q_mem_rd32(dc, base + CS_PIDR1, &p1);
+	dc_q_mem_rd32(dc, base + CS_PIDR2, &p2);
+	dc_q_mem_rd32(dc, base + CS_PIDR4, &p4);
+	if (dc_q_exec(dc) < 0) {
+		return DBG_ERR;
+	}
+	*pid = (p0 & 0xFF) | ((p1 & 0xFF) << 8) |
+		((p2 & 0xFF) << 16) | ((p4 & 0xFF) << 24);
+	return 0;
+}
+
+const target_profile_t* target_identify(dctx_t* dc) {
+	uint32_t dpidr = 0, targetid = 0, cpuid = 0, rompid = 0;
+	int have_targetid = 0, have_cpuid = 0, have_rompid = 0;
+
+	// device id registers are read lazily, since most profiles
+	// share one of a few addresses, remember the last one
+	uint32_t devid_addr = 0, devid = 0;
+	int devid_ok = 0;
+
+	if (dc_dp_rd(dc, DP_DPIDR, &dpidr) < 0) {
+		current = &generic;
+		return current;
+	}
+	if (DP_DPIDR_VERSION(dpidr) >= 2) {
+		have_targetid = (dc_dp_rd(dc, DP_TARGETID, &targetid) == 0);
+	}
+	have_cpuid = (dc_mem_rd32(dc, CPUID, &cpuid) == 0);
+	have_rompid = (read_rom_pid(dc, &rompid) == 0);
+
+	DEBUG("target: DPIDR %08x TARGETID %08x CPUID %08x ROMPID %08x\n",
+		dpidr, targetid, cpuid, rompid);
+
+	for (unsigned n = 0; n < sizeof(profiles)/sizeof(profiles[0]); n++) {
+		const target_profile_t* tp = profiles + n;
+		if (tp->dpidr_mask && ((dpidr & tp->dpidr_mask) != tp->dpidr)) {
+			continue;
+		}
+		if (tp->targetid_mask && (!have_targetid ||
+			((targetid & tp->targetid_mask) != tp->targetid))) {
+			continue;
+		}
+		if (tp->cpuid_mask && (!have_cpuid ||
+			((cpuid & tp->cpuid_mask) != tp->cpuid))) {
+			continue;
+		}
+		if (tp->rompid_mask && (!have_rompid ||
+			((rompid & tp->rompid_mask) != tp->rompid))) {
+			continue;
+		}
+		if (tp->devid_addr) {
+			if (tp->devid_addr != devid_addr) {
+				devid_addr = tp->devid_addr;
+				devid_ok = (dc_mem_rd32(dc, devid_addr, &devid) == 0);
+			}
+			if (!devid_ok || ((devid & tp->devid_mask) != tp->devid)) {
+				continue;
+			}
+		}
+		current = tp;
+		return current;
+	}
+	current = &generic;
+	return current;
+}
+
+void target_apply(dctx_t* dc, const target_profile_t* tp) {
+	dc_set_xfer_config(dc, tp->idle, tp->wait);
+	if (tp->wrap_size) {
+		dc_set_wrap_size(dc, tp->wrap_size);
+	}
+}
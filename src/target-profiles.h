@@ -0,0 +1,59 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "transport.h"
+
+// A target profile identifies a part (or family of parts) and
+// carries transport and flashing parameters known to work well
+// with it, so attach can go straight to fast settings.
+//
+// Identification fields only participate when their mask is
+// nonzero (or, for devid, when devid_addr is nonzero), and all
+// participating fields must match.  Profiles are checked in
+// table order, so specific parts come before generic cores.
+typedef struct target_profile {
+	const char* name;
+
+	// identification
+	uint32_t dpidr, dpidr_mask;       // DP.DPIDR
+	uint32_t targetid, targetid_mask; // DP.TARGETID (DPv2 only)
+	uint32_t cpuid, cpuid_mask;       // SCB.CPUID
+	uint32_t rompid, rompid_mask;     // ROM table PIDR0,1,2,4 (low bytes)
+	uint32_t devid_addr;              // DBGMCU.IDCODE, FICR, etc
+	uint32_t devid, devid_mask;
+
+	// transport tuning (0 = leave as-is)
+	uint32_t swd_hz;
+	uint32_t idle;      // idle cycles after each transfer
+	uint32_t wait;      // retries after WAIT response
+	uint32_t wrap_size; // MEM-AP TAR auto-increment wrap
+
+	// flashing
+	const char* agent;  // builtin agent binary
+	const char* direct; // agentless flash driver (see commands-agent.c)
+	const char* masserase; // debug-port mass erase method (ditto)
+	uint32_t ram_addr;  // on-chip ram, which the agent and its
+	                    // data buffer must stay within
+	uint32_t ram_size;
+
+	// what "attach recover" does when the target stops responding
+	// (DC_RECOVER_*, none meaning the plain reattach)
+	unsigned recovery;
+} target_profile_t;
+
+// read the target's identification registers and return
+// the first matching profile (never NULL: falls back to
+// a conservative generic profile)
+const target_profile_t* target_identify(dctx_t* dc);
+
+// apply a profile's transport settings
+// (the SWD clock is left to the caller, which may have been
+// told to use a specific one)
+void target_apply(dctx_t* dc, const target_profile_t* tp);
+
+// most recently identified profile (or NULL)
+const target_profile_t* target_current(void);
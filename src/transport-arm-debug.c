@@ -1,6 +1,8 @@
 // Copyright 2023, Brian Swetland <swetland@frotz.net>
 // Licensed under the Apache License, Version 2.0.
 
+#include <stdlib.h>
+
 #include "transport.h"
 #include "transport-private.h"
 
@@ -21,10 +23,148 @@ static void dc_q_map_tar_wr(DC* dc, uint32_t val) {
 	}
 }
 
+// Relaxed regions (see dc_q_region()): collected accesses are
+// sorted by DP.SELECT group (AP:8 BANK:4, memory being the MEM-AP's
+// bank 0), then reads and writes by address ahead of matches by mask
+// and address.  Sorting is stable, so same-location accesses keep
+// their order, except that a match may not move past a later read
+// or write of its location, or a later match there with another
+// mask: such an access ends the collected run instead.
+
+static int qop_cmp(const void* _a, const void* _b) {
+	const qop_t* a = _a;
+	const qop_t* b = _b;
+	uint32_t ga = (a->kind <= QOP_AP_WR) ? (a->addr >> 4) : 0;
+	uint32_t gb = (b->kind <= QOP_AP_WR) ? (b->addr >> 4) : 0;
+	if (ga != gb) {
+		return (ga < gb) ? -1 : 1;
+	}
+	int ma = (a->kind == QOP_MEM_MATCH);
+	int mb = (b->kind == QOP_MEM_MATCH);
+	if (ma != mb) {
+		return ma - mb;
+	}
+	if (ma && (a->mask != b->mask)) {
+		return (a->mask < b->mask) ? -1 : 1;
+	}
+	if (a->addr != b->addr) {
+		return (a->addr < b->addr) ? -1 : 1;
+	}
+	return (a->seq < b->seq) ? -1 : 1;
+}
+
+int dc_q_opt_add(DC* dc, unsigned kind, uint32_t addr, uint32_t val, uint32_t* ptr) {
+	if (dc->qerror) {
+		return 0;
+	}
+	if ((kind <= QOP_AP_WR) && ((addr >> 8) == 0)) {
+		// the MEM-AP's own registers (CSW, TAR, DRW, BDn)
+		// are tied up with collected memory accesses
+		dc_q_opt_flush(dc);
+		return -1;
+	}
+	if ((kind == QOP_MEM_MATCH) && (dc->qmask == INVALID)) {
+		ERROR("relaxed match at %08x without a mask\n", addr);
+		dc->qerror = DC_ERR_BAD_PARAMS;
+		return 0;
+	}
+	if (kind >= QOP_MEM_RD) {
+		for (uint32_t n = 0; n < dc->qopcount; n++) {
+			if ((dc->qop[n].kind == QOP_MEM_MATCH) && (dc->qop[n].addr == addr) &&
+				((kind != QOP_MEM_MATCH) || (dc->qop[n].mask != dc->qmask))) {
+				dc_q_opt_flush(dc);
+				break;
+			}
+		}
+	}
+	if (dc->qopcount == QOP_MAX) {
+		dc_q_opt_flush(dc);
+	}
+	if (dc->qopcount == dc->qopmax) {
+		uint32_t max = dc->qopmax ? dc->qopmax * 2 : 64;
+		qop_t* qop = realloc(dc->qop, max * sizeof(qop_t));
+		if (qop == NULL) {
+			dc->qerror = DC_ERR_FAILED;
+			return 0;
+		}
+		dc->qop = qop;
+		dc->qopmax = max;
+	}
+	qop_t* op = dc->qop + dc->qopcount;
+	op->kind = kind;
+	op->addr = addr;
+	op->val = val;
+	op->mask = dc->qmask;
+	op->ptr = ptr;
+	op->seq = dc->qopcount++;
+	return 0;
+}
+
+void dc_q_opt_flush(DC* dc) {
+	uint32_t count = dc->qopcount;
+	if (count == 0) {
+		return;
+	}
+	qop_t* op = dc->qop;
+	qsort(op, count, sizeof(qop_t), qop_cmp);
+
+	// encode as queued from here (restoring the caller's
+	// mask, which encoding matches will have changed)
+	unsigned region = dc->qregion;
+	uint32_t mask = dc->qmask;
+	dc->qregion = DC_Q_ORDERED;
+	dc->qopcount = 0;
+
+	for (uint32_t n = 0; n < count; n++, op++) {
+		if (((op->kind == QOP_AP_WR) || (op->kind == QOP_MEM_WR)) &&
+			((n + 1) < count) && (op[1].kind == op->kind) &&
+			(op[1].addr == op->addr)) {
+			// overwritten before anything reads it
+			continue;
+		}
+		switch (op->kind) {
+		case QOP_AP_RD:
+			dc_q_ap_rd(dc, op->addr, op->ptr);
+			break;
+		case QOP_AP_WR:
+			dc_q_ap_wr(dc, op->addr, op->val);
+			break;
+		case QOP_MEM_RD:
+		case QOP_MEM_WR:
+			dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
+			dc_q_map_tar_wr(dc, op->addr);
+			if (op->kind == QOP_MEM_RD) {
+				dc_q_ap_rd(dc, MAP_DRW, op->ptr);
+			} else {
+				dc_q_ap_wr(dc, MAP_DRW, op->val);
+			}
+			// TAR has moved on to the next word, unless it wrapped,
+			// so a following neighbour costs no TAR write
+			if ((op->addr + 4) & (dc->map_wrap_size - 1)) {
+				dc->map_tar_cache = op->addr + 4;
+			} else {
+				dc->map_tar_cache = INVALID;
+			}
+			break;
+		case QOP_MEM_MATCH:
+			dc_q_set_mask(dc, op->mask);
+			dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
+			dc_q_map_tar_wr(dc, op->addr);
+			dc_q_ap_match(dc, MAP_DRW, op->val);
+			break;
+		}
+	}
+
+	dc->qregion = region;
+	dc->qmask = mask;
+}
+
 
 void dc_q_mem_rd32(DC* dc, uint32_t addr, uint32_t* val) {
 	if (addr & 3) {
 		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else if (dc->qregion == DC_Q_RELAXED) {
+		dc_q_opt_add(dc, QOP_MEM_RD, addr, 0, val);
 	} else {
 		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
 		dc_q_map_tar_wr(dc, addr);
@@ -35,6 +175,8 @@ void dc_q_mem_rd32(DC* dc, uint32_t addr, uint32_t* val) {
 void dc_q_mem_match32(DC* dc, uint32_t addr, uint32_t val) {
 	if (addr & 3) {
 		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else if (dc->qregion == DC_Q_RELAXED) {
+		dc_q_opt_add(dc, QOP_MEM_MATCH, addr, val, NULL);
 	} else {
 		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
 		dc_q_map_tar_wr(dc, addr);
@@ -45,6 +187,8 @@ void dc_q_mem_match32(DC* dc, uint32_t addr, uint32_t val) {
 void dc_q_mem_wr32(DC* dc, uint32_t addr, uint32_t val) {
 	if (addr & 3) {
 		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else if (dc->qregion == DC_Q_RELAXED) {
+		dc_q_opt_add(dc, QOP_MEM_WR, addr, val, NULL);
 	} else {
 		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
 		dc_q_map_tar_wr(dc, addr);
@@ -52,6 +196,26 @@ void dc_q_mem_wr32(DC* dc, uint32_t addr, uint32_t val) {
 	}
 }
 
+void dc_q_mem_rd32_ts(DC* dc, uint32_t addr, uint32_t* val, uint32_t* ts) {
+	if (addr & 3) {
+		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else {
+		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
+		dc_q_map_tar_wr(dc, addr);
+		dc_q_ap_rd_ts(dc, MAP_DRW, val, ts);
+	}
+}
+
+void dc_q_mem_wr32_ts(DC* dc, uint32_t addr, uint32_t val, uint32_t* ts) {
+	if (addr & 3) {
+		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else {
+		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
+		dc_q_map_tar_wr(dc, addr);
+		dc_q_ap_wr_ts(dc, MAP_DRW, val, ts);
+	}
+}
+
 int dc_mem_rd32(DC* dc, uint32_t addr, uint32_t* val) {
 	dc_q_init(dc);
 	dc_q_mem_rd32(dc, addr, val);
@@ -87,57 +251,74 @@ int dc_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr
 	return dc_q_exec(dc);
 }
 #else
-// some implementations support >10 bits, but 10 is the minimum required
-// by spec (and some targets like rp2040 are limited to this)
-#define WRAPSIZE 0x400
-#define WRAPMASK (WRAPSIZE - 1)
+// TAR auto-increment wraps at dc->map_wrap_size, which defaults to
+// 0x400: some implementations support >10 bits, but 10 is the minimum
+// required by spec (and some targets like rp2040 are limited to this)
+//
+// Whole buffers are queued as one batch (which flushes as the probe's
+// packet buffering fills) rather than one round trip per wrap block.
 
 int dc_mem_rd_words(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr) {
+	dc_q_init(dc);
 	while (num > 0) {
-		uint32_t xfer = (WRAPSIZE - (addr & WRAPMASK)) / 4;
+		uint32_t xfer = (dc->map_wrap_size - (addr & (dc->map_wrap_size - 1))) / 4;
 		if (xfer > num) {
 			xfer = num;
 		}
-		dc_q_init(dc);
 		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
 		dc_q_map_tar_wr(dc, addr);
 		num -= xfer;
 		addr += xfer * 4;
 		while (xfer > 0) {
 			dc_q_ap_rd(dc, MAP_DRW, ptr++);
+			// where TAR points next, should a packet restate it
+			dc->map_tar_cache += 4;
 			xfer--;
 		}
-		int r = dc_q_exec(dc);
-		if (r != DC_OK) {
-			return r;
-		}
+		// TAR has advanced (or wrapped) behind the cache's back
+		dc->map_tar_cache = INVALID;
 	}
-	return DC_OK;
+	return dc_q_exec(dc);
 }
 
 int dc_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr) {
+	dc_q_init(dc);
+	dc_q_mem_wr_words(dc, addr, num, ptr);
+	return dc_q_exec(dc);
+}
+#endif
+
+void dc_q_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr) {
+	if (addr & 3) {
+		dc->qerror = DC_ERR_BAD_PARAMS;
+		return;
+	}
+	if (dc->qregion == DC_Q_RELAXED) {
+		while (num-- > 0) {
+			dc_q_opt_add(dc, QOP_MEM_WR, addr, *ptr++, NULL);
+			addr += 4;
+		}
+		return;
+	}
 	while (num > 0) {
-		uint32_t xfer = (WRAPSIZE - (addr & WRAPMASK)) / 4;
+		uint32_t xfer = (dc->map_wrap_size - (addr & (dc->map_wrap_size - 1))) / 4;
 		if (xfer > num) {
 			xfer = num;
 		}
-		dc_q_init(dc);
 		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
 		dc_q_map_tar_wr(dc, addr);
 		num -= xfer;
 		addr += xfer * 4;
 		while (xfer > 0) {
 			dc_q_ap_wr(dc, MAP_DRW, *ptr++);
+			// where TAR points next, should a packet restate it
+			dc->map_tar_cache += 4;
 			xfer--;
 		}
-		int r = dc_q_exec(dc);
-		if (r != DC_OK) {
-			return r;
-		}
+		// TAR has advanced (or wrapped) behind the cache's back
+		dc->map_tar_cache = INVALID;
 	}
-	return DC_OK;
 }
-#endif
 
 int dc_core_check_halt(dctx_t* dc) {
 	uint32_t val;
@@ -228,35 +409,83 @@ int dc_core_step(DC* dc) {
 	return 0;
 }
 
+// the probe polls DHCSR for up to this many reads per batch,
+// which bounds how long an interrupt request goes unnoticed
+#define WAIT_HALT_MATCH_RETRY 1024
+
 int dc_core_wait_halt(DC* dc) {
 	uint32_t last = dc_get_attn_value(dc);
-	uint32_t val;
+	unsigned retry = dc_set_match_retry(dc, WAIT_HALT_MATCH_RETRY);
 	int r;
 	for (;;) {
-		if ((r = dc_mem_rd32(dc, DHCSR, &val)) < 0) {
-			return r;
-		}
-		if (val & DHCSR_S_HALT) {
-			return 0;
+		dc_q_init(dc);
+		dc_q_poll(dc);
+		dc_q_set_mask(dc, DHCSR_S_HALT);
+		dc_q_mem_match32(dc, DHCSR, DHCSR_S_HALT);
+		if ((r = dc_q_exec(dc)) != DC_ERR_MATCH) {
+			break;
 		}
 		if (last != dc_get_attn_value(dc)) {
-			return DC_ERR_INTERRUPTED;
+			r = DC_ERR_INTERRUPTED;
+			break;
 		}
 	}
-	return 0;
+	dc_set_match_retry(dc, retry);
+	return r;
+}
+
+int dc_fpb_enable(DC* dc) {
+	uint32_t ctrl;
+	int r;
+	if ((r = dc_mem_rd32(dc, FP_CTRL, &ctrl)) < 0) {
+		return r;
+	}
+	dc->fpb_rev = FP_CTRL_REV(ctrl);
+	dc->fpb_count = FP_CTRL_NUM_CODE(ctrl);
+	if ((dc->fpb_count != 0) && !(ctrl & FP_CTRL_ENABLE)) {
+		if ((r = dc_mem_wr32(dc, FP_CTRL, FP_CTRL_KEY | FP_CTRL_ENABLE)) < 0) {
+			return r;
+		}
+	}
+	return dc->fpb_count;
+}
+
+void dc_q_fpb_set(DC* dc, unsigned n, uint32_t addr) {
+	uint32_t comp;
+	if (n >= dc->fpb_count) {
+		dc->qerror = DC_ERR_BAD_PARAMS;
+		return;
+	}
+	if (addr == DC_FPB_OFF) {
+		comp = 0;
+	} else if (dc->fpb_rev != 0) {
+		comp = (addr & 0xFFFFFFFE) | FP_COMP_ENABLE;
+	} else if (addr < 0x20000000) {
+		comp = (addr & 0x1FFFFFFC) | FP_COMP_ENABLE |
+			((addr & 2) ? FP_COMP_BP_HI : FP_COMP_BP_LO);
+	} else {
+		dc->qerror = DC_ERR_BAD_PARAMS;
+		return;
+	}
+	dc_q_mem_wr32(dc, FP_COMP(n), comp);
 }
 
-static void dc_q_core_reg_rd(DC* dc, unsigned id, uint32_t* val) {
+// the DCRSR/DHCSR/DCRDR handshake is never reordered
+void dc_q_core_reg_rd(DC* dc, unsigned id, uint32_t* val) {
+	unsigned region = dc_q_region(dc, DC_Q_ORDERED);
 	dc_q_mem_wr32(dc, DCRSR, DCRSR_RD | (id & DCRSR_ID_MASK));
 	dc_q_set_mask(dc, DHCSR_S_REGRDY);
 	dc_q_mem_match32(dc, DHCSR, DHCSR_S_REGRDY);
 	dc_q_mem_rd32(dc, DCRDR, val);
+	dc_q_region(dc, region);
 }
-static void dc_q_core_reg_wr(DC* dc, unsigned id, uint32_t val) {
+void dc_q_core_reg_wr(DC* dc, unsigned id, uint32_t val) {
+	unsigned region = dc_q_region(dc, DC_Q_ORDERED);
 	dc_q_mem_wr32(dc, DCRDR, val);
 	dc_q_mem_wr32(dc, DCRSR, DCRSR_WR | (id & DCRSR_ID_MASK));
 	dc_q_set_mask(dc, DHCSR_S_REGRDY);
 	dc_q_mem_match32(dc, DHCSR, DHCSR_S_REGRDY);
+	dc_q_region(dc, region);
 }
 
 int dc_core_reg_rd(DC* dc, unsigned id, uint32_t* val) {
@@ -5,9 +5,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "usb.h"
 #include "arm-debug.h"
+#include "arm-v7-debug.h"
 #include "cmsis-dap-protocol.h"
 #include "transport.h"
 #include "transport-private.h"
@@ -125,6 +127,25 @@ int dc_set_clock(DC* dc, uint32_t hz) {
 	return dap_cmd_std(dc, "dap_swj_clock()", io, 5, 2);
 }
 
+// drive the pins selected by sel to the levels in out
+// and wait up to us microseconds for them to settle
+static int dap_swj_pins(DC* dc, unsigned out, unsigned sel, unsigned us) {
+	uint8_t io[7] = { DAP_SWJ_Pins, out, sel,
+		us, us >> 8, us >> 16, us >> 24 };
+	int r = dap_cmd(dc, io, 7, io, 2);
+	if (r < 0) {
+		return r;
+	}
+	return 0;
+}
+
+// have the probe wait (up to 65535us)
+static int dap_delay(DC* dc, unsigned us) {
+	if (us > 65535) us = 65535;
+	uint8_t io[3] = { DAP_Delay, us, us >> 8 };
+	return dap_cmd_std(dc, "dap_delay()", io, 3, 2);
+}
+
 static int dap_xfer_config(DC* dc, unsigned idle, unsigned wait, unsigned match) {
 	// clamp to allowed max values
 	if (idle > 255) idle = 255;
@@ -148,15 +169,80 @@ static int dap_xfer_config(DC* dc, unsigned idle, unsigned wait, unsigned match)
 	return dap_cmd_std(dc, "dap_transfer_configure()", io, 6, 2); 
 }
 
-static void dc_q_clear(DC* dc) {
-	dc->txnext = dc->txbuf + 3;
-	dc->rxnext = dc->rxptr;
+// DAP_Transfer carries an 8bit transfer count
+#define MAX_XFER_COUNT 255
+
+// every response run is at least one word
+static uint32_t dc_q_max_runs(DC* dc) {
+	return (dc->max_packet_size - 3) / 4;
+}
+
+static void dc_q_free(DC* dc) {
+	free(dc->arena);
+	dc->arena = NULL;
+	dc->arena_size = 0;
+}
+
+// size the queue arena for the probe's packet configuration,
+// (re)allocating only if it needs to grow
+static int dc_q_alloc(DC* dc) {
+	uint32_t count = dc->max_packet_count;
+	uint32_t size = dc->max_packet_size;
+	uint32_t need = count * sizeof(txpkt_t) +
+		count * dc_q_max_runs(dc) * sizeof(rxrun_t) +
+		size + count * size;
+	if (need > dc->arena_size) {
+		uint8_t* arena = realloc(dc->arena, need);
+		if (arena == NULL) {
+			dc_q_free(dc);
+			return DC_ERR_FAILED;
+		}
+		dc->arena = arena;
+		dc->arena_size = need;
+	}
+	dc->pkt = (void*) dc->arena;
+	dc->rxrun = (void*) (dc->pkt + count);
+	dc->rxbuf = (void*) (dc->rxrun + count * dc_q_max_runs(dc));
+	dc->txbuf = dc->rxbuf + size;
+	return 0;
+}
+
+static void dc_q_start_packet(DC* dc, uint8_t* tx, rxrun_t* run) {
+	dc->txbuf = tx;
+	dc->txnext = tx + 3;
+	dc->rxrun = run;
+	dc->rxnext = run;
+	dc->rxcount = 0;
+	dc->txmatch = 0;
 	dc->txavail = dc->max_packet_size - 3;
 	dc->rxavail = dc->max_packet_size - 3;
-	dc->qerror = 0;
 	dc->txbuf[0] = DAP_Transfer;
 	dc->txbuf[1] = 0; // Index 0 for SWD
 	dc->txbuf[2] = 0; // Count 0 initially
+}
+
+static void dc_q_close_packet(DC* dc) {
+	txpkt_t* p = dc->pkt + dc->pktcount - 1;
+	p->tx = dc->txbuf;
+	p->txlen = dc->txnext - dc->txbuf;
+	p->run = dc->rxrun;
+	p->end = dc->rxnext;
+	p->rxcount = dc->rxcount;
+	p->match = dc->txmatch;
+}
+
+static void dc_q_clear(DC* dc) {
+	dc->qerror = 0;
+	dc->pktcount = 1;
+	if (dc->arena == NULL) {
+		// not configured yet, nothing may be queued
+		dc->txavail = 0;
+		dc->rxavail = 0;
+		dc->qerror = DC_ERR_OFFLINE;
+	} else {
+		dc_q_start_packet(dc, dc->rxbuf + dc->max_packet_size,
+			(void*) (dc->pkt + dc->max_packet_count));
+	}
 
 	// TODO: less conservative mode: don't always invalidate
 	dc->dp_select_cache = INVALID;
@@ -168,10 +254,36 @@ static void dc_q_clear(DC* dc) {
 void dc_q_init(DC* dc) {
 	// TODO: handle error cleanup, re-attach, etc
 	dc_q_clear(dc);
+	dc->qregion = DC_Q_ORDERED;
+	dc->qopcount = 0;
+	dc->qmask = INVALID;
+	dc->qpoll = 0;
+}
+
+void dc_q_poll(DC* dc) {
+	dc->qpoll = 1;
+}
+
+unsigned dc_q_region(DC* dc, unsigned type) {
+	unsigned old = dc->qregion;
+	if (type != DC_Q_RELAXED) {
+		// accesses queued from here on may depend on
+		// (or have effects visible to) collected ones
+		dc_q_opt_flush(dc);
+	}
+	dc->qregion = type;
+	return old;
+}
+
+// accesses that are never moved go out after everything collected
+static inline void dc_q_barrier(DC* dc) {
+	if (dc->qopcount) {
+		dc_q_opt_flush(dc);
+	}
 }
 
 // unpack the status bits into a useful status code
-static int dc_decode_status(unsigned n) {
+static int dc_decode_status(unsigned n, int quiet_match) {
 	unsigned ack = n & RSP_ACK_MASK;
 	if (n & RSP_ProtocolError) {
 		ERROR("DAP SWD Parity Error\n");
@@ -194,12 +306,88 @@ static int dc_decode_status(unsigned n) {
 		return DC_ERR_SWD_BOGUS;
 	}
 	if (n & RSP_ValueMismatch) {
-		ERROR("DAP Value Mismatch\n");
+		if (!quiet_match) {
+			ERROR("DAP Value Mismatch\n");
+		}
 		return DC_ERR_MATCH;
 	}
 	return DC_OK;
 }
 
+// The probe uart is polled with DAP_UART_Transfer, which also
+// carries pending tx.  Polls ride along with transfer batches
+// (as one more packet, when the probe has room for it) at most
+// every UART_POLL_US, and dc_periodic() drains it when idle.
+#define UART_POLL_US 20000
+
+static uint64_t uart_now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((uint64_t) tv.tv_sec) * 1000000ULL + tv.tv_usec;
+}
+
+// build a DAP_UART_Transfer request carrying as much of the
+// pending tx as fits in max bytes, returns its length
+static unsigned dap_uart_request(DC* dc, uint8_t* tx, unsigned max) {
+	unsigned n = dc->uart_txlen;
+	if (n > (max - 3)) {
+		n = max - 3;
+	}
+	tx[0] = DAP_UART_Transfer;
+	tx[1] = n;
+	tx[2] = n >> 8;
+	memcpy(tx + 3, dc->uart_tx, n);
+	return 3 + n;
+}
+
+// consume a DAP_UART_Transfer response, returns rx byte count
+static int dap_uart_response(DC* dc, const uint8_t* rx, int len) {
+	if ((len < 6) || (rx[0] != DAP_UART_Transfer)) {
+		ERROR("uart: bad response\n");
+		return DC_ERR_PROTOCOL;
+	}
+	unsigned txn = rx[2] | (rx[3] << 8);
+	unsigned rxn = rx[4] | (rx[5] << 8);
+	if ((txn > dc->uart_txlen) || (rxn > (len - 6))) {
+		ERROR("uart: bogus counts\n");
+		return DC_ERR_PROTOCOL;
+	}
+	dc->uart_txlen -= txn;
+	memmove(dc->uart_tx, dc->uart_tx + txn, dc->uart_txlen);
+	if (rx[1] & UART_ST_RX_LOST) {
+		ERROR("uart: rx data lost\n");
+	}
+	if (rx[1] & (UART_ST_FRAMING | UART_ST_PARITY)) {
+		ERROR("uart: framing/parity error\n");
+	}
+	dc->uart_next = uart_now() + UART_POLL_US;
+	if (dc->uart_callback) {
+		dc->uart_callback(dc->uart_cookie, rx + 6, rxn);
+	}
+	return rxn;
+}
+
+// standalone poll, repeated while the probe returns full packets
+// or there is tx left to send
+static int dap_uart_poll(DC* dc) {
+	uint8_t io[1024];
+	unsigned max = (dc->max_packet_size < sizeof(io)) ? dc->max_packet_size : sizeof(io);
+	int r;
+	for (unsigned n = 0; n < 16; n++) {
+		unsigned len = dap_uart_request(dc, io, max);
+		if ((r = dap_cmd(dc, io, len, io, max)) < 0) {
+			return r;
+		}
+		if ((r = dap_uart_response(dc, io, r)) < 0) {
+			return r;
+		}
+		if ((r < (max - 6)) && (dc->uart_txlen == 0)) {
+			break;
+		}
+	}
+	return 0;
+}
+
 // this internal version is called from the "public" dc_q_exec
 // as well as when we need to flush outstanding txns before
 // continuing to queue up more
@@ -211,50 +399,167 @@ static int _dc_q_exec(DC* dc) {
 		return r;
 	}
 	// if we have no work to do, succeed
-	if (dc->txbuf[2] == 0) {
+	if ((dc->pktcount == 1) && (dc->txbuf[2] == 0)) {
 		return 0;
 	}
-	int sz = dc->txnext - dc->txbuf;
-	dump("TX>", dc->txbuf, sz);
-	int n = usb_write(dc->usb, dc->txbuf, sz);
-	if (n != sz) {
-		ERROR("dc_q_exec() usb write error\n");
+	dc_q_close_packet(dc);
+
+	// Send packets before reading their responses, so the probe can
+	// work through them without waiting on us.  A failed transfer
+	// only aborts the rest of its own packet, so a packet holding a
+	// value match is a barrier: nothing behind it is sent until its
+	// response shows the match succeeded (a WAIT timeout or mismatch
+	// does not latch in the DP the way a FAULT does).
+	int r = DC_OK;
+	int uart = 0;
+	txpkt_t* p = dc->pkt;
+	txpkt_t* end = dc->pkt + dc->pktcount;
+	while ((p < end) && (r == DC_OK)) {
+		txpkt_t* stop = p;
+		while ((stop < end) && !stop->match) {
+			stop++;
+		}
+		if (stop < end) {
+			stop++;
+		}
+		for (txpkt_t* q = p; q < stop; q++) {
+			dump("TX>", q->tx, q->txlen);
+			int n = usb_write(dc->usb, q->tx, q->txlen);
+			if (n != q->txlen) {
+				ERROR("dc_q_exec() usb write error\n");
+				if (n < 0) {
+					usb_failure(dc, n);
+				}
+				return DC_ERR_IO;
+			}
+		}
+
+		// a due uart poll goes along in the next free packet slot
+		if ((stop == end) && dc->uart_on && (dc->pktcount < dc->max_packet_count) &&
+			(uart_now() >= dc->uart_next)) {
+			uint8_t* tx = dc->pkt[dc->pktcount - 1].tx + dc->max_packet_size;
+			unsigned len = dap_uart_request(dc, tx, dc->max_packet_size);
+			int n = usb_write(dc->usb, tx, len);
+			if (n != len) {
+				ERROR("dc_q_exec() usb write error\n");
+				if (n < 0) {
+					usb_failure(dc, n);
+				}
+				return DC_ERR_IO;
+			}
+			uart = 1;
+		}
+
+		// read every response sent to stay in sync with the
+		// probe, but only decode up to the first failure (packets
+		// behind a failed one in the same group will have been
+		// executed, their results are discarded)
+		for (; p < stop; p++) {
+			int sz = 3 + p->rxcount * 4;
+#if 0
+			// poison the buffer to catch short responses
+			memset(dc->rxbuf, 0xEE, dc->max_packet_size);
+#endif
+			int n = usb_read(dc->usb, dc->rxbuf, sz);
+			if (n < 0) {
+				ERROR("dc_q_exec() usb read error\n");
+				usb_failure(dc, n);
+				return DC_ERR_IO;
+			}
+			dump("RX>", dc->rxbuf, sz);
+			if (r != DC_OK) {
+				continue;
+			}
+			if ((n < 3) || (dc->rxbuf[0] != DAP_Transfer)) {
+				ERROR("dc_q_exec() bad response\n");
+				r = DC_ERR_PROTOCOL;
+				continue;
+			}
+			if ((r = dc_decode_status(dc->rxbuf[2], dc->qpoll)) != DC_OK) {
+				continue;
+			}
+			// how many response words available?
+			uint32_t avail = (n - 3) / 4;
+			uint8_t* rxptr = dc->rxbuf + 3;
+			// one copy per contiguous destination run
+			for (rxrun_t* run = p->run; run < p->end; run++) {
+				uint32_t count = (run->count > avail) ? avail : run->count;
+				memcpy(run->ptr, rxptr, count * 4);
+				rxptr += count * 4;
+				avail -= count;
+			}
+		}
+	}
+	if (uart) {
+		int n = usb_read(dc->usb, dc->rxbuf, dc->max_packet_size);
 		if (n < 0) {
+			ERROR("dc_q_exec() usb read error\n");
 			usb_failure(dc, n);
+			return DC_ERR_IO;
 		}
-		return DC_ERR_IO;
+		dap_uart_response(dc, dc->rxbuf, n);
 	}
-	sz = 3 + (dc->rxnext - dc->rxptr) * 4;
-	uint8_t rxbuf[1024];
-	memset(rxbuf, 0xEE, 1024); // DEBUG
-	n = usb_read(dc->usb, rxbuf, sz);
-	if (n < 0) {
-		ERROR("dc_q_exec() usb read error\n");
-		usb_failure(dc, n);
-		return DC_ERR_IO;
+
+	dc_q_clear(dc);
+	return r;
+}
+
+static void dc_q_raw_wr(DC* dc, unsigned req, uint32_t val);
+void dc_q_ap_sel(DC* dc, uint32_t apaddr);
+
+// A WAIT timeout (unlike a FAULT) only aborts the rest of its own
+// packet, and the packets behind it in the group still run.  So each
+// packet starts by restating the MEM-AP CSW and TAR the queue expects,
+// rather than trusting writes (or TAR increments) in an earlier one.
+static void dc_q_restate(DC* dc) {
+	uint32_t select = dc->dp_select_cache;
+	if (dc->map_csw_cache != INVALID) {
+		dc_q_ap_sel(dc, MAP_CSW);
+		dc_q_raw_wr(dc, XFER_AP | XFER_WR | MAP_CSW, dc->map_csw_cache | dc->map_csw_keep);
 	}
-	dump("RX>", rxbuf, sz);
-	if ((n < 3) || (rxbuf[0] != DAP_Transfer)) {
-		ERROR("dc_q_exec() bad response\n");
-		return DC_ERR_PROTOCOL;
+	if (dc->map_tar_cache != INVALID) {
+		dc_q_ap_sel(dc, MAP_TAR);
+		dc_q_raw_wr(dc, XFER_AP | XFER_WR | MAP_TAR, dc->map_tar_cache);
 	}
-	int r = dc_decode_status(rxbuf[2]);
-	if (r == DC_OK) {
-		// how many response words available?
-		n = (n - 3) / 4;
-		uint8_t* rxptr = rxbuf + 3;
-		for (unsigned i = 0; i < n; i++) {
-			memcpy(dc->rxptr[i], rxptr, 4);
-			rxptr += 4;
-		}
+	if ((select != INVALID) && (select != dc->dp_select_cache)) {
+		dc->dp_select_cache = select;
+		dc_q_raw_wr(dc, XFER_DP | XFER_WR | DP_SELECT, select);
 	}
+}
 
-	dc_q_clear(dc);
+// make room for more work: start another packet in this batch
+// if the probe can buffer one, otherwise exec the batch
+static int dc_q_flush(DC* dc) {
+	if (dc->qerror) {
+		return _dc_q_exec(dc);
+	}
+	if (dc->pktcount < dc->max_packet_count) {
+		dc_q_close_packet(dc);
+		txpkt_t* p = dc->pkt + dc->pktcount - 1;
+		dc->pktcount++;
+		dc_q_start_packet(dc, p->tx + dc->max_packet_size, p->end);
+		dc_q_restate(dc);
+		return DC_OK;
+	}
+	// a batch that ran cleanly left the DP and MEM-AP as queued:
+	// carry on from there (mid-stream TAR included)
+	uint32_t select = dc->dp_select_cache;
+	uint32_t csw = dc->map_csw_cache;
+	uint32_t tar = dc->map_tar_cache;
+	int r = _dc_q_exec(dc);
+	if (r == DC_OK) {
+		dc->dp_select_cache = select;
+		dc->map_csw_cache = csw;
+		dc->map_tar_cache = tar;
+	}
 	return r;
 }
 
 // the public dc_q_exec() is called from higher layers
 int dc_q_exec(DC* dc) {
+	dc_q_opt_flush(dc);
+	dc->qregion = DC_Q_ORDERED;
+	dc->qmask = INVALID;
 	int r = _dc_q_exec(dc);
 	if (r == DC_ERR_SWD_FAULT) {
 		// clear all sticky errors
@@ -267,38 +572,73 @@ int dc_q_exec(DC* dc) {
 
 // internal use only -- queue raw dp reads and writes
 // these do not check req for correctness
-static void dc_q_raw_rd(DC* dc, unsigned req, uint32_t* val) {
-	if ((dc->txavail < 1) || (dc->rxavail < 4)) {
+// add a response word destination, extending the current
+// run if this lands right after it
+static void dc_q_rx_word(DC* dc, uint32_t* ptr) {
+	if ((dc->rxnext != dc->rxrun) &&
+		((dc->rxnext[-1].ptr + dc->rxnext[-1].count) == ptr)) {
+		dc->rxnext[-1].count++;
+	} else {
+		dc->rxnext->ptr = ptr;
+		dc->rxnext->count = 1;
+		dc->rxnext++;
+	}
+	dc->rxcount += 1;
+	dc->rxavail -= 4;
+}
+
+// if ts is non-NULL, request the probe timestamp for this
+// transfer, which precedes the data in the response
+static void dc_q_raw_rd_ts(DC* dc, unsigned req, uint32_t* val, uint32_t* ts) {
+	unsigned rxneed = ts ? 8 : 4;
+	if ((dc->txavail < 1) || (dc->rxavail < rxneed) ||
+		(dc->txbuf[2] == MAX_XFER_COUNT)) {
 		// exec q to make space for more work,
 		// but if there's an error, latch it
 		// so we don't send any further txns
-		if ((dc->qerror = _dc_q_exec(dc)) != DC_OK) {
+		if ((dc->qerror = dc_q_flush(dc)) != DC_OK) {
 			return;
 		}
 	}
-	dc->txnext[0] = req;
-	dc->rxnext[0] = val;
+	dc->txnext[0] = req | (ts ? XFER_TimeStamp : 0);
 	dc->txnext += 1;
-	dc->rxnext += 1;
+	if (ts) {
+		dc_q_rx_word(dc, ts);
+	}
+	dc_q_rx_word(dc, val);
 	dc->txbuf[2] += 1;
 	dc->txavail -= 1;
-	dc->rxavail -= 4;
 }
 
-static void dc_q_raw_wr(DC* dc, unsigned req, uint32_t val) {
-	if (dc->txavail < 5) {
+static void dc_q_raw_rd(DC* dc, unsigned req, uint32_t* val) {
+	dc_q_raw_rd_ts(dc, req, val, NULL);
+}
+
+static void dc_q_raw_wr_ts(DC* dc, unsigned req, uint32_t val, uint32_t* ts) {
+	if ((dc->txavail < 5) || (ts && (dc->rxavail < 4)) ||
+		(dc->txbuf[2] == MAX_XFER_COUNT)) {
 		// exec q to make space for more work,
 		// but if there's an error, latch it
 		// so we don't send any further txns
-		if ((dc->qerror = _dc_q_exec(dc)) != DC_OK) {
+		if ((dc->qerror = dc_q_flush(dc)) != DC_OK) {
 			return;
 		}
 	}
-	dc->txnext[0] = req;
+	if ((req & (XFER_RD | XFER_ValueMatch)) == (XFER_RD | XFER_ValueMatch)) {
+		dc->txmatch = 1;
+	}
+	dc->txnext[0] = req | (ts ? XFER_TimeStamp : 0);
 	memcpy(dc->txnext + 1, &val, 4);
 	dc->txnext += 5;
 	dc->txavail -= 5;
 	dc->txbuf[2] += 1;
+	if (ts) {
+		dc_q_rx_word(dc, ts);
+	}
+}
+
+static void dc_q_raw_wr(DC* dc, unsigned req, uint32_t val) {
+	dc_q_raw_wr_ts(dc, req, val, NULL);
 }
 
 // adjust DP.SELECT for desired DP access, if necessary
@@ -334,7 +674,7 @@ void dc_q_ap_sel(DC* dc, uint32_t apaddr) {
 	// we always return DPBANK to 0 when adjusting AP & APBANK
 	// since it preceeds an AP write which will need DPBANK at 0
 	uint32_t select =
-		DP_SELECT_AP((apaddr & 0xFF00U) << 16) |
+		DP_SELECT_AP(apaddr >> 8) |
 		DP_SELECT_APBANK(apaddr >> 4);
 	if (select != dc->dp_select_cache) {
 		dc->dp_select_cache = select;
@@ -346,48 +686,123 @@ void dc_q_ap_sel(DC* dc, uint32_t apaddr) {
 // DP.SELECT will be adjusted as necessary to ensure proper addressing
 void dc_q_dp_rd(DC* dc, unsigned dpaddr, uint32_t* val) {
 	if (dc->qerror) return;
+	dc_q_barrier(dc);
 	dc_q_dp_sel(dc, dpaddr);
 	dc_q_raw_rd(dc, XFER_DP | XFER_RD | (dpaddr & 0x0C), val);
 }
 
 void dc_q_dp_wr(DC* dc, unsigned dpaddr, uint32_t val) {
 	if (dc->qerror) return;
+	dc_q_barrier(dc);
 	dc_q_dp_sel(dc, dpaddr);
 	dc_q_raw_wr(dc, XFER_DP | XFER_WR | (dpaddr & 0x0C), val);
 }
 
 void dc_q_ap_rd(DC* dc, unsigned apaddr, uint32_t* val) {
 	if (dc->qerror) return;
+	if (dc->qregion && (dc_q_opt_add(dc, QOP_AP_RD, apaddr, 0, val) == 0)) return;
 	dc_q_ap_sel(dc, apaddr);
 	dc_q_raw_rd(dc, XFER_AP | XFER_RD | (apaddr & 0x0C), val);
 }
 
 void dc_q_ap_wr(DC* dc, unsigned apaddr, uint32_t val) {
 	if (dc->qerror) return;
+	if (dc->qregion && (dc_q_opt_add(dc, QOP_AP_WR, apaddr, val, NULL) == 0)) return;
 	dc_q_ap_sel(dc, apaddr);
 	dc_q_raw_wr(dc, XFER_AP | XFER_WR | (apaddr & 0x0C), val);
 }
 
-void dc_q_set_mask(DC* dc, uint32_t mask) {
+static int dc_q_check_timer(DC* dc) {
+	if (dc->timer_hz == 0) {
+		ERROR("probe has no timestamp timer\n");
+		dc->qerror = DC_ERR_UNSUPPORTED;
+		return -1;
+	}
+	return 0;
+}
+
+void dc_q_ap_rd_ts(DC* dc, unsigned apaddr, uint32_t* val, uint32_t* ts) {
+	if (dc->qerror) return;
+	if (dc_q_check_timer(dc)) return;
+	dc_q_barrier(dc);
+	dc_q_ap_sel(dc, apaddr);
+	dc_q_raw_rd_ts(dc, XFER_AP | XFER_RD | (apaddr & 0x0C), val, ts);
+}
+
+void dc_q_ap_wr_ts(DC* dc, unsigned apaddr, uint32_t val, uint32_t* ts) {
 	if (dc->qerror) return;
+	if (dc_q_check_timer(dc)) return;
+	dc_q_barrier(dc);
+	dc_q_ap_sel(dc, apaddr);
+	dc_q_raw_wr_ts(dc, XFER_AP | XFER_WR | (apaddr & 0x0C), val, ts);
+}
+
+uint32_t dc_get_timer_freq(DC* dc) {
+	return dc->timer_hz;
+}
+
+double dc_ticks_to_sec(DC* dc, uint32_t ticks) {
+	if (dc->timer_hz == 0) {
+		return 0.0;
+	}
+	return ((double) ticks) / ((double) dc->timer_hz);
+}
+
+static void dc_q_raw_mask(DC* dc, uint32_t mask) {
 	if (dc->cfg_mask == mask) return;
 	dc->cfg_mask = mask;
 	dc_q_raw_wr(dc, XFER_WR | XFER_MatchMask, mask);
 }
 
-void dc_set_match_retry(dctx_t* dc, unsigned num) {
+void dc_q_set_mask(DC* dc, uint32_t mask) {
 	if (dc->qerror) return;
+	dc->qmask = mask;
+	if (dc->qregion == DC_Q_RELAXED) {
+		// applied per collected match
+		return;
+	}
+	dc_q_raw_mask(dc, mask);
+}
+
+// a match that goes out as queued needs the mask as last set
+static void dc_q_match_barrier(DC* dc) {
+	if (dc->qregion == DC_Q_RELAXED) {
+		dc_q_opt_flush(dc);
+		if (dc->qmask != INVALID) {
+			dc_q_raw_mask(dc, dc->qmask);
+		}
+	}
+}
+
+int dc_set_xfer_config(DC* dc, unsigned idle, unsigned wait) {
+	return dap_xfer_config(dc, idle, wait, dc->cfg_match);
+}
+
+void dc_set_wrap_size(DC* dc, uint32_t size) {
+	if ((size < 0x400) || (size & (size - 1))) {
+		ERROR("invalid wrap size 0x%x\n", size);
+		return;
+	}
+	dc->map_wrap_size = size;
+}
+
+unsigned dc_set_match_retry(dctx_t* dc, unsigned num) {
+	unsigned old = dc->cfg_match;
+	if (dc->qerror) return old;
 	dap_xfer_config(dc, dc->cfg_idle, dc->cfg_wait, num);
+	return old;
 }
 
 void dc_q_ap_match(DC* dc, unsigned apaddr, uint32_t val) {
 	if (dc->qerror) return;
+	dc_q_match_barrier(dc);
 	dc_q_ap_sel(dc, apaddr);
 	dc_q_raw_wr(dc, XFER_AP | XFER_RD | XFER_ValueMatch | (apaddr & 0x0C), val);
 }
 
 void dc_q_dp_match(DC* dc, unsigned apaddr, uint32_t val) {
 	if (dc->qerror) return;
+	dc_q_match_barrier(dc);
 	dc_q_ap_sel(dc, apaddr);
 	dc_q_raw_wr(dc, XFER_DP | XFER_RD | XFER_ValueMatch | (apaddr & 0x0C), val);
 }
@@ -473,49 +888,186 @@ static int _dc_attach(DC* dc, unsigned flags, uint32_t tgt, uint32_t* idcode) {
 	return r;
 }
 
-int dc_attach(DC* dc, unsigned flags, unsigned tgt, uint32_t* idcode) {
+// line reset, identify the DP, and switch to multidrop if needed
+static int dc_attach_dp(DC* dc, unsigned flags, uint32_t tgt, uint32_t* idcode) {
 	uint32_t n;
+	int r;
 
-	_dc_attach(dc, 0, 0, &n);
+	if ((r = _dc_attach(dc, flags & DC_MULTIDROP, tgt, &n)) < 0) {
+		return r;
+	}
 	INFO("attach: IDCODE %08x\n", n);
 
 	// If this is a RP2040, we need to connect in multidrop
 	// mode before doing anything else.
-	if ((n == 0x0bc12477) && (tgt == 0)) {
-		dc_dp_rd(dc, DP_TARGETID, &n);
-		if (n == 0x01002927) { // RP2040
-			_dc_attach(dc, DC_MULTIDROP, 0x01002927, &n);
+	if ((n == 0x0bc12477) && !(flags & DC_MULTIDROP)) {
+		uint32_t id = 0;
+		dc_dp_rd(dc, DP_TARGETID, &id);
+		if (id == 0x01002927) { // RP2040
+			if ((r = _dc_attach(dc, DC_MULTIDROP, id, &n)) < 0) {
+				return r;
+			}
 		}
 	}
+	*idcode = n;
 
 	dc_dp_rd(dc, DP_CS, &n);
 	DEBUG("attach: CTRL/STAT   %08x\n", n);
+	return 0;
+}
 
-	// clear all sticky errors
-	dc_dp_wr(dc, DP_ABORT, DP_ABORT_ALLCLR);
-
-	// power up and wait for ack
-	dc_q_init(dc);
+// clear sticky errors, power up the debug and system domains,
+// and wait for the acks, all in one batch
+static void dc_q_power_up(DC* dc) {
+	dc_q_dp_wr(dc, DP_ABORT, DP_ABORT_ALLCLR);
 	dc_q_set_mask(dc, DP_CS_CDBGPWRUPACK | DP_CS_CSYSPWRUPACK);
 	dc_q_dp_wr(dc, DP_CS, DP_CS_CDBGPWRUPREQ | DP_CS_CSYSPWRUPREQ);
 	dc_q_dp_match(dc, DP_CS, DP_CS_CDBGPWRUPACK | DP_CS_CSYSPWRUPACK);
+}
+
+static int dc_attach_normal(DC* dc, unsigned flags, uint32_t tgt, uint32_t* idcode) {
+	uint32_t n;
+	int r;
+
+	if ((r = dc_attach_dp(dc, flags, tgt, idcode)) < 0) {
+		return r;
+	}
+
+	dc_q_init(dc);
+	dc_q_power_up(dc);
 	dc_q_dp_rd(dc, DP_CS, &n);
 	dc_q_ap_rd(dc, MAP_CSW, &dc->map_csw_keep);
-	dc_q_exec(dc);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
 	DEBUG("attach: CTRL/STAT   %08x\n", n);
 	DEBUG("attach: MAP.CSW     %08x\n", dc->map_csw_keep);
 
 	dc->map_csw_keep &= MAP_CSW_KEEP;
+	return 0;
+}
+
+// Attach while holding nRESET low, so that a target which has
+// gated its debug clocks (deep sleep) or locked up is brought
+// back to a known state.  Power-up and halt requests are queued
+// before nRESET is released so the core halts at the reset vector
+// before running any firmware.  The attach is retried with
+// exponential backoff while reset is still held.
+#define UNDER_RESET_TRIES 6
+
+static int dc_attach_under_reset(DC* dc, unsigned flags, uint32_t tgt, uint32_t* idcode) {
+	unsigned delay = 1000;
+	uint32_t n;
+	int r;
+
+	if ((r = dap_swj_pins(dc, 0, PIN_nRESET, 0)) < 0) {
+		return r;
+	}
+	for (unsigned tries = 0; tries < UNDER_RESET_TRIES; tries++) {
+		if (tries) {
+			dap_delay(dc, delay);
+			delay *= 2;
+		}
+		if ((r = dc_attach_dp(dc, flags, tgt, idcode)) < 0) {
+			continue;
+		}
+		dc_q_init(dc);
+		dc_q_power_up(dc);
+		dc_q_ap_rd(dc, MAP_CSW, &dc->map_csw_keep);
+		if ((r = dc_q_exec(dc)) < 0) {
+			continue;
+		}
+		dc->map_csw_keep &= MAP_CSW_KEEP;
+
+		// request halt and catch the reset vector
+		dc_q_init(dc);
+		dc_q_mem_wr32(dc, DHCSR, DHCSR_DBGKEY | DHCSR_C_HALT | DHCSR_C_DEBUGEN);
+		dc_q_mem_wr32(dc, DEMCR, DEMCR_VC_CORERESET | DEMCR_TRCENA);
+		if ((r = dc_q_exec(dc)) == 0) {
+			break;
+		}
+	}
+
+	// release nRESET, wait 10ms for it to rise
+	int rr = dap_swj_pins(dc, PIN_nRESET, PIN_nRESET, 10000);
+	if (r < 0) {
+		return r;
+	}
+	if (rr < 0) {
+		return rr;
+	}
+
+	// some parts ignore debug writes while in reset, so halt
+	// now if the core escaped, then drop the vector catch
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, DHCSR, &n);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	dc_q_init(dc);
+	if (!(n & DHCSR_S_HALT)) {
+		INFO("attach: core not halted at reset, halting\n");
+		dc_q_mem_wr32(dc, DHCSR, DHCSR_DBGKEY | DHCSR_C_HALT | DHCSR_C_DEBUGEN);
+	}
+	dc_q_mem_wr32(dc, DEMCR, DEMCR_TRCENA);
+	return dc_q_exec(dc);
+}
+
+int dc_attach(DC* dc, unsigned flags, unsigned tgt, uint32_t* idcode) {
+	int r;
+	if (flags & DC_UNDER_RESET) {
+		r = dc_attach_under_reset(dc, flags, tgt, idcode);
+	} else {
+		r = dc_attach_normal(dc, flags, tgt, idcode);
+	}
+	if (r < 0) {
+		ERROR("attach: failed (%d)\n", r);
+		if (dc->status != DC_OFFLINE) {
+			dc_set_status(dc, DC_DETACHED);
+		}
+		return r;
+	}
 
+	dc->recovering = 0;
+	dc->recover_delay = 0;
+	dc->lockup_seen = 0;
 	dc_set_status(dc, DC_ATTACHED);
 
 	return 0;
 }
 
+void dc_set_recovery(DC* dc, unsigned strategy) {
+	dc->recovery = strategy;
+}
+
+// try to get an unresponsive target back, backing off
+// exponentially (up to ~3s) between failed attempts
+#define RECOVER_DELAY_MIN 100
+#define RECOVER_DELAY_MAX 3200
+
+static int dc_recover(DC* dc) {
+	uint32_t n;
+	unsigned flags = 0;
+	if (dc->recovery == DC_RECOVER_RESET) {
+		flags = DC_UNDER_RESET;
+	}
+	if (dc_attach(dc, flags, 0, &n) == 0) {
+		INFO("recovered%s\n", (flags & DC_UNDER_RESET) ? " (under reset)" : "");
+		return 100;
+	}
+	dc->recovering = 1;
+	if (dc->recover_delay < RECOVER_DELAY_MIN) {
+		dc->recover_delay = RECOVER_DELAY_MIN;
+	} else if (dc->recover_delay < RECOVER_DELAY_MAX) {
+		dc->recover_delay *= 2;
+	}
+	return dc->recover_delay;
+}
 
 static unsigned dc_vid = 0;
 static unsigned dc_pid = 0;
 static const char* dc_serialno = NULL;
+static const char* dc_remote = NULL;
 
 void dc_require_vid_pid(unsigned vid, unsigned pid) {
 	dc_vid = vid;
@@ -526,7 +1078,14 @@ void dc_require_serialno(const char* sn) {
 	dc_serialno = sn;
 }
 
+void dc_require_remote(const char* hostport) {
+	dc_remote = hostport;
+}
+
 static usb_handle* usb_connect(void) {
+	if (dc_remote) {
+		return usb_open_remote(dc_remote);
+	}
 	return usb_open(dc_vid, dc_pid, dc_serialno);
 }
 
@@ -545,6 +1104,69 @@ static const char* di_name(unsigned n) {
 	}
 }
 
+int dc_uart_enable(DC* dc, uint32_t baud, uint32_t* actual) {
+	uint8_t io[6];
+	int r;
+	if (!dc->uart_supported) {
+		return DC_ERR_UNSUPPORTED;
+	}
+	io[0] = DAP_UART_Transport;
+	io[1] = UART_TRANSPORT_DAP;
+	if ((r = dap_cmd_std(dc, "dap_uart_transport()", io, 2, 2)) < 0) {
+		return r;
+	}
+	io[0] = DAP_UART_Configure;
+	io[1] = UART_CFG_8N1;
+	io[2] = baud;
+	io[3] = baud >> 8;
+	io[4] = baud >> 16;
+	io[5] = baud >> 24;
+	if ((r = dap_cmd_std(dc, "dap_uart_configure()", io, 6, 6)) < 0) {
+		return r;
+	}
+	if (actual) {
+		*actual = io[2] | (io[3] << 8) | (io[4] << 16) | (io[5] << 24);
+	}
+	io[0] = DAP_UART_Control;
+	io[1] = UART_CTL_RX_ENABLE | UART_CTL_RX_FLUSH |
+		UART_CTL_TX_ENABLE | UART_CTL_TX_FLUSH;
+	if ((r = dap_cmd_std(dc, "dap_uart_control()", io, 2, 2)) < 0) {
+		return r;
+	}
+	dc->uart_baud = baud;
+	dc->uart_on = 1;
+	dc->uart_txlen = 0;
+	dc->uart_next = 0;
+	return 0;
+}
+
+int dc_uart_disable(DC* dc) {
+	uint8_t io[2];
+	dc->uart_baud = 0;
+	if (!dc->uart_on) {
+		return 0;
+	}
+	dc->uart_on = 0;
+	io[0] = DAP_UART_Control;
+	io[1] = UART_CTL_RX_DISABLE | UART_CTL_TX_DISABLE;
+	return dap_cmd_std(dc, "dap_uart_control()", io, 2, 2);
+}
+
+void dc_uart_set_callback(DC* dc, void (*cb)(void* cookie, const void* data, unsigned len),
+			void* cookie) {
+	dc->uart_callback = cb;
+	dc->uart_cookie = cookie;
+}
+
+unsigned dc_uart_write(DC* dc, const void* data, unsigned len) {
+	if (len > (UART_TX_FIFO - dc->uart_txlen)) {
+		len = UART_TX_FIFO - dc->uart_txlen;
+	}
+	memcpy(dc->uart_tx + dc->uart_txlen, data, len);
+	dc->uart_txlen += len;
+	return len;
+}
+
 // setup a newly connected DAP device
 static int dap_configure(DC* dc) {
 	uint8_t buf[256 + 2];
@@ -566,9 +1188,6 @@ static int dap_configure(DC* dc) {
 	dc->max_packet_count = 1;
 	dc->max_packet_size = 64;
 
-	// flush queue
-	dc_q_clear(dc);
-
 	buf[0] = DAP_Info;
 	for (unsigned n = 0; n < 10; n++) {
 		int sz = dap_get_info(dc, n, buf, 0, 255);
@@ -592,6 +1211,14 @@ static int dap_configure(DC* dc) {
 		if (buf[1] & I1_USB_COM_Port) INFO(" USBCOM");
 		INFO("\n");
 	}
+	dc->timer_hz = 0;
+	if ((buf[0] & I0_Test_Domain_Timer) &&
+		(dap_get_info(dc, DI_Test_Domain_Timer, &n32, 4, 4) == 4)) {
+		dc->timer_hz = n32;
+		INFO("connect: Timestamp Timer: %u Hz\n", n32);
+	}
+	dc->uart_supported = (buf[0] & I0_UART_Comm_Port) ? 1 : 0;
+	dc->uart_on = 0;
 	if (dap_get_info(dc, DI_UART_RX_Buffer_Size, &n32, 4, 4) == 4) {
 		INFO("connect: UART RX Buffer Size: %u\n", n32);
 	}
@@ -607,24 +1234,34 @@ static int dap_configure(DC* dc) {
 	if (dap_get_info(dc, DI_Max_Packet_Size, &n16, 2, 2) == 2) {
 		dc->max_packet_size = n16;
 	}
+	// v1 (HID) probes move one fixed size report per packet,
+	// whatever they claim, and queue max_packet_count of them
+	if ((n32 = usb_report_size(dc->usb)) && (dc->max_packet_size > n32)) {
+		dc->max_packet_size = n32;
+	}
 	INFO("connect: Max Packet Count: %u, Size: %u\n",
 		dc->max_packet_count, dc->max_packet_size);
 	if ((dc->max_packet_count < 1) || (dc->max_packet_size < 64)) {
 		ERROR("dc_init() impossible packet configuration\n");
+		dc_q_free(dc);
 		return DC_ERR_PROTOCOL;
 	}
 
-	// invalidate register cache
-	dc->dp_select_cache = INVALID;
-
-	// clip to our buffer size
-	if (dc->max_packet_size > 1024) {
-		dc->max_packet_size = 1024;
+	// size the queue for this probe and flush it
+	if (dc_q_alloc(dc) < 0) {
+		ERROR("dc_init() cannot allocate queue\n");
+		return DC_ERR_FAILED;
 	}
+	dc_q_clear(dc);
 
 	dap_connect(dc);
 	dap_swd_configure(dc, CFG_Turnaround_1);
 	dap_xfer_config(dc, 8, 64, 64);
+
+	// the probe forgot its uart setup if it went away
+	if (dc->uart_baud) {
+		dc_uart_enable(dc, dc->uart_baud, NULL);
+	}
 	return DC_OK;
 }
 
@@ -648,6 +1285,8 @@ int dc_create(DC** out, void (*cb)(void *cookie, uint32_t status), void *cookie)
 	}
 	dc->status_callback = cb;
 	dc->status_cookie = cookie;
+	dc->recovery = DC_RECOVER_NONE;
+	dc->map_wrap_size = 0x400;
 	*out = dc;
 	dc_set_status(dc, DC_OFFLINE);
 	dc_connect(dc);
@@ -655,6 +1294,9 @@ int dc_create(DC** out, void (*cb)(void *cookie, uint32_t status), void *cookie)
 }
 
 int dc_periodic(DC* dc) {
+	if (dc->uart_on && (dc->status != DC_OFFLINE)) {
+		dap_uart_poll(dc);
+	}
 	switch (dc->status) {
 	case DC_OFFLINE:
 		if (dc_connect(dc) < 0) {
@@ -663,20 +1305,54 @@ int dc_periodic(DC* dc) {
 			return 100;
 		}
 	case DC_ATTACHED: {
-		uint32_t n;
-		int r = dc_dp_rd(dc, DP_CS, &n);
+		// DP CTRL/STAT only: reading DHCSR here would clear its
+		// sticky S_RESET_ST/S_RETIRE_ST bits under other commands
+		uint32_t cs, dhcsr = 0;
+		dc_q_init(dc);
+		dc_q_dp_rd(dc, DP_CS, &cs);
+		if (dc->recovery == DC_RECOVER_RESET) {
+			// opted in to resets: lockup is worth watching for
+			dc_q_mem_rd32(dc, DHCSR, &dhcsr);
+		}
+		int r = dc_q_exec(dc);
 		if (r == DC_ERR_IO) {
 			dc_set_status(dc, DC_OFFLINE);
 			ERROR("offline\n");
-		} else if (r < 0) {
+			return 100;
+		}
+		if ((r == 0) && !(cs & DP_CS_CDBGPWRUPACK)) {
+			// debug domain was powered down under us
+			// (target asleep), ask for it back
+			dc_q_init(dc);
+			dc_q_power_up(dc);
+			r = dc_q_exec(dc);
+		}
+		if (r < 0) {
 			dc_set_status(dc, DC_DETACHED);
 			ERROR("detached\n");
+			if (dc->recovery != DC_RECOVER_NONE) {
+				dc->recovering = 1;
+				return dc_recover(dc);
+			}
+			return 100;
+		}
+		if (dhcsr & DHCSR_S_LOCKUP) {
+			if (!dc->lockup_seen) {
+				ERROR("target locked up, resetting\n");
+				dc->lockup_seen = 1;
+			}
+			return dc_recover(dc);
+		} else {
+			dc->lockup_seen = 0;
 		}
 		return 100;
 	}
 	case DC_FAILURE:
 	case DC_UNCONFIG:
 	case DC_DETACHED: {
+		if (dc->recovering) {
+			return dc_recover(dc);
+		}
 		// ping the probe to see if USB is still connected
 		uint8_t buf[256 + 2];
 		dap_get_info(dc, DI_Protocol_Version, buf, 0, 255);
@@ -9,6 +9,45 @@
 
 #include "usb.h"
 
+// a run of response words landing contiguously in the caller's memory
+typedef struct rxrun {
+	uint32_t* ptr;
+	uint32_t count;
+} rxrun_t;
+
+// a DAP_Transfer packet in the current batch
+typedef struct txpkt {
+	uint8_t* tx;
+	uint32_t txlen;
+	rxrun_t* run;     // first response run
+	rxrun_t* end;     // one past the last response run
+	uint32_t rxcount; // response words
+	uint32_t match;   // holds a value match (see _dc_q_exec())
+} txpkt_t;
+
+// an access collected in a relaxed queue region (see dc_q_region())
+typedef struct qop {
+	uint32_t kind;  // QOP_*
+	uint32_t addr;  // AP register (AP:8 BANK:4 REG:4) or memory address
+	uint32_t val;   // write or match value
+	uint32_t mask;  // match mask
+	uint32_t* ptr;  // read destination
+	uint32_t seq;   // queue order, which sorting must keep
+} qop_t;
+
+#define QOP_AP_RD	0
+#define QOP_AP_WR	1
+#define QOP_MEM_RD	2
+#define QOP_MEM_WR	3
+#define QOP_MEM_MATCH	4
+
+// collected accesses are encoded at the latest when this many
+// have piled up
+#define QOP_MAX 4096
+
+// host side buffer for data on its way to the probe uart
+#define UART_TX_FIFO 1024
+
 struct debug_context {
 	usb_handle* usb;
 	unsigned status;
@@ -20,6 +59,11 @@ struct debug_context {
 	// dap protocol info
 	uint32_t max_packet_count;
 	uint32_t max_packet_size;
+	uint32_t timer_hz; // 0 if no timestamp support
+
+	// FPB (see dc_fpb_enable())
+	uint32_t fpb_rev;
+	uint32_t fpb_count;
 
 	// dap internal state cache
 	uint32_t cfg_idle;
@@ -32,25 +76,67 @@ struct debug_context {
 	// last known state of DP.SELECT on the target
 	uint32_t dp_select_cache;
 
+	// attach/recovery state
+	uint32_t recovery;
+	uint32_t recover_delay;
+	int recovering;
+	int lockup_seen;
+
 	// MAP cached state
+	uint32_t map_wrap_size;
 	uint32_t map_csw_keep;
 	uint32_t map_csw_cache;
 	uint32_t map_tar_cache;
 
-	// transfer queue state
-	uint8_t txbuf[1024];
-	uint32_t* rxptr[256];
+	// transfer queue state, carved out of one arena sized from
+	// the probe's packet size and count at configure time, so a
+	// batch can hold up to max_packet_count packets in flight
+	uint8_t* arena;
+	uint32_t arena_size;
+	txpkt_t* pkt;      // packets in the current batch
+	uint32_t pktcount; // packets in use, including the current one
+	uint8_t* rxbuf;    // response buffer (one packet)
+	uint8_t* txbuf;    // current packet
+	rxrun_t* rxrun;    // first response run of current packet
 	uint8_t *txnext;
-	uint32_t** rxnext;
+	rxrun_t* rxnext;
+	uint32_t rxcount;
+	uint32_t txmatch;
+	int qpoll; // see dc_q_poll()
 	uint32_t txavail;
 	uint32_t rxavail;
 	int qerror;
+
+	// relaxed region state: accesses waiting for dc_q_opt_flush()
+	// and the match mask as the caller last set it
+	unsigned qregion;
+	qop_t* qop;
+	uint32_t qopcount;
+	uint32_t qopmax;
+	uint32_t qmask;
+
+	// probe uart bridge (DAP_UART_*)
+	int uart_supported;
+	uint32_t uart_baud; // requested rate, 0 = off
+	int uart_on;
+	uint64_t uart_next; // when the next piggybacked poll is due (us)
+	uint8_t uart_tx[UART_TX_FIFO];
+	uint32_t uart_txlen;
+	void (*uart_callback)(void* cookie, const void* data, unsigned len);
+	void* uart_cookie;
 };
 
 typedef struct debug_context DC;
 
 #define INVALID 0xFFFFFFFFU
 
+// relaxed queue regions (transport-arm-debug.c)
+// collect an access, returning < 0 if it must go out as queued
+// (after everything collected so far)
+int dc_q_opt_add(DC* dc, unsigned kind, uint32_t addr, uint32_t val, uint32_t* ptr);
+// rewrite and encode the collected accesses
+void dc_q_opt_flush(DC* dc);
+
 
 #if 0
 static void dump(const char* str, const void* ptr, unsigned len) {
@@ -66,5 +152,4 @@ static void dump(const char* str, const void* ptr, unsigned len) {
 #define dump(...) do {} while (0)
 #endif
 
-uint32_t dc_get_attn_value(DC* dc);
 
@@ -9,11 +9,18 @@
 void dc_require_vid_pid(unsigned vid, unsigned pid);
 void dc_require_serialno(const char* sn);
 
+// use a probe served by xdebug-server instead of a local one
+void dc_require_remote(const char* hostport);
+
 typedef struct debug_context dctx_t;
 int dc_periodic(dctx_t* dc);
 
 void dc_interrupt(dctx_t* dc);
 
+// changes on every dc_interrupt(), so long running operations
+// can notice a cancellation request
+uint32_t dc_get_attn_value(dctx_t* dc);
+
 #define DC_OK               0
 #define DC_ERR_FAILED      -1  // generic internal failure
 #define DC_ERR_BAD_PARAMS  -2  // Invalid parameters
@@ -34,6 +41,26 @@ void dc_interrupt(dctx_t* dc);
 
 int dc_set_clock(dctx_t* dc, uint32_t hz);
 
+// Probe UART bridge (CMSIS-DAP DAP_UART_*, 8N1).  Once enabled it
+// is polled in the background, alongside queued transfers and from
+// dc_periodic().  The callback gets each poll's rx data (len may be
+// 0) on the thread driving the transport, and must not issue
+// transport operations other than dc_uart_write(), which queues tx
+// and returns how many bytes fit.
+int dc_uart_enable(dctx_t* dc, uint32_t baud, uint32_t* actual);
+int dc_uart_disable(dctx_t* dc);
+void dc_uart_set_callback(dctx_t* dc,
+	void (*cb)(void* cookie, const void* data, unsigned len), void* cookie);
+unsigned dc_uart_write(dctx_t* dc, const void* data, unsigned len);
+
+// set idle cycles after each transfer and the max retries
+// after a WAIT response
+int dc_set_xfer_config(dctx_t* dc, unsigned idle, unsigned wait);
+
+// set the MEM-AP TAR auto-increment wrap size for block transfers
+// (power of two, at least 0x400, which all MEM-APs support)
+void dc_set_wrap_size(dctx_t* dc, uint32_t size);
+
 // queue Debug Port reads and writes
 // DP.SELECT will be updated as necessary
 void dc_q_dp_rd(dctx_t* dc, unsigned dpaddr, uint32_t* val);
@@ -44,8 +71,21 @@ void dc_q_dp_wr(dctx_t* dc, unsigned dpaddr, uint32_t val);
 void dc_q_ap_rd(dctx_t* dc, unsigned apaddr, uint32_t* val); 
 void dc_q_ap_wr(dctx_t* dc, unsigned apaddr, uint32_t val);
 
-// set the max retry count for match operations
-void dc_set_match_retry(dctx_t* dc, unsigned num);
+// as above, but also capture the probe's timestamp for the
+// transfer into *ts (fails with DC_ERR_UNSUPPORTED on probes
+// without a test domain timer)
+void dc_q_ap_rd_ts(dctx_t* dc, unsigned apaddr, uint32_t* val, uint32_t* ts);
+void dc_q_ap_wr_ts(dctx_t* dc, unsigned apaddr, uint32_t val, uint32_t* ts);
+
+// probe timestamp timer frequency in Hz, 0 if unsupported
+uint32_t dc_get_timer_freq(dctx_t* dc);
+
+// convert a (wrapping, 32bit) difference of probe timestamps
+// to seconds
+double dc_ticks_to_sec(dctx_t* dc, uint32_t ticks);
+
+// set the max retry count for match operations, returns the old count
+unsigned dc_set_match_retry(dctx_t* dc, unsigned num);
 
 // set the mask pattern (in the probe, not the target)
 void dc_q_set_mask(dctx_t* dc, uint32_t mask);
@@ -60,6 +100,28 @@ void dc_q_init(dctx_t* dc);
 // execute any outstanding transactions, return final status
 int dc_q_exec(dctx_t* dc);
 
+// mark the batch being queued as a poll: a match failure is the
+// expected outcome until the condition holds, and is returned as
+// DC_ERR_MATCH without being logged (until the next dc_q_init())
+void dc_q_poll(dctx_t* dc);
+
+// Queue regions.  In an ordered region (the default, and what
+// dc_q_init() and dc_q_exec() return to) accesses go out exactly
+// as queued.  In a relaxed region the caller promises that memory
+// and AP register accesses are independent and free of side
+// effects, so they are collected and rewritten before encoding:
+// grouped by AP and bank to save DP.SELECT writes, sorted by address
+// so neighbouring words share a TAR write and auto-increment, with
+// repeated writes to a location reduced to the last one and match
+// masks set once per distinct mask.  Accesses to the same location
+// keep their order.  DP, timestamped, and MEM-AP register accesses
+// are never moved: they go out after everything collected so far.
+#define DC_Q_ORDERED 0
+#define DC_Q_RELAXED 1
+
+// switch region type, returns the previous one
+unsigned dc_q_region(dctx_t* dc, unsigned type);
+
 // convenince wrappers for a single read/write and then exec
 int dc_dp_rd(dctx_t* dc, unsigned dpaddr, uint32_t* val);
 int dc_dp_wr(dctx_t* dc, unsigned dpaddr, uint32_t val);
@@ -78,19 +140,34 @@ int dc_create(dctx_t** dc, void (*cb)(void *cookie, uint32_t status), void *cook
 
 // attempt to attach to the debug target
 int dc_attach(dctx_t* dc, unsigned flags, uint32_t tgt, uint32_t* idcode);
-#define DC_MULTIDROP 1
+#define DC_MULTIDROP   1
+#define DC_UNDER_RESET 2 // hold nRESET while attaching, halt at reset vector
+
+// what dc_periodic() does when an attached target stops responding
+// (debug clocks gated by sleep, core in lockup, etc)
+#define DC_RECOVER_NONE   0 // stay detached until the next dc_attach()
+#define DC_RECOVER_ATTACH 1 // retry the normal attach sequence
+#define DC_RECOVER_RESET  2 // retry attach under reset (core left halted)
+void dc_set_recovery(dctx_t* dc, unsigned strategy);
 
 
 void dc_q_mem_rd32(dctx_t* dc, uint32_t addr, uint32_t* val);
 void dc_q_mem_wr32(dctx_t* dc, uint32_t addr, uint32_t val);
 void dc_q_mem_match32(dctx_t* dc, uint32_t addr, uint32_t val);
 
+// with probe-side capture timestamps
+void dc_q_mem_rd32_ts(dctx_t* dc, uint32_t addr, uint32_t* val, uint32_t* ts);
+void dc_q_mem_wr32_ts(dctx_t* dc, uint32_t addr, uint32_t val, uint32_t* ts);
+
 int dc_mem_rd32(dctx_t* dc, uint32_t addr, uint32_t* val);
 int dc_mem_wr32(dctx_t* dc, uint32_t addr, uint32_t val);
 
 int dc_mem_rd_words(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr);
 int dc_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr);
 
+// queue a block write using TAR auto-increment
+void dc_q_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr);
+
 
 
 int dc_core_halt(dctx_t* dc);
@@ -98,6 +175,20 @@ int dc_core_resume(dctx_t* dc);
 int dc_core_step(dctx_t* dc);
 int dc_core_wait_halt(dctx_t* dc);
 
+// Flash Patch and Breakpoint unit: enable it and return the number
+// of instruction address comparators (0 if the core has none)
+int dc_fpb_enable(dctx_t* dc);
+
+// queue pointing comparator n at a (halfword aligned) instruction,
+// or disabling it (DC_FPB_OFF) -- v1 units (v6M/v7M) only cover the
+// code region (below 0x20000000), others fail with DC_ERR_BAD_PARAMS
+#define DC_FPB_OFF 0xFFFFFFFFU
+void dc_q_fpb_set(dctx_t* dc, unsigned n, uint32_t addr);
+
+// queue core register accesses (core must be halted)
+void dc_q_core_reg_rd(dctx_t* dc, unsigned id, uint32_t* val);
+void dc_q_core_reg_wr(dctx_t* dc, unsigned id, uint32_t val);
+
 int dc_core_reg_rd(dctx_t* dc, unsigned id, uint32_t* val);
 int dc_core_reg_wr(dctx_t* dc, unsigned id, uint32_t val);
 
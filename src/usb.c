@@ -10,13 +10,20 @@
 #include <libusb-1.0/libusb.h>
 
 #include "usb.h"
+#include "remote.h"
 
 struct usb_handle {
 	libusb_device_handle *dev;
 	unsigned ei;
 	unsigned eo;
+	unsigned ino;
+	unsigned report; // nonzero: a HID probe with fixed size reports
+	int fd; // >= 0: a remote probe (see remote.h)
 };
 
+// largest (high speed) interrupt endpoint payload
+#define HID_REPORT_MAX 1024
+
 int get_sysfs_path(libusb_device* dev, char* path, int max) {
 	if (max < 0) return -1;
 	uint8_t num[8];
@@ -81,9 +88,47 @@ match:
 	return 0;
 }
 
+// CMSIS-DAP v1 probes are HID devices: an interrupt IN endpoint and
+// usually an interrupt OUT endpoint (without one, reports go out as
+// SET_REPORT control transfers), moving fixed size reports
+int get_hid_ifc(struct libusb_config_descriptor *cd, uint8_t *ino,
+		uint8_t *eptin, uint8_t *eptout, unsigned *report) {
+	const struct libusb_interface_descriptor *id;
+	for (unsigned i = 0; i < cd->bNumInterfaces; i++) {
+		if (cd->interface[i].num_altsetting != 1) {
+			continue;
+		}
+		id = &cd->interface[i].altsetting[0];
+		if (id->bInterfaceClass != LIBUSB_CLASS_HID) {
+			continue;
+		}
+		*eptin = 0;
+		*eptout = 0;
+		for (unsigned n = 0; n < id->bNumEndpoints; n++) {
+			const struct libusb_endpoint_descriptor *e = id->endpoint + n;
+			if ((e->bmAttributes & 3) != LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT) {
+				continue;
+			}
+			if (e->bEndpointAddress & 0x80) {
+				*eptin = e->bEndpointAddress;
+				*report = e->wMaxPacketSize & 0x7FF;
+			} else {
+				*eptout = e->bEndpointAddress;
+			}
+		}
+		if ((*eptin == 0) || (*report == 0) || (*report > HID_REPORT_MAX)) {
+			continue;
+		}
+		*ino = id->bInterfaceNumber;
+		return 0;
+	}
+	return -1;
+}
+
 usb_handle *usb_try_open(libusb_device* dev, const char* sn,
 			unsigned isn, unsigned iifc,
-			unsigned ino, unsigned ei, unsigned eo) {
+			unsigned ino, unsigned ei, unsigned eo,
+			unsigned report) {
 	unsigned char text[256];
 	usb_handle *usb;
 	int r;
@@ -123,6 +168,14 @@ usb_handle *usb_try_open(libusb_device* dev, const char* sn,
 
 	usb->ei = ei;
 	usb->eo = eo;
+	usb->ino = ino;
+	usb->report = report;
+	usb->fd = -1;
+
+	if (report) {
+		// unbind usbhid (where the platform has such a thing)
+		libusb_set_auto_detach_kernel_driver(usb->dev, 1);
+	}
 
 	// This causes problems on re-attach.  Maybe need for OSX?
 	// On Linux it's completely happy without us explicitly setting a configuration.
@@ -174,6 +227,7 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 	}
 
 	uint8_t ino, eo, ei, iifc;
+	unsigned report;
 	libusb_device** list;
 	int count = libusb_get_device_list(usb_ctx, &list);
 	for (int n = 0; n < count; n++) {
@@ -203,7 +257,13 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 		if (libusb_get_active_config_descriptor(list[n], &cd) != 0) {
 			continue;
 		}
+		report = 0;
 		int r = get_vendor_bulk_ifc(cd, &iifc, &ino, &ei, &eo);
+		if ((r != 0) && (get_hid_ifc(cd, &ino, &ei, &eo, &report) == 0)) {
+			// v1 identifies itself by product string
+			iifc = dd.iProduct;
+			r = 0;
+		}
 		libusb_free_config_descriptor(cd);
 		if (r != 0) {
 			continue;
@@ -243,7 +303,12 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 				continue;
 			}
 			// if we're wildcarding it, check interface
-			sprintf(path + len, ":%u.%u/interface", 1, 0);
+			// (or product, for HID) string
+			if (report) {
+				sprintf(path + len, "/product");
+			} else {
+				sprintf(path + len, ":%u.%u/interface", 1, 0);
+			}
 			if (read_sysfs(path, text, sizeof(text)) == 0) {
 				if (strstr(text, "CMSIS-DAP") == 0) {
 					continue;
@@ -256,7 +321,7 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 			iifc = 0;
 		}
 
-		if ((usb = usb_try_open(list[n], sn, isn, iifc, ino, ei, eo)) != NULL) {
+		if ((usb = usb_try_open(list[n], sn, isn, iifc, ino, ei, eo, report)) != NULL) {
 			break;
 		}
 	}
@@ -266,23 +331,86 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 	return usb;
 }
 
+usb_handle *usb_open_remote(const char* hostport) {
+	usb_handle *usb;
+	if ((usb = calloc(1, sizeof(usb_handle))) == NULL) {
+		return NULL;
+	}
+	if ((usb->fd = remote_connect(hostport)) < 0) {
+		free(usb);
+		return NULL;
+	}
+	return usb;
+}
+
 void usb_close(usb_handle *usb) {
-	libusb_close(usb->dev);
+	if (usb->fd >= 0) {
+		close(usb->fd);
+	} else {
+		libusb_close(usb->dev);
+	}
 	free(usb);
 }
 
 int usb_ctrl(usb_handle *usb, void *data,
 	uint8_t typ, uint8_t req, uint16_t val, uint16_t idx, uint16_t len) {
-	if (usb == NULL) {
+	if ((usb == NULL) || (usb->fd >= 0)) {
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
 	return libusb_control_transfer(usb->dev, typ, req, val, idx, data, len, 5000);
 }
 
+int usb_report_size(usb_handle *usb) {
+	return usb ? usb->report : 0;
+}
+
+// HID reports are always full size: read into a bounce
+// buffer and keep what the caller asked for
+static int usb_hid_read(usb_handle *usb, void *data, int len, unsigned timeout) {
+	uint8_t buf[HID_REPORT_MAX];
+	int xfer = 0;
+	int r = libusb_interrupt_transfer(usb->dev, usb->ei, buf, usb->report, &xfer, timeout);
+	if (r < 0) {
+		return r;
+	}
+	if (xfer > len) {
+		xfer = len;
+	}
+	memcpy(data, buf, xfer);
+	return xfer;
+}
+
+// and written zero padded
+static int usb_hid_write(usb_handle *usb, const void *data, int len) {
+	uint8_t buf[HID_REPORT_MAX];
+	int xfer = 0;
+	int r;
+	if (len > usb->report) {
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+	memcpy(buf, data, len);
+	memset(buf + len, 0, usb->report - len);
+	if (usb->eo == 0) {
+		// SET_REPORT(Output, id 0)
+		r = libusb_control_transfer(usb->dev, 0x21, 0x09, 0x0200, usb->ino,
+			buf, usb->report, 5000);
+	} else {
+		r = libusb_interrupt_transfer(usb->dev, usb->eo, buf, usb->report, &xfer, 5000);
+	}
+	return (r < 0) ? r : len;
+}
+
 int usb_read(usb_handle *usb, void *data, int len) {
 	if (usb == NULL) {
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
+	if (usb->fd >= 0) {
+		int r = remote_recv(usb->fd, data, len, 5000);
+		return (r < 0) ? LIBUSB_ERROR_IO : r;
+	}
+	if (usb->report) {
+		return usb_hid_read(usb, data, len, 5000);
+	}
 	int xfer = len;
 	int r = libusb_bulk_transfer(usb->dev, usb->ei, data, len, &xfer, 5000);
 	if (r < 0) {
@@ -295,6 +423,13 @@ int usb_read_forever(usb_handle *usb, void *data, int len) {
 	if (usb == NULL) {
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
+	if (usb->fd >= 0) {
+		int r = remote_recv(usb->fd, data, len, -1);
+		return (r < 0) ? LIBUSB_ERROR_IO : r;
+	}
+	if (usb->report) {
+		return usb_hid_read(usb, data, len, 0);
+	}
 	int xfer = len;
 	int r = libusb_bulk_transfer(usb->dev, usb->ei, data, len, &xfer, 0);
 	if (r < 0) {
@@ -307,6 +442,12 @@ int usb_write(usb_handle *usb, const void *data, int len) {
 	if (usb == NULL) {
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
+	if (usb->fd >= 0) {
+		return (remote_send(usb->fd, data, len) < 0) ? LIBUSB_ERROR_IO : len;
+	}
+	if (usb->report) {
+		return usb_hid_write(usb, data, len);
+	}
 	int xfer = len;
 	int r = libusb_bulk_transfer(usb->dev, usb->eo, (void*) data, len, &xfer, 5000);
 	if (r < 0) {
@@ -9,12 +9,19 @@
 typedef struct usb_handle usb_handle;
 
 /* simple usb api for devices with bulk in+out interfaces */
+/* (or HID interrupt endpoints, for CMSIS-DAP v1 probes) */
 
 usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn);
+
+/* a probe served by xdebug-server at "host[:port]" (see remote.h) */
+usb_handle *usb_open_remote(const char* hostport);
 void usb_close(usb_handle *usb);
 int usb_read(usb_handle *usb, void *data, int len);
 int usb_read_forever(usb_handle *usb, void *data, int len);
 int usb_write(usb_handle *usb, const void *data, int len);
 int usb_ctrl(usb_handle *usb, void *data,
 	uint8_t typ, uint8_t req, uint16_t val, uint16_t idx, uint16_t len);
+
+/* fixed report size of a HID probe, 0 otherwise */
+int usb_report_size(usb_handle *usb);
 #endif
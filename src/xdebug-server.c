@@ -0,0 +1,208 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Serve a local CMSIS-DAP probe to one remote xdebug at a time
+// (xdebug -remote host[:port]), see remote.h for the protocol.
+//
+// There is no authentication, so it listens on loopback only (reach
+// it with ssh -L) unless given -listen <addr>, or -listen any.
+//
+// To try it on one machine with lab-like latency:
+//   tc qdisc add dev lo root netem delay 500us
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "usb.h"
+#include "remote.h"
+#include "cmsis-dap-protocol.h"
+
+static unsigned probe_count = 1;
+static unsigned probe_size = 64;
+
+// large enough for any packet (DI_Max_Packet_Size is 16bit)
+static uint8_t probe_buf[REMOTE_MAX_FRAME];
+
+static int probe_info(usb_handle* usb, unsigned di, uint8_t* buf, unsigned max) {
+	buf[0] = DAP_Info;
+	buf[1] = di;
+	if (usb_write(usb, buf, 2) != 2) {
+		return -1;
+	}
+	int n = usb_read(usb, buf, max);
+	if ((n < 2) || (buf[0] != DAP_Info) || (buf[1] > (n - 2))) {
+		return -1;
+	}
+	return buf[1];
+}
+
+static void probe_limits(usb_handle* usb) {
+	uint8_t* buf = probe_buf;
+	probe_count = 1;
+	probe_size = 64;
+	if (probe_info(usb, DI_Max_Packet_Count, buf, sizeof(probe_buf)) == 1) {
+		probe_count = buf[2];
+	}
+	if (probe_info(usb, DI_Max_Packet_Size, buf, sizeof(probe_buf)) == 2) {
+		probe_size = buf[2] | (buf[3] << 8);
+	}
+	if (probe_count < 1) {
+		probe_count = 1;
+	}
+	if (probe_size < 64) {
+		probe_size = 64;
+	}
+	// v1 (HID) probes move one fixed size report per packet
+	if (usb_report_size(usb) && (probe_size > usb_report_size(usb))) {
+		probe_size = usb_report_size(usb);
+	}
+	fprintf(stderr, "probe: %u packets of %u bytes\n", probe_count, probe_size);
+}
+
+// read and drop the responses to requests still in the probe, so
+// the next client finds it idle
+static int drain(usb_handle* usb, unsigned inflight) {
+	while (inflight-- > 0) {
+		if (usb_read(usb, probe_buf, probe_size) < 1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#define INFO_OTHER 0
+#define INFO_COUNT 1 // request was DAP_Info(DI_Max_Packet_Count)
+#define INFO_SIZE 2  // request was DAP_Info(DI_Max_Packet_Size)
+
+// Forward requests as they arrive, keeping up to probe_count of
+// them in the probe, and return responses in order.  Returns 0
+// when the client goes away (once the probe is drained), < 0 if
+// the probe does.
+static int serve(int fd, usb_handle* usb) {
+	uint8_t buf[REMOTE_MAX_FRAME];
+	uint8_t kind[256];
+	unsigned head = 0, tail = 0;
+	unsigned inflight = 0;
+
+	for (;;) {
+		// take requests while the probe has room, blocking
+		// for one only when there is nothing else to do
+		while (inflight < probe_count) {
+			struct pollfd pfd = {
+				.fd = fd,
+				.events = POLLIN,
+			};
+			if (inflight && (poll(&pfd, 1, 0) != 1)) {
+				break;
+			}
+			int n = remote_recv(fd, buf, sizeof(buf), -1);
+			if (n < 1) {
+				return drain(usb, inflight);
+			}
+			if (usb_write(usb, buf, n) != n) {
+				return -1;
+			}
+			kind[head++ & 255] = ((n < 2) || (buf[0] != DAP_Info)) ? INFO_OTHER :
+				(buf[1] == DI_Max_Packet_Count) ? INFO_COUNT :
+				(buf[1] == DI_Max_Packet_Size) ? INFO_SIZE : INFO_OTHER;
+			inflight++;
+		}
+
+		int n = usb_read(usb, buf, probe_size);
+		if (n < 1) {
+			return -1;
+		}
+		inflight--;
+		// let the client queue deeper than the probe does: we
+		// hold the excess here, a network round trip away from
+		// it rather than the probe
+		unsigned k = kind[tail++ & 255];
+		if ((k == INFO_COUNT) && (n >= 3) && (buf[1] == 1) &&
+			(buf[2] < REMOTE_PACKET_COUNT)) {
+			buf[2] = REMOTE_PACKET_COUNT;
+		}
+		// but packets no larger than we read from the probe
+		if ((k == INFO_SIZE) && (n >= 4) && (buf[1] == 2) &&
+			((buf[2] | (buf[3] << 8)) > probe_size)) {
+			buf[2] = probe_size;
+			buf[3] = probe_size >> 8;
+		}
+		if (remote_send(fd, buf, n) < 0) {
+			return drain(usb, inflight);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* addr = REMOTE_DEFAULT_ADDR;
+	const char* port = REMOTE_DEFAULT_PORT;
+	const char* sn = NULL;
+	unsigned vid = 0, pid = 0;
+	usb_handle* usb = NULL;
+	int lfd;
+
+	for (int n = 1; n < argc; n++) {
+		if (!strcmp(argv[n], "-port") && ((n + 1) < argc)) {
+			port = argv[++n];
+		} else if (!strcmp(argv[n], "-listen") && ((n + 1) < argc)) {
+			addr = argv[++n];
+			if (!strcmp(addr, "any")) {
+				addr = NULL;
+			}
+		} else if (!strcmp(argv[n], "-usb") && ((n + 1) < argc)) {
+			char* x = strchr(argv[++n], ':');
+			if (x == NULL) {
+				fprintf(stderr, "option -usb requires vid:pid\n");
+				return -1;
+			}
+			vid = strtoul(argv[n], 0, 16);
+			pid = strtoul(x + 1, 0, 16);
+		} else if (!strcmp(argv[n], "-sn") && ((n + 1) < argc)) {
+			sn = argv[++n];
+		} else {
+			fprintf(stderr, "usage: xdebug-server [ -listen <addr>|any ] "
+				"[ -port <port> ] [ -usb <vid>:<pid> ] [ -sn <serialno> ]\n");
+			return -1;
+		}
+	}
+
+	if ((lfd = remote_listen(addr, port)) < 0) {
+		fprintf(stderr, "cannot listen on %s port %s\n", addr ? addr : "any", port);
+		return -1;
+	}
+	fprintf(stderr, "listening on %s port %s\n", addr ? addr : "any", port);
+	if (addr == NULL) {
+		fprintf(stderr, "warning: the server has no authentication, "
+			"anyone who can reach it can drive the probe\n");
+	}
+
+	for (;;) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		if (usb == NULL) {
+			if ((usb = usb_open(vid, pid, sn)) == NULL) {
+				fprintf(stderr, "no probe\n");
+				close(fd);
+				continue;
+			}
+			probe_limits(usb);
+		}
+		fprintf(stderr, "client connected\n");
+		if (serve(fd, usb) < 0) {
+			fprintf(stderr, "probe lost\n");
+			usb_close(usb);
+			usb = NULL;
+		}
+		fprintf(stderr, "client disconnected\n");
+		close(fd);
+	}
+	return 0;
+}
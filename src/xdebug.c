@@ -271,6 +271,13 @@ int main(int argc, char** argv) {
 				return -1;
 			}
 			dc_require_serialno(argv[n]);
+		} else if (!strcmp(argv[n], "-remote")) {
+			n++;
+			if (n == argc) {
+				fprintf(stderr, "option -remote requires host[:port]\n");
+				return -1;
+			}
+			dc_require_remote(argv[n]);
 		} else {
 			fprintf(stderr, "unknown option '%s'\n", argv[n]);
 			return -1;
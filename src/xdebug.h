@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 void MSG(uint32_t flags, const char* fmt, ...)
 	__attribute__ ((format (printf, 2, 3)));
@@ -31,6 +32,21 @@ int cmd_arg_u32_opt(CC* cc, unsigned nth, uint32_t* out, uint32_t val);
 int cmd_arg_str(CC* cc, unsigned nth, const char** out);
 int cmd_arg_str_opt(CC* cc, unsigned nth, const char** out, const char* str);
 
+void *load_file(const char *fn, size_t *sz);
+long long now(void);
+
+// agent binaries linked into the debugger (gen/builtins.c)
+void *get_builtin_file(const char *name, size_t *sz);
+const char *get_builtin_filename(unsigned n);
+
 typedef struct debug_context DC;
 void debugger_command(DC* dc, CC* cc);
 void debugger_exit(void);
+
+// raise the swd clock for a faster core clock, or return to normal
+void swd_clock_boost(DC* dc, uint32_t core_hz);
+void swd_clock_restore(DC* dc);
+
+// read len bytes (a multiple of 4) via the flash agent's packer,
+// which resets the target to install the agent
+int agent_upload(DC* dc, uint32_t addr, uint32_t len, void* data);
@@ -0,0 +1,86 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Emit gen/builtins.c: agent binaries named on the command line are
+// embedded under their basenames for get_builtin_file().
+
+static unsigned char *load(const char *fn, size_t *sz) {
+	unsigned char *data = NULL;
+	size_t max = 0, len = 0, n;
+	FILE *fp;
+
+	if ((fp = fopen(fn, "rb")) == NULL) {
+		return NULL;
+	}
+	for (;;) {
+		if (len == max) {
+			max = max ? max * 2 : 4096;
+			if ((data = realloc(data, max)) == NULL) {
+				break;
+			}
+		}
+		if ((n = fread(data + len, 1, max - len, fp)) == 0) {
+			break;
+		}
+		len += n;
+	}
+	fclose(fp);
+	*sz = len;
+	return data;
+}
+
+static const char *tail =
+	"};\n"
+	"\n"
+	"void *get_builtin_file(const char *name, size_t *sz) {\n"
+	"\tint n;\n"
+	"\tfor (n = 0; n < (sizeof(files)/sizeof(files[0])); n++) {\n"
+	"\t\tif (!strcmp(name, files[n].name)) {\n"
+	"\t\t\t*sz = files[n].size;\n"
+	"\t\t\treturn files[n].data;\n"
+	"\t\t}\n"
+	"\t}\n"
+	"\treturn NULL;\n"
+	"}\n"
+	"\n"
+	"const char *get_builtin_filename(unsigned n) {\n"
+	"\tif (n >= (sizeof(files)/sizeof(files[0]))) {\n"
+	"\t\treturn NULL;\n"
+	"\t}\n"
+	"\treturn files[n].name;\n"
+	"}\n";
+
+int main(int argc, char **argv) {
+	printf("/* this file is machine-generated by mkbuiltins -- do not modify */\n\n"
+		"#include <string.h>\n"
+		"#include <stdint.h>\n\n"
+		"static struct {\n"
+		"\tconst char *name;\n"
+		"\tsize_t size;\n"
+		"\tvoid *data;\n"
+		"} files[] = {\n");
+	for (int n = 1; n < argc; n++) {
+		const char *name = strrchr(argv[n], '/');
+		unsigned char *data;
+		size_t sz;
+
+		name = name ? name + 1 : argv[n];
+		if ((data = load(argv[n], &sz)) == NULL) {
+			fprintf(stderr, "mkbuiltins: cannot read '%s'\n", argv[n]);
+			return -1;
+		}
+		printf("\t{ \"%s\", %zu,\n", name, sz);
+		for (size_t i = 0; i < sz; i++) {
+			printf("%s\\x%02X%s", (i & 15) ? "" : "\t\"", data[i],
+				(((i & 15) == 15) || (i == (sz - 1))) ? "\"\n" : "");
+		}
+		printf("\t},\n");
+		free(data);
+	}
+	printf("%s", tail);
+	return 0;
+}